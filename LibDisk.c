@@ -2,17 +2,106 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "LibDisk.h"
 
 typedef struct sector {
   char data[SECTOR_SIZE];
 } sector_t;
 
-// used to see what happened w/ disk ops
-int diskErrno; 
+// used to see what happened w/ disk ops (each thread has its own)
+__thread int diskErrno; 
 
-// the disk in memory (static makes it private to the file)
-static sector_t* disk;
+#define SECTOR_LOCKS 64
+
+// the state of a disk; a process can use several disks, each with its
+// own image file (see Disk_New()), and a thread works on the disk it
+// chose last with Disk_Use()
+struct _disk {
+  // the disk in memory
+  sector_t* sectors;
+
+  // the backend in use; with DISK_FILE, once the disk has been loaded
+  // from (or saved to) a file, sectors are read and written in place in
+  // that file through disk_fd, and the memory copy is no longer used
+  int backend;
+  int disk_fd;
+  char disk_fname[1024];
+
+  // with the memory backend, the sectors changed since the disk was
+  // loaded from (or saved to) 'image_fname' are marked dirty, so that
+  // only those need to be written back to that file; a sector is
+  // copied in or out of memory with its stripe lock held, so that a
+  // flush running in another thread never writes half of a change
+  pthread_mutex_t sector_locks[SECTOR_LOCKS];
+  unsigned char dirty[TOTAL_SECTORS];
+  int dirty_count;
+  int image_fd;
+  char image_fname[1024];
+
+  // with the read-only backend, 'sectors' is a private mapping of the
+  // image file 'image_fname': the sectors are read straight from the
+  // page cache, shared with whoever else maps the file, and a sector
+  // written is copied in memory only, so nothing is ever dirty
+  int disk_mapped;
+
+  // set while the disk holds only what was written since Disk_Init()
+  // (all the other sectors are zeroes, and none has been loaded)
+  int disk_fresh;
+};
+
+// the disk used by threads that haven't chosen one (its locks are set
+// up by the first Disk_Init()), and the disk of the calling thread
+static disk_t default_disk = { .backend = DISK_MEMORY, .disk_fd = -1, .image_fd = -1 };
+static pthread_once_t sector_locks_once = PTHREAD_ONCE_INIT;
+static __thread disk_t* disk = &default_disk;
+
+// most sectors written back by Disk_Flush() with a single write
+#define FLUSH_RUN 16
+
+static void sector_locks_init()
+{
+  for(int i=0; i<SECTOR_LOCKS; i++) pthread_mutex_init(&default_disk.sector_locks[i], NULL);
+}
+
+// from now on, 'file' holds the same content as the memory copy;
+// return 0 if successful, -1 otherwise
+static int image_attach(char* file)
+{
+  if(disk->image_fd >= 0) close(disk->image_fd);
+  disk->image_fd = open(file, O_WRONLY);
+  if(disk->image_fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  strncpy(disk->image_fname, file, sizeof(disk->image_fname)-1);
+  disk->image_fname[sizeof(disk->image_fname)-1] = '\0';
+  return 0;
+}
+
+// start using 'file' in place as the disk; return 0 if successful, -1
+// otherwise
+static int disk_attach(char* file)
+{
+  int fd = open(file, O_RDWR);
+  if(fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size != (off_t)TOTAL_SECTORS*sizeof(sector_t)) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+  disk->disk_fd = fd;
+  strncpy(disk->disk_fname, file, sizeof(disk->disk_fname)-1);
+  disk->disk_fname[sizeof(disk->disk_fname)-1] = '\0';
+  return 0;
+}
 
 // used for statistics
 // static int lastSector = 0;
@@ -28,15 +117,86 @@ static sector_t* disk;
  */
 int Disk_Init()
 {
+  pthread_once(&sector_locks_once, sector_locks_init);
+
+  // let go of the file of a previous disk
+  if(disk->disk_fd >= 0) {
+    close(disk->disk_fd);
+    disk->disk_fd = -1;
+  }
+  if(disk->image_fd >= 0) {
+    close(disk->image_fd);
+    disk->image_fd = -1;
+  }
+
   // create the disk image and fill every sector with zeroes
-  disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
-  if(disk == NULL) {
+  if(disk->disk_mapped) munmap(disk->sectors, TOTAL_SECTORS*sizeof(sector_t));
+  else free(disk->sectors);
+  disk->disk_mapped = 0;
+  disk->sectors = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
+  if(disk->sectors == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+  memset(disk->dirty, 0, sizeof(disk->dirty));
+  disk->dirty_count = 0;
+  disk->disk_fresh = 1;
   return 0;
 }
 
+/*
+ * Disk_New
+ *
+ * Creates a disk of its own, with no sectors yet: once chosen with
+ * Disk_Use(), it's set up with Disk_Init() like the default disk.
+ * Returns NULL if out of memory.
+ */
+disk_t* Disk_New()
+{
+  disk_t* d = (disk_t*)calloc(1, sizeof(disk_t));
+  if (d == NULL) {
+    diskErrno = E_MEM_OP;
+    return NULL;
+  }
+  d->backend = DISK_MEMORY;
+  d->disk_fd = d->image_fd = -1;
+  for (int i = 0; i < SECTOR_LOCKS; i++) pthread_mutex_init(&d->sector_locks[i], NULL);
+  return d;
+}
+
+/*
+ * Disk_Free
+ *
+ * Lets go of a disk made by Disk_New(), its memory and its files; no
+ * thread may use it any more (the calling thread goes back to the
+ * default disk if it did).
+ */
+void Disk_Free(disk_t* d)
+{
+  if (d == NULL || d == &default_disk) return;
+  if (disk == d) disk = &default_disk;
+  if (d->disk_fd >= 0) close(d->disk_fd);
+  if (d->image_fd >= 0) close(d->image_fd);
+  if (d->disk_mapped) munmap(d->sectors, TOTAL_SECTORS*sizeof(sector_t));
+  else free(d->sectors);
+  for (int i = 0; i < SECTOR_LOCKS; i++) pthread_mutex_destroy(&d->sector_locks[i]);
+  free(d);
+}
+
+/*
+ * Disk_Use
+ *
+ * Makes the calling thread work on disk 'd' from now on, or on the
+ * default disk if 'd' is NULL. Returns the disk it worked on before
+ * (NULL for the default disk).
+ */
+disk_t* Disk_Use(disk_t* d)
+{
+  disk_t* prev = disk;
+  disk = d ? d : &default_disk;
+  return (prev == &default_disk) ? NULL : prev;
+}
+
 /*
  * Disk_Save
  *
@@ -52,15 +212,56 @@ int Disk_Save(char* file)
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
+
+  // a file used in place only needs to reach stable storage, and the
+  // file the disk came from only needs the sectors changed since
+  if ((disk->disk_fd >= 0 && !strcmp(file, disk->disk_fname)) ||
+      (disk->image_fd >= 0 && !strcmp(file, disk->image_fname)))
+    return (Disk_Flush(0, TOTAL_SECTORS) < 0) ? -1 : 0;
+  // and a mapped file is never written
+  if (disk->disk_mapped && !strcmp(file, disk->image_fname)) return 0;
+
+  // a fresh disk is saved as a file of the right size with only the
+  // sectors written so far; the rest of the file is a hole, which
+  // reads as zeroes, so this costs the same however large the disk
+  if (disk->disk_fresh && disk->disk_fd < 0 && !disk->disk_mapped) {
+    int fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+      diskErrno = E_OPENING_FILE;
+      return -1;
+    }
+    if (ftruncate(fd, (off_t)TOTAL_SECTORS*sizeof(sector_t)) < 0) {
+      close(fd);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    close(fd);
+    if (image_attach(file) < 0 || Disk_Flush(0, TOTAL_SECTORS) < 0) return -1;
+    disk->disk_fresh = 0;
+    return (disk->backend == DISK_FILE) ? disk_attach(file) : 0;
+  }
+
+  // saving elsewhere first brings the memory copy up to date
+  if (disk->disk_fd >= 0 &&
+      pread(disk->disk_fd, disk->sectors, TOTAL_SECTORS*sizeof(sector_t), 0) != TOTAL_SECTORS*sizeof(sector_t)) {
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
     
   // open the diskFile
   if ((diskFile = fopen(file, "w")) == NULL) {
     diskErrno = E_OPENING_FILE;
     return -1;
   }
+
+  // whatever changes from now on is dirty again
+  for (int i = 0; i < TOTAL_SECTORS; i++) {
+    if (__atomic_exchange_n(&disk->dirty[i], 0, __ATOMIC_RELAXED))
+      __atomic_fetch_sub(&disk->dirty_count, 1, __ATOMIC_RELAXED);
+  }
     
   // actually write the disk image to a file
-  if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  if ((fwrite(disk->sectors, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
     fclose(diskFile);
     diskErrno = E_WRITING_FILE;
     return -1;
@@ -68,6 +269,38 @@ int Disk_Save(char* file)
     
   // clean up and return
   fclose(diskFile);
+
+  // with the file backend, a new image is used in place from now on
+  if (disk->backend == DISK_FILE && disk->disk_fd < 0)
+    return disk_attach(file);
+  if (disk->disk_fd < 0 && !disk->disk_mapped)
+    return image_attach(file);
+  return 0;
+}
+
+// map 'file' privately as the disk; return 0 if successful, -1
+// otherwise
+static int disk_map(char* file)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size == (off_t)TOTAL_SECTORS*sizeof(sector_t))
+    map = mmap(NULL, TOTAL_SECTORS*sizeof(sector_t), PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+  free(disk->sectors);
+  disk->sectors = (sector_t*)map;
+  disk->disk_mapped = 1;
+  strncpy(disk->image_fname, file, sizeof(disk->image_fname)-1);
+  disk->image_fname[sizeof(disk->image_fname)-1] = '\0';
   return 0;
 }
 
@@ -86,15 +319,32 @@ int Disk_Load(char* file)
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
+
+  // with the file backend, nothing is loaded; the file is used in place
+  if (disk->backend == DISK_FILE) {
+    if (disk->disk_fd >= 0) {
+      close(disk->disk_fd);
+      disk->disk_fd = -1;
+    }
+    return disk_attach(file);
+  }
+  if (disk->backend == DISK_READONLY) return disk_map(file);
     
-  // open the diskFile
+  // open the diskFile, which must be the size of the disk
   if ((diskFile = fopen(file, "r")) == NULL) {
     diskErrno = E_OPENING_FILE;
     return -1;
   }
+  struct stat st;
+  if (fstat(fileno(diskFile), &st) < 0 || st.st_size != (off_t)TOTAL_SECTORS*sizeof(sector_t)) {
+    fclose(diskFile);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
     
   // actually read the disk image into memory
-  if ((fread(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  disk->disk_fresh = 0;
+  if ((fread(disk->sectors, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
     fclose(diskFile);
     diskErrno = E_READING_FILE;
     return -1;
@@ -102,7 +352,9 @@ int Disk_Load(char* file)
     
   // clean up and return
   fclose(diskFile);
-  return 0;
+  for (int i = 0; i < TOTAL_SECTORS; i++) disk->dirty[i] = 0;
+  disk->dirty_count = 0;
+  return image_attach(file);
 }
 
 /*
@@ -119,8 +371,17 @@ int Disk_Read(int sector, char* buffer)
     return -1;
   }
     
+  // read the sector in place from the file backend
+  if(disk->disk_fd >= 0) {
+    if(pread(disk->disk_fd, buffer, sizeof(sector_t), (off_t)sector*sizeof(sector_t)) != sizeof(sector_t)) {
+      diskErrno = E_READING_FILE;
+      return -1;
+    }
+    return 0;
+  }
+
   // copy the memory for the user
-  if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(sector_t))) == NULL) {
+  if((memcpy((void*)buffer, (void*)(disk->sectors + sector), sizeof(sector_t))) == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
@@ -141,10 +402,175 @@ int Disk_Write(int sector, char* buffer)
     return -1;
   }
     
+  // write the sector in place to the file backend
+  if(disk->disk_fd >= 0) {
+    if(pwrite(disk->disk_fd, buffer, sizeof(sector_t), (off_t)sector*sizeof(sector_t)) != sizeof(sector_t)) {
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    return 0;
+  }
+
   // copy the memory for the user
-  if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(sector_t))) == NULL) {
-    diskErrno = E_MEM_OP;
+  pthread_mutex_lock(&disk->sector_locks[sector%SECTOR_LOCKS]);
+  memcpy((void*)(disk->sectors + sector), (void*)buffer, sizeof(sector_t));
+  if(!disk->disk_mapped && !__atomic_exchange_n(&disk->dirty[sector], 1, __ATOMIC_RELAXED))
+    __atomic_fetch_add(&disk->dirty_count, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&disk->sector_locks[sector%SECTOR_LOCKS]);
+  return 0;
+}
+
+/*
+ * Disk_SetBackend
+ *
+ * Chooses how the disk image is kept (DISK_MEMORY, DISK_FILE or
+ * DISK_READONLY); this takes effect with the next Disk_Load() or
+ * Disk_Save().
+ */
+int Disk_SetBackend(int b)
+{
+  if (b != DISK_MEMORY && b != DISK_FILE && b != DISK_READONLY) {
+    diskErrno = E_INVALID_PARAM;
     return -1;
   }
+  disk->backend = b;
   return 0;
 }
+
+/*
+ * Disk_Take
+ *
+ * Copies a dirty sector of the memory copy into 'buffer' and marks it
+ * clean, for a caller that writes it back to the file itself (see
+ * Disk_Put); a change made afterwards marks the sector dirty again.
+ * Returns 1 if the sector was dirty, 0 if not (always with the file
+ * backend), -1 on error.
+ */
+int Disk_Take(int sector, char* buffer)
+{
+  if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (disk->disk_fd >= 0 || !__atomic_load_n(&disk->dirty[sector], __ATOMIC_RELAXED)) return 0;
+  pthread_mutex_lock(&disk->sector_locks[sector%SECTOR_LOCKS]);
+  int was_dirty = __atomic_exchange_n(&disk->dirty[sector], 0, __ATOMIC_RELAXED);
+  if (was_dirty) {
+    memcpy(buffer, disk->sectors + sector, sizeof(sector_t));
+    __atomic_fetch_sub(&disk->dirty_count, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&disk->sector_locks[sector%SECTOR_LOCKS]);
+  return was_dirty;
+}
+
+/*
+ * Disk_Put
+ *
+ * Writes a buffer straight to a sector of the file the disk was loaded
+ * from or last saved to, leaving the memory copy alone (with the file
+ * backend, the two are the same). Disk_Sync() makes it reach stable
+ * storage.
+ */
+int Disk_Put(int sector, char* buffer)
+{
+  return Disk_PutRun(sector, 1, buffer);
+}
+
+/*
+ * Disk_PutRun
+ *
+ * Same as Disk_Put(), for 'count' consecutive sectors starting at
+ * 'sector', written from 'buffer' with a single write.
+ */
+int Disk_PutRun(int sector, int count, char* buffer)
+{
+  if ((sector < 0) || (count <= 0) || (sector+count > TOTAL_SECTORS) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  int fd = (disk->disk_fd >= 0) ? disk->disk_fd : disk->image_fd;
+  if (fd < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  size_t len = (size_t)count*sizeof(sector_t);
+  if (pwrite(fd, buffer, len, (off_t)sector*sizeof(sector_t)) != len) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Disk_Sync
+ *
+ * Makes everything written to the file so far reach stable storage.
+ */
+int Disk_Sync()
+{
+  if (disk->disk_mapped) return 0;
+  int fd = (disk->disk_fd >= 0) ? disk->disk_fd : disk->image_fd;
+  if (fd < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (fsync(fd) < 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Disk_Flush
+ *
+ * Writes the dirty sectors from 'first' up to (not including) 'last'
+ * back to the file the disk was loaded from or last saved to, and
+ * makes them reach stable storage; the sectors are not written in any
+ * particular order, so a caller that needs some sectors to land
+ * before others flushes them first. With the file backend, sectors
+ * are already written in place and only need to reach stable storage.
+ * Returns the number of sectors written, -1 on error.
+ */
+int Disk_Flush(int first, int last)
+{
+  if (first < 0 || last > TOTAL_SECTORS || first > last) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if (disk->disk_fd >= 0) return (Disk_Sync() < 0) ? -1 : 0;
+
+  // consecutive dirty sectors go out with a single write
+  int n = 0, len = 0, start = 0;
+  sector_t run[FLUSH_RUN];
+  for (int i = first; i <= last; i++) {
+    int r = (i < last) ? Disk_Take(i, run[len].data) : 0;
+    if (r > 0 && len++ == 0) start = i;
+    if (len == 0 || (r > 0 && len < FLUSH_RUN)) continue;
+    if (Disk_PutRun(start, len, run[0].data) < 0) {
+      // the sectors still need to be written, unless changed meanwhile
+      for (int j = start; j < start+len; j++) {
+        pthread_mutex_lock(&disk->sector_locks[j%SECTOR_LOCKS]);
+        if (!__atomic_exchange_n(&disk->dirty[j], 1, __ATOMIC_RELAXED))
+          __atomic_fetch_add(&disk->dirty_count, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&disk->sector_locks[j%SECTOR_LOCKS]);
+      }
+      return -1;
+    }
+    n += len;
+    len = 0;
+  }
+  if (n > 0 && Disk_Sync() < 0) return -1;
+  return n;
+}
+
+/*
+ * Disk_Dirty
+ *
+ * Returns the number of sectors changed since they were last written
+ * back to the file (always 0 with the file backend).
+ */
+int Disk_Dirty()
+{
+  return __atomic_load_n(&disk->dirty_count, __ATOMIC_RELAXED);
+}
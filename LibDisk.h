@@ -26,12 +26,37 @@ typedef enum {
   E_READING_FILE,
 } Disk_Error_t;
 
-extern int diskErrno; // used to see what happened w/ disk ops
+extern __thread int diskErrno; // used to see what happened w/ disk ops (per thread)
+
+// disk backends: by default the whole disk image is kept in memory,
+// loaded and saved at once; with the file backend the image file is
+// read and written in place, one sector at a time; with the read-only
+// backend the image file is mapped into memory and never written, and
+// whatever is written to the disk stays in memory
+typedef enum {
+  DISK_MEMORY,
+  DISK_FILE,
+  DISK_READONLY,
+} Disk_Backend_t;
 
 int Disk_Init();
 int Disk_Save(char* file);
 int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
+int Disk_SetBackend(int backend);
+int Disk_Flush(int first, int last);
+int Disk_Dirty();
+int Disk_Take(int sector, char* buffer);
+int Disk_Put(int sector, char* buffer);
+int Disk_PutRun(int sector, int count, char* buffer);
+int Disk_Sync();
+
+// several disks can be used at once: each thread works on the default
+// disk until it chooses another one with Disk_Use()
+typedef struct _disk disk_t;
+disk_t* Disk_New();
+void Disk_Free(disk_t* d);
+disk_t* Disk_Use(disk_t* d);
 
 #endif // __Disk_H__
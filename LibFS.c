@@ -5,16 +5,26 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <malloc.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "LibDisk.h"
 #include "LibFS.h"
  
-// set to 1 to have detailed debug print-outs and 0 to have none
+// set to 1 to have detailed debug print-outs and 0 to have none (can
+// be overridden when compiling, with -DFSDEBUG=0)
+#ifndef FSDEBUG
 #define FSDEBUG 1
+#endif
  
 #if FSDEBUG
 #define dprintf printf
+#define cprintf printf
 #else
 #define dprintf noprintf
+#define cprintf noprintf
 void noprintf(char* str, ...) {}
 #endif
  
@@ -26,6 +36,47 @@ void noprintf(char* str, ...) {}
  
 // the magic number chosen for our file system
 #define OS_MAGIC 0xdeadbeef
+
+// the sector reference count table has one byte for each sector of the
+// disk, counting the extra references to a sector shared by cloned
+// files (0 means the sector has a single owner); the table is only
+// allocated from the data blocks the first time a file is cloned
+#define REFCOUNT_TABLE_SECTORS ((TOTAL_SECTORS+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define MAX_REFCOUNT 255
+
+// the superblock starts with the magic number; the rest of it records
+// where optional on-disk structures live (zero if not present)
+typedef struct _superblock {
+  int magic; // OS_MAGIC
+  int refcount_table[REFCOUNT_TABLE_SECTORS]; // sectors of the reference count table
+  int journal; // first sector of the metadata journal
+  int imap;    // first sector of the inode map (log-structured layout only)
+  int itable_hwm; // inode table sectors initialized so far (0 if all of them)
+} superblock_t;
+
+// the metadata journal is a run of sectors allocated from the data
+// blocks when the file system is first booted: a header sector, the
+// sector numbers of the sectors logged (the tags), and the content of
+// those sectors; the header is written last, and a header with the
+// right magic number and checksum means the rest of the transaction
+// is on disk as well
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_CAPACITY 256 // most sectors logged by a commit
+#define JOURNAL_TAG_SECTORS ((JOURNAL_CAPACITY*sizeof(int)+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define JOURNAL_SECTORS (1+JOURNAL_TAG_SECTORS+JOURNAL_CAPACITY)
+
+typedef struct _journal_header {
+  int magic;         // JOURNAL_MAGIC if a transaction is committed
+  int seq;           // incremented with each commit
+  int count;         // number of sectors logged
+  unsigned checksum; // of the sequence number, tags and logged sectors
+} journal_header_t;
+
+// in the log-structured layout (see FS_BootLog()), the sectors of the
+// inode table move around the disk like the data, and the inode map,
+// a run of sectors allocated when the file system switches to that
+// layout, records where each of them currently lives
+#define IMAP_SECTORS ((INODE_TABLE_SECTORS*sizeof(int)+SECTOR_SIZE-1)/SECTOR_SIZE)
  
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
@@ -82,8 +133,13 @@ typedef struct _inode {
 // max length of a filename is 16 bytes (including the ending null)
 #define MAX_NAME 16
  
-// max number of open files is 256
+// the file descriptor table starts with room for 256 open files and
+// grows as needed, up to 65536
 #define MAX_OPEN_FILES 256
+#define MAX_OPEN_FILES_LIMIT 65536
+
+// directory handles open at once (see Dir_OpenHandle())
+#define MAX_DIR_HANDLES 256
  
 // each directory entry represents a file/directory in the parent
 // directory, and consists of a file/directory name (less than 16
@@ -96,11 +152,227 @@ typedef struct _dirent {
 // the number of directory entries that can be contained in a sector
 #define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))
  
-// global errno value here
-int osErrno;
- 
-// the name of the disk backstore file (with which the file system is booted)
-static char bs_filename[1024];
+// errno value here, one for each thread
+__thread int osErrno;
+ 
+// a bitmap is kept in memory as 64-bit words (see bitmap_alloc())
+typedef struct _bitmap {
+  int start;       // first sector of the bitmap on disk
+  int num;         // number of sectors of the bitmap on disk
+  int nbits;       // number of bits in use
+  int nwords;      // number of words in memory
+  uint64_t* words; // the bits; bit i is bit i%64 of words[i/64]
+  int dirty;       // changed since written to disk
+} bitmap_t;
+
+#define BITMAP_WORDS(nbits) (((nbits)+63)/64)
+#define RECLAIM_LIST_SIZE 256 // sectors queued before they're reclaimed
+#define LOG_SEGMENT 64 // sectors in a segment of the log
+#define OPEN_FILE_CHUNKS (MAX_OPEN_FILES_LIMIT/MAX_OPEN_FILES)
+
+// everything the library knows about a booted file system: there is
+// the default one, booted with FS_Boot() and the like, and any number
+// mounted with FS_Mount(); each thread works on one of them at a time
+// (see fs_enter()), and each has a disk of its own
+struct _fs {
+  disk_t* disk; // its disk (NULL for the default disk)
+
+  // the name of the disk backstore file (with which the file system is booted)
+  char bs_filename[1024];
+  int fs_readonly; // booted read-only: nothing may change then
+
+  // the locks, taken in the order given below
+  pthread_mutex_t flush_lock; // writing back to the backstore
+  pthread_rwlock_t rename_lock; // directories moving (write) or going away (read)
+  pthread_rwlock_t inode_locks[MAX_FILES]; // contents of a file or directory
+  pthread_mutex_t open_lock; // open file table
+  pthread_mutex_t refcount_lock; // reference count table
+  pthread_mutex_t reclaim_lock; // reclaim list
+  pthread_mutex_t itable_locks[INODE_TABLE_SECTORS]; // inode table sectors
+  pthread_mutex_t super_lock; // superblock
+  pthread_mutex_t log_lock; // head of the log
+
+  // the metadata sectors (see meta_write())
+  unsigned char meta_sectors[TOTAL_SECTORS]; // the sector holds metadata
+  unsigned char meta_dirty[TOTAL_SECTORS];   // changed since the last commit
+  int meta_dirty_count;
+
+  // the bitmaps
+  uint64_t inode_bitmap_words[BITMAP_WORDS(MAX_FILES)];
+  uint64_t sector_bitmap_words[BITMAP_WORDS(TOTAL_SECTORS)];
+  bitmap_t inode_bitmap;
+  bitmap_t sector_bitmap;
+
+  // sectors given up, not yet returned to the bitmap (see reclaim_flush())
+  int reclaim_list[RECLAIM_LIST_SIZE];
+  int reclaim_count;
+
+  // the log-structured layout (see log_alloc())
+  int imap_start; // first sector of the inode map (0 if not log-structured)
+  int imap[IMAP_SECTORS*SECTOR_SIZE/sizeof(int)]; // where each inode table sector lives
+  int imap_dirty; // the inode map has changed since written to disk
+  int log_head;   // segment at the head of the log (-1 until the first one)
+  int log_epoch;  // incremented by each commit
+  int sector_epoch[TOTAL_SECTORS]; // the epoch each sector was taken in
+  int dead_epoch[TOTAL_SECTORS];   // the epoch each sector was given up in (0 if not)
+  int log_dead;   // sectors given up and not returned to the bitmap yet
+  int log_spare;  // empty segments
+  int log_stuck;  // the cleaner found nothing worth cleaning last time
+  // the sectors the inode map and the inodes in use refer to, found by
+  // log_scan() with the flush lock held (or while booting)
+  unsigned char log_owned[TOTAL_SECTORS];
+  int clean_moved[TOTAL_SECTORS]; // the copy of each sector moved by the cleaner (0 if not)
+  int clean_copies[TOTAL_SECTORS];
+
+  // the reference count table, cached in memory once loaded; the table
+  // is used with 'refcount_lock' held
+  unsigned char* refcounts;
+  int refcount_sectors[REFCOUNT_TABLE_SECTORS]; // where the table lives on disk
+  char refcount_dirty[REFCOUNT_TABLE_SECTORS]; // table sectors not yet written
+
+  int itable_hwm; // inode table sectors initialized (see itable_read())
+
+  // the open file entry of each inode (NULL if the inode isn't open);
+  // inode numbers are small and dense, so they index the table directly
+  struct _open_inode* open_inodes[MAX_FILES];
+  // the file descriptor table (see new_file_fd())
+  struct _open_file* open_file_chunks[OPEN_FILE_CHUNKS];
+  int open_files_size;
+  int open_files_free;
+  // the open directories behind the directory handles
+  struct _open_inode* dir_handles[MAX_DIR_HANDLES];
+
+  // transactions (see txn_begin())
+  pthread_mutex_t txn_lock;
+  pthread_cond_t txn_cond;
+  int txn_active;     // operations running
+  int txn_reserved;   // journal room reserved by them
+  int txn_committing; // commits (or a check) waiting or taking their snapshot
+
+  int journal_start; // first sector of the journal (0 if none)
+  int journal_seq;   // sequence number of the last commit
+  // the transaction being committed, used with the flush lock held (or
+  // while booting)
+  int journal_tags[JOURNAL_TAG_SECTORS*SECTOR_SIZE/sizeof(int)];
+  char journal_data[JOURNAL_CAPACITY][SECTOR_SIZE];
+  char flush_run[LOG_SEGMENT][SECTOR_SIZE]; // consecutive sectors written at once
+
+  // the background flusher (see FS_FlushSetup())
+  pthread_mutex_t flusher_lock;
+  pthread_cond_t flusher_wake;
+  pthread_t flusher;
+  int flusher_running; // the flusher thread has been started
+  int flusher_stop;    // tells the flusher to exit
+  int flusher_poked;   // the dirty threshold has been reached
+  int flusher_interval, flusher_threshold;
+
+  // what the checker found (see FS_Check())
+  inode_t check_nodes[MAX_FILES];      // the inode table
+  dirent_t* check_dirents[MAX_FILES];  // the entries of each directory
+  char check_valid[MAX_FILES];   // the inode makes sense
+  char check_live[MAX_FILES];    // the inode is reached from the root (or open)
+  int check_bad[MAX_FILES];      // bad entries of each directory
+  char check_struct[TOTAL_SECTORS]; // the sector holds a structure of the file system
+  int check_uses[TOTAL_SECTORS];    // references to each sector
+  int check_queue[MAX_FILES];       // directories left to walk
+
+  // async ops (see FS_AioSetup())
+  pthread_mutex_t aio_lock;
+  pthread_cond_t aio_submitted; // a request is queued
+  pthread_cond_t aio_completed; // a request is done
+  fs_aio_t *sq_head, *sq_tail; // submission queue
+  fs_aio_t *cq_head, *cq_tail; // completion queue
+  int cq_count;      // number of requests on the completion queue
+  int aio_inflight;  // requests submitted and not done yet
+  int aio_depth;     // max number of requests in flight
+  int aio_nworkers;  // number of worker threads (0 if not set up)
+  pthread_t* aio_workers;
+  int aio_stop;      // tells the workers to exit once the queue is empty
+};
+
+// the default file system, and the one the calling thread works on
+static fs_t default_fs;
+static pthread_once_t default_fs_once = PTHREAD_ONCE_INIT;
+static __thread fs_t* fs = &default_fs;
+
+// set up the locks and the empty tables of file system 'f'
+static void fs_init(fs_t* f)
+{
+  pthread_mutex_init(&f->flush_lock, NULL);
+  pthread_rwlock_init(&f->rename_lock, NULL);
+  for(int i=0; i<MAX_FILES; i++) pthread_rwlock_init(&f->inode_locks[i], NULL);
+  pthread_mutex_init(&f->open_lock, NULL);
+  pthread_mutex_init(&f->refcount_lock, NULL);
+  pthread_mutex_init(&f->reclaim_lock, NULL);
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) pthread_mutex_init(&f->itable_locks[i], NULL);
+  pthread_mutex_init(&f->super_lock, NULL);
+  pthread_mutex_init(&f->log_lock, NULL);
+  pthread_mutex_init(&f->txn_lock, NULL);
+  pthread_cond_init(&f->txn_cond, NULL);
+  pthread_mutex_init(&f->flusher_lock, NULL);
+  pthread_cond_init(&f->flusher_wake, NULL);
+  pthread_mutex_init(&f->aio_lock, NULL);
+  pthread_cond_init(&f->aio_submitted, NULL);
+  pthread_cond_init(&f->aio_completed, NULL);
+
+  f->inode_bitmap = (bitmap_t){ INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS,
+    MAX_FILES, BITMAP_WORDS(MAX_FILES), f->inode_bitmap_words };
+  f->sector_bitmap = (bitmap_t){ SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+    TOTAL_SECTORS, BITMAP_WORDS(TOTAL_SECTORS), f->sector_bitmap_words };
+  f->open_files_free = -1;
+}
+
+static void default_fs_init()
+{
+  fs_init(&default_fs);
+}
+
+// make 'f' the file system (and its disk the disk) the calling thread
+// works on; return the one it worked on before
+static fs_t* fs_enter(fs_t* f)
+{
+  fs_t* prev = fs;
+  fs = f;
+  Disk_Use(f->disk);
+  return prev;
+}
+
+// return 0 if the file system may be changed, -1 (with osErrno set) if
+// it was booted read-only
+static int check_writable()
+{
+  if(!fs->fs_readonly) return 0;
+  dprintf("... error: file system is read-only\n");
+  osErrno = E_READ_ONLY;
+  return -1;
+}
+
+// the library can be called from several threads at once (but booting
+// must be done before, and a file descriptor or stream must not be
+// used by two threads at the same time, except by async requests,
+// which leave its read/write position alone); a thread takes the locks in
+// this order: the flush lock, the rename lock, the inode locks of
+// directories from the root down and then of a file, the open file
+// table, the reference count table, the reclaim list, an inode table
+// sector, the superblock, and last the head of the log (the bitmaps
+// need no lock); each file system has locks of its own (see struct
+// _fs)
+
+// lock modes for inode_lock() and follow_path()
+#define LOCK_NONE  0
+#define LOCK_READ  1
+#define LOCK_WRITE 2
+
+static void inode_lock(int inode, int mode)
+{
+  if(mode == LOCK_READ) pthread_rwlock_rdlock(&fs->inode_locks[inode]);
+  else if(mode == LOCK_WRITE) pthread_rwlock_wrlock(&fs->inode_locks[inode]);
+}
+
+static void inode_unlock(int inode)
+{
+  pthread_rwlock_unlock(&fs->inode_locks[inode]);
+}
  
 /* the following functions are internal helper functions */
 //find min
@@ -132,21 +404,18 @@ static void clear_bit(char *bitmap, int index)
 {
     ( bitmap[(index/CHARBITS)] &= ~(1UL << (index % CHARBITS)));
 }
+
  
-static int test_bit(char *bitmap, int index)
-{
-    return ( bitmap[(index/CHARBITS)] & (1UL << (index % CHARBITS))) > 0;
-}
- 
-void yellow(){printf("\033[0;33m");};
-void boldYellow(){printf("\033[1m\033[33m");};
-void blue(){printf("\033[0;34m");};
-void boldBlue(){printf("\033[1m\033[34m");};
-void green(){printf("\033[0;32m");};
-void boldGreen(){printf("\033[1m\033[32m");};
-void red(){printf("\033[0;31m");}
-void boldRed(){printf("\033[1m\033[31m");};
-void reset(){printf("\033[0m");};
+// colors for the debug print-outs
+void yellow(){cprintf("\033[0;33m");};
+void boldYellow(){cprintf("\033[1m\033[33m");};
+void blue(){cprintf("\033[0;34m");};
+void boldBlue(){cprintf("\033[1m\033[34m");};
+void green(){cprintf("\033[0;32m");};
+void boldGreen(){cprintf("\033[1m\033[32m");};
+void red(){cprintf("\033[0;31m");}
+void boldRed(){cprintf("\033[1m\033[31m");};
+void reset(){cprintf("\033[0m");};
 // initialize a bitmap with 'num' sectors starting from 'start'
 // sector; all bits should be set to zero except that the first
 // 'nbits' number of bits are set to one
@@ -247,329 +516,764 @@ static void bitmap_init(int start, int num, int nbits, int type)
   reset();
 }
  
-// set the first unused bit from a bitmap of 'nbits' bits (flip the
-// first zero appeared in the bitmap to one) and return its location;
-// return -1 if the bitmap is already full (no more zeros)
-static int bitmap_first_unused(int start, int num, int nbits)
+// the metadata sectors (the superblock, bitmaps and inode table, the
+// sectors of directories and of the reference count table, and the
+// journal) are known from the time they are first written or when
+// the file system is booted, since they're written back through the
+// journal, and the other sectors in place; a metadata sector is
+// changed with meta_write(), which notes it for the next commit
+
+static int log_fresh(int sector);
+
+// write a metadata sector to disk; return 0 if successful, -1 otherwise
+static int meta_write(int sector, char* buffer)
 {
-  /* YOUR CODE */
- 
-  green();
-  dprintf("bitmap_first_unused(%d, %d, %d)\n", start, num, nbits);
-  reset();
-  int numSec = num;
-  int found = 0;
-  int firstUnused = -1;
- 
-  //determine number of bytes needed to represent bitmap with nbits
-  int bmpARRLen = nbits;  
-  int currSec = start;
- 
-  //get number of bits represented by bmp
-  int bits;
-  if (start == INODE_BITMAP_START_SECTOR){
-     bits = 1000;
-  }else{
-      bits = 10000;
+  // nothing on disk refers to a sector just taken from the log yet, so
+  // it's written out like data
+  if(log_fresh(sector)) return Disk_Write(sector, buffer);
+  __atomic_store_n(&fs->meta_sectors[sector], 1, __ATOMIC_RELAXED);
+  if(!__atomic_exchange_n(&fs->meta_dirty[sector], 1, __ATOMIC_RELAXED))
+    __atomic_fetch_add(&fs->meta_dirty_count, 1, __ATOMIC_RELAXED);
+  return Disk_Write(sector, buffer);
+}
+
+// the inode and sector bitmaps are kept in memory, as arrays of 64-bit
+// words loaded at boot and written back to disk by FS_Sync(); a bit
+// is taken with an atomic compare-and-swap on its word and given back
+// with an atomic and, so no lock is needed to allocate; each thread
+// looks for a free bit from its own hint (the word where it last found
+// one), and threads start spread out over the bitmap, so that they
+// don't all contend for the first free word (see bitmap_t)
+
+// where the calling thread looks first in each bitmap (-1 until the
+// thread's first allocation), and how many threads have started
+static __thread int inode_bitmap_hint = -1;
+static __thread int sector_bitmap_hint = -1;
+static int bitmap_threads;
+
+// load the bitmap from disk; the bits past the end of the bitmap are
+// set, so that they're never handed out; return 0 if successful, -1
+// otherwise
+static int bitmap_load(bitmap_t* bm)
+{
+  unsigned char buf[SECTOR_SIZE];
+  memset(bm->words, 0, bm->nwords*sizeof(uint64_t));
+  for(int i=0; i<bm->num; i++) {
+    if(Disk_Read(bm->start+i, (char*)buf) < 0) return -1;
+    for(int j=0; j<SECTOR_SIZE; j++) {
+      int byte = i*SECTOR_SIZE+j;
+      if(byte*CHARBITS >= bm->nbits) break;
+      bm->words[byte/8] |= (uint64_t)buf[j] << (byte%8*CHARBITS);
+    }
   }
- 
-  //prep bitmap array
-  char *bitmap;
-  bitmap = (char*)calloc(bmpARRLen, sizeof(char));
-  bzero(bitmap,bmpARRLen);
- 
-  int index = 0; //track index in bmp where next chunk from buff will be stored
-  int numBytes = bmpARRLen; //track remaining bytes to be copied to form complete bitmap
-  int bytesToCopy = -1;
-  int indexCount = 0;
- 
-  //read bitmap from disk
-  for(int i = 0; i < numSec; i++)
-  {
-      char buff[SECTOR_SIZE];
-      //read each sector and build full bitmap
-      if(Disk_Read(currSec, buff) < 0) return -1;
-      //copy buff to bitmap
-      index = SECTOR_SIZE * i;
- 
-      if(numBytes<=SECTOR_SIZE)
-      {
-          bytesToCopy = numBytes;
-      }
-      else
-      {
-          bytesToCopy = SECTOR_SIZE;
-          numBytes -= SECTOR_SIZE;
-      }
- 
-        for(int j = 0; j<numBytes; j++){
-          bitmap[indexCount++] = buff[j];
-        }
-      bzero(buff, SECTOR_SIZE);
-      currSec++;
+  for(int i=bm->nbits; i<bm->nwords*64; i++) bm->words[i/64] |= 1ULL << (i%64);
+  bm->dirty = 0;
+  dprintf("... load bitmap of %d bits from sectors %d..%d\n",
+          bm->nbits, bm->start, bm->start+bm->num-1);
+  return 0;
+}
+
+// write the bitmap back to disk if it has changed; return 0 if
+// successful, -1 otherwise
+static int bitmap_flush(bitmap_t* bm)
+{
+  if(!__atomic_exchange_n(&bm->dirty, 0, __ATOMIC_ACQ_REL)) return 0;
+  unsigned char buf[SECTOR_SIZE];
+  for(int i=0; i<bm->num; i++) {
+    memset(buf, 0, SECTOR_SIZE);
+    for(int j=0; j<SECTOR_SIZE; j++) {
+      int byte = i*SECTOR_SIZE+j;
+      if(byte*CHARBITS >= bm->nbits) break;
+      uint64_t word = __atomic_load_n(&bm->words[byte/8], __ATOMIC_ACQUIRE);
+      buf[j] = word >> (byte%8*CHARBITS);
+    }
+    if(meta_write(bm->start+i, (char*)buf) < 0) {
+      bm->dirty = 1;
+      return -1;
+    }
   }
- 
-  //search for first bit equal to 0
-  for(int i =0; i < bits; i++)
-  {
-      //if equal to 0 set bit and return i
-      if (test_bit(bitmap, i) == 0)
-      {
-          //set ith bit to 1
-          green();
-          dprintf("---> attempting to set bit %d\n", i);
-          reset();
-          set_bit(bitmap, i);
-          found = 1;
-          firstUnused = i;
-      }
-      if(found) break;
+  dprintf("... write bitmap of %d bits to sectors %d..%d\n",
+          bm->nbits, bm->start, bm->start+bm->num-1);
+  return 0;
+}
+
+// set the first unused bit found from the calling thread's 'hint'
+// onwards (wrapping around) and return its location; return -1 if the
+// bitmap is full
+static int bitmap_alloc(bitmap_t* bm, int* hint)
+{
+  if(*hint < 0) {
+    // the first thread starts at the beginning, the next ones spread
+    int k = __atomic_fetch_add(&bitmap_threads, 1, __ATOMIC_RELAXED);
+    *hint = k*(bm->nwords/8+1);
   }
-  //write new bit map to disk
-  numBytes = bmpARRLen;
-  currSec = start;
-  index = 0;
-  for(int i = 0; i < numSec; i++)
-  {
-      char buff[SECTOR_SIZE];
-      //update index, beginning of next section of bitmap to copy
-      index = SECTOR_SIZE * i;
-      //check if remaining bytes to be copied (numBytes) is less than sector size
-      if(numBytes <= SECTOR_SIZE)
-      {
-          bytesToCopy = numBytes;
+  for(int n=0; n<bm->nwords; n++) {
+    int w = (*hint+n)%bm->nwords;
+    uint64_t old = __atomic_load_n(&bm->words[w], __ATOMIC_RELAXED);
+    while(~old) {
+      int bit = __builtin_ctzll(~old);
+      if(__atomic_compare_exchange_n(&bm->words[w], &old, old|(1ULL<<bit), 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        *hint = w;
+        __atomic_store_n(&bm->dirty, 1, __ATOMIC_RELEASE);
+        return w*64+bit;
       }
-      else
-      {
-          bytesToCopy = SECTOR_SIZE;
-      }
-      //copy from bitmap to buff
-      memcpy(buff, &bitmap[index], bytesToCopy);
-      //write to currSec full bitmap or part of full bitmap
-      if(Disk_Write(currSec, buff) < 0) return -1;
- 
-      currSec++;
- 
-      bzero(buff, SECTOR_SIZE);
-      //update remaining number of bytes needing to be written to disk
-      numBytes -= bytesToCopy;
-  }
-  //free allocated memory of bitmap
-  free(bitmap);
-  //check if bitmap corrupted
-  if(found ==0 && start==SECTOR_BITMAP_START_SECTOR){
-      green();
-      dprintf("---> error bitmap corrupted superblock sector found as first unused\n");
-      reset();
-      return -1;
+      // another thread changed the word; 'old' now holds its new value
+    }
   }
- 
-  //if unused is found return its index, else return -1
-  if(found)
-  {
-      green();
-      dprintf("---> found first unused bit in nbytes=%d bmp at index=%d\n", nbits, firstUnused);
-        reset();
-      return firstUnused;
+  dprintf("---> unused bit NOT FOUND in bitmap of %d bits\n", bm->nbits);
+  return -1;
+}
+
+// set up to 'want' consecutive unused bits, all within the first word
+// from the calling thread's 'hint' onwards that has any, and return
+// the location of the first one through 'first'; return the number of
+// bits set, or -1 if the bitmap is full
+static int bitmap_alloc_run(bitmap_t* bm, int* hint, int want, int* first)
+{
+  if(*hint < 0) {
+    int k = __atomic_fetch_add(&bitmap_threads, 1, __ATOMIC_RELAXED);
+    *hint = k*(bm->nwords/8+1);
   }
-  else
-  {
-       green();
-      dprintf("---> unused bit NOT FOUND in nbytes=%d bmp\n", nbits);
-        reset();
-      return -1;
+  for(int n=0; n<bm->nwords; n++) {
+    int w = (*hint+n)%bm->nwords;
+    uint64_t old = __atomic_load_n(&bm->words[w], __ATOMIC_RELAXED);
+    while(~old) {
+      int bit = __builtin_ctzll(~old);
+      uint64_t unused = ~old >> bit; // the free bits from 'bit' on
+      int len = (~unused) ? __builtin_ctzll(~unused) : 64;
+      if(len > want) len = want;
+      uint64_t mask = ((len == 64) ? ~0ULL : (1ULL<<len)-1) << bit;
+      if(__atomic_compare_exchange_n(&bm->words[w], &old, old|mask, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        *hint = w;
+        __atomic_store_n(&bm->dirty, 1, __ATOMIC_RELEASE);
+        *first = w*64+bit;
+        return len;
+      }
+    }
   }
+  dprintf("---> unused bits NOT FOUND in bitmap of %d bits\n", bm->nbits);
+  return -1;
 }
- 
-// reset the i-th bit of a bitmap with 'num' sectors starting from
-// 'start' sector; return 0 if successful, -1 otherwise
-// reset the i-th bit of a bitmap with 'num' sectors starting from
-// 'start' sector; return 0 if successful, -1 otherwise
-static int bitmap_reset(int start, int num, int ibit)
+
+// set the i-th bit of the bitmap; return 0 if successful, -1 if the
+// bit was already set
+static int bitmap_set(bitmap_t* bm, int ibit)
 {
-  /* YOUR CODE */
-  green();
-  dprintf("bitmap_reset(%d, %d, %d)\n", start, num, ibit);
-  reset();
-  if((start==SECTOR_BITMAP_START_SECTOR) && ((ibit == 0)||(ibit == 1) ||(ibit == 2) || (ibit == 3)||(ibit == 4))){
-      green();
-    dprintf("---> error attempting to over critical sector=%d\n", ibit);
-    dprintf("---> exiting bitmap_reset UNSUCCESSFULLY\n");
-    reset();
+  uint64_t mask = 1ULL << (ibit%64);
+  uint64_t old = __atomic_fetch_or(&bm->words[ibit/64], mask, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&bm->dirty, 1, __ATOMIC_RELEASE);
+  return (old & mask) ? -1 : 0;
+}
+
+// return true if the i-th bit of the bitmap is set
+static int bitmap_test(bitmap_t* bm, int ibit)
+{
+  return (__atomic_load_n(&bm->words[ibit/64], __ATOMIC_ACQUIRE) >> (ibit%64)) & 1;
+}
+
+// reset the i-th bit of the bitmap; return 0 if successful, -1 if the
+// bit was already clear
+static int bitmap_free(bitmap_t* bm, int ibit)
+{
+  uint64_t mask = 1ULL << (ibit%64);
+  uint64_t old = __atomic_fetch_and(&bm->words[ibit/64], ~mask, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&bm->dirty, 1, __ATOMIC_RELEASE);
+  if(!(old & mask)) {
+    dprintf("---> error bit %d already clear\n", ibit);
     return -1;
   }
-  int numSec = num;  
-  //determine number of bytes needed to represent bitmap with nbits
-  int bmpARRLen = -1;
-  if (start == INODE_BITMAP_START_SECTOR){
-     bmpARRLen = INODE_BITMAP_SIZE;
-  }else{
-      bmpARRLen = SECTOR_BITMAP_SIZE;
-  }  
-  int currSec = start;
- 
-  //prep bitmap array
-  char *bitmap;
-  bitmap = (char*)calloc(bmpARRLen, sizeof(char));
-  bzero(bitmap,bmpARRLen);
- 
-  int index = 0; //track index in bmp where next chunk from buff will be stored
-  int numBytes = bmpARRLen; //track remaining bytes to be copied to form complete bitmap
-  int bytesToCopy = -1;
-  int indexCount = 0;
- 
-  //read bitmap from disk
-  for(int i = 0; i < numSec; i++)
-  {
-      char buff[SECTOR_SIZE];
-      //read each sector and build full bitmap
-      if(Disk_Read(currSec, buff) < 0) return -1;
-      //copy buff to bitmap
-      index = SECTOR_SIZE * i;
-      if(numBytes<=SECTOR_SIZE)
-      {
-          bytesToCopy = numBytes;
-      }
-      else
-      {
-          bytesToCopy = SECTOR_SIZE;
-          numBytes -= SECTOR_SIZE;
-      }
- 
-        for(int j = 0; j<numBytes; j++){
-          bitmap[indexCount++] = buff[j];
-        }
-      bzero(buff, SECTOR_SIZE);
-      currSec++;
-  }
-  //checkt if ibit already clear if not clear
-  if(test_bit(bitmap, ibit) == 0){
-      green();
-      dprintf("---> error bit already clear\n");
-      reset();
-      return -1;
-  }else{
-      clear_bit(bitmap, ibit);
+  return 0;
+}
+
+// sectors given up by files (through truncation or unlink) are not
+// returned to the sector bitmap one at a time; they are queued on the
+// reclaim list and handed back in a single batch when the list fills
+// up, when the disk appears full, or when the file system is synced
+
+// return all the queued sectors to the sector bitmap, with the reclaim
+// list locked; return the number of sectors returned, -1 on error
+static int reclaim_flush_locked()
+{
+  int n = fs->reclaim_count;
+  if(n == 0) return 0;
+  dprintf("... reclaim %d sectors\n", n);
+  for(int i=0; i<n; i++) {
+    if(fs->reclaim_list[i] < DATABLOCK_START_SECTOR) {
+      dprintf("---> error attempting to free critical sector=%d\n", fs->reclaim_list[i]);
+      continue;
+    }
+    __atomic_store_n(&fs->meta_sectors[fs->reclaim_list[i]], 0, __ATOMIC_RELAXED);
+    bitmap_free(&fs->sector_bitmap, fs->reclaim_list[i]);
   }
-  //write new bit map to disk
-  numBytes = bmpARRLen;
-  currSec = start;
-  index = 0;
-  for(int i = 0; i < numSec; i++)
-  {
-      char buff[SECTOR_SIZE];
-      //update index, beginning of next section of bitmap to copy
-      index = SECTOR_SIZE * i;
-      //check if remaining bytes to be copied (numBytes) is less than sector size
-      if(numBytes <= SECTOR_SIZE)
-      {
-          bytesToCopy = numBytes;
-      }
-      else
-      {
-          bytesToCopy = SECTOR_SIZE;
+  fs->reclaim_count = 0;
+  return n;
+}
+
+// same as above, locking the reclaim list
+static int reclaim_flush()
+{
+  pthread_mutex_lock(&fs->reclaim_lock);
+  int ret = reclaim_flush_locked();
+  pthread_mutex_unlock(&fs->reclaim_lock);
+  return ret;
+}
+
+// in the log-structured layout, the disk is divided into segments of
+// 64 sectors (one word of the sector bitmap), and sectors are taken in
+// order from the segment at the head of the log, which moves on to the
+// next empty segment once full; a sector written back by an earlier
+// commit is never changed in place: a data, directory or inode table
+// sector is moved to the head of the log before it's changed (see
+// log_relocate()), so that a commit writes it out with the others in
+// one sequential run, and the old copy is only given back once the
+// commit that stops using it is on disk; a sector taken since the last
+// commit is "fresh" and can be changed in place, which is told by the
+// commit epoch it was taken in (see LOG_SEGMENT)
+#define LOG_SEGMENTS BITMAP_WORDS(TOTAL_SECTORS)
+#define LOG_CLEAN_LOW 4   // the cleaner is wanted below this many empty segments
+#define LOG_CLEAN_HIGH 12 // and makes room for this many
+
+// return true if the sector has been taken from the log since the last
+// commit
+static int log_fresh(int sector)
+{
+  return fs->imap_start && __atomic_load_n(&fs->sector_epoch[sector], __ATOMIC_RELAXED) ==
+    __atomic_load_n(&fs->log_epoch, __ATOMIC_RELAXED);
+}
+
+// count the empty segments; return their number
+static int log_count_spare()
+{
+  int n = 0;
+  for(int w=DATABLOCK_START_SECTOR/LOG_SEGMENT; w<LOG_SEGMENTS; w++)
+    n += (__atomic_load_n(&fs->sector_bitmap.words[w], __ATOMIC_RELAXED) == 0);
+  __atomic_store_n(&fs->log_spare, n, __ATOMIC_RELAXED);
+  return n;
+}
+
+// take 'n' sectors from the head of the log and return them through
+// 'sectors'; once no segment is empty, they're taken wherever they're
+// free; either all 'n' sectors are taken or none; return 0 if
+// successful, -1 otherwise
+static int log_alloc(int n, int* sectors)
+{
+  pthread_mutex_lock(&fs->log_lock);
+  int found = 0;
+  while(found < n) {
+    if(fs->log_head >= 0) {
+      uint64_t* word = &fs->sector_bitmap.words[fs->log_head];
+      uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+      while(~old && found < n) {
+        int bit = __builtin_ctzll(~old);
+        if(__atomic_compare_exchange_n(word, &old, old|(1ULL<<bit), 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+          sectors[found++] = fs->log_head*LOG_SEGMENT+bit;
       }
-      //copy from bitmap to buff
-      memcpy(buff, &bitmap[index], bytesToCopy);
-      //write to currSec full bitmap or part of full bitmap
-      if(Disk_Write(currSec, buff) < 0) return -1;
-      currSec++;
- 
-      bzero(buff, SECTOR_SIZE);
-      //update remaining number of bytes needing to be written to disk
-      numBytes -= bytesToCopy;
+      if(found == n) break;
+    }
+    // the head moves on to the next empty segment
+    int next = -1;
+    for(int k=1; k<=LOG_SEGMENTS && next < 0; k++) {
+      int w = (fs->log_head+k+LOG_SEGMENTS)%LOG_SEGMENTS;
+      if(__atomic_load_n(&fs->sector_bitmap.words[w], __ATOMIC_RELAXED) == 0) next = w;
+    }
+    if(next < 0) break;
+    fs->log_head = next;
+    dprintf("... log head moves to segment %d (%d empty)\n", fs->log_head, log_count_spare());
   }
-  //free allocated memory of bitmap
-  free(bitmap);
- 
-   green();
-  dprintf("---> bitmap_reset COMPLETED SUCCESSFULLY\n");
-  reset();
+  while(found < n && (sectors[found] = bitmap_alloc(&fs->sector_bitmap, &sector_bitmap_hint)) >= 0)
+    found++;
+  if(found < n) {
+    for(int i=0; i<found; i++) bitmap_free(&fs->sector_bitmap, sectors[i]);
+    pthread_mutex_unlock(&fs->log_lock);
+    dprintf("---> not enough free sectors in the log for %d\n", n);
+    return -1;
+  }
+  __atomic_store_n(&fs->sector_bitmap.dirty, 1, __ATOMIC_RELEASE);
+  int epoch = __atomic_load_n(&fs->log_epoch, __ATOMIC_RELAXED);
+  for(int i=0; i<n; i++) __atomic_store_n(&fs->sector_epoch[sectors[i]], epoch, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&fs->log_lock);
   return 0;
 }
-// return 1 if the file name is illegal; otherwise, return 0; legal
-// characters for a file name include letters (case sensitive),
-// numbers, dots, dashes, and underscores; and a legal file name
-// should not be more than MAX_NAME-1 in length
-static int illegal_filename(char* name)
+
+// give up the sector, which nothing refers to any more; a fresh sector
+// goes straight back to the sector bitmap, since nothing on disk refers
+// to it either, the others once the next commit is on disk (the inode
+// table the inode map starts out pointing at is never reused)
+static void log_kill(int sector)
 {
-  // Check if name is non empty or too long
-  if(name==NULL || strlen(name)==0 || strlen(name)>=MAX_NAME)
-  {
-    dprintf("... Filename is null or too long: %s\n", name);    
-    return 1;
+  if(sector < DATABLOCK_START_SECTOR) return;
+  if(log_fresh(sector)) {
+    __atomic_store_n(&fs->meta_sectors[sector], 0, __ATOMIC_RELAXED);
+    bitmap_free(&fs->sector_bitmap, sector);
+    return;
   }
- 
-  // Check if entries only contain allowed elements
-  for(int i=0; i < strlen(name);i++){
-    if(!(isalpha(name[i]) || isdigit(name[i]) ||
-        name[i] == '.' || name[i] == '_' || name[i] == '-'  || name[i] == '/'))
-        {
-          dprintf("... Invalid characters in filename: %s\n", name);
-          return 1; }
+  __atomic_store_n(&fs->dead_epoch[sector], __atomic_load_n(&fs->log_epoch, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_fetch_add(&fs->log_dead, 1, __ATOMIC_RELAXED);
+}
+
+// make sure the sector referenced by '*slot' can be changed in place:
+// in the log-structured layout, a sector that isn't fresh is replaced
+// by one taken from the log (its content is copied only if 'copy' is
+// set); return 0 if successful, -1 otherwise
+static int log_relocate(int* slot, int copy)
+{
+  if(!fs->imap_start || log_fresh(*slot)) return 0;
+  int newsec;
+  char buf[SECTOR_SIZE];
+  if(log_alloc(1, &newsec) < 0) return -1;
+  if(copy && (Disk_Read(*slot, buf) < 0 || Disk_Write(newsec, buf) < 0)) {
+    bitmap_free(&fs->sector_bitmap, newsec);
+    return -1;
   }
- 
-  return 0;  
+  dprintf("... move sector %d to %d at the head of the log\n", *slot, newsec);
+  log_kill(*slot);
+  *slot = newsec;
+  return 0;
 }
- 
-// return the child inode of the given file name 'fname' from the
-// parent inode; the parent inode is currently stored in the segment
-// of inode table in the cache (we cache only one disk sector for
-// this); once found, both cached_inode_sector and cached_inode_buffer
-// may be updated to point to the segment of inode table containing
-// the child inode; the function returns -1 if no such file is found;
-// it returns -2 is something else is wrong (such as parent is not
-// directory, or there's read error, etc.)
-static int find_child_inode(int parent_inode, char* fname,
-          int *cached_inode_sector, char* cached_inode_buffer)
-{
-  int cached_start_entry = ((*cached_inode_sector)-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = parent_inode-cached_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(cached_inode_buffer+offset*sizeof(inode_t));
-  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
-   parent_inode, parent->size, parent->type);
-  if(parent->type != 1) {
-    dprintf("... parent not a directory\n");
-    return -2;
+
+// return the sectors given up up to the epoch 'epoch' to the sector
+// bitmap, once the commit that ended that epoch is on disk
+static void log_release(int epoch)
+{
+  int n = 0;
+  for(int i=DATABLOCK_START_SECTOR; i<TOTAL_SECTORS; i++) {
+    int e = __atomic_load_n(&fs->dead_epoch[i], __ATOMIC_RELAXED);
+    if(e == 0 || e > epoch) continue;
+    __atomic_store_n(&fs->dead_epoch[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->meta_sectors[i], 0, __ATOMIC_RELAXED);
+    bitmap_free(&fs->sector_bitmap, i);
+    n++;
   }
- 
-  int nentries = parent->size; // remaining number of directory entries
-  int idx = 0;
-  while(nentries > 0) {
-    char buf[SECTOR_SIZE]; // cached content of directory entries
-    if(Disk_Read(parent->data[idx], buf) < 0) return -2;
-    for(int i=0; i<DIRENTS_PER_SECTOR; i++) {
-      if(i>nentries) break;
-      if(!strcmp(((dirent_t*)buf)[i].fname, fname)) {
-  // found the file/directory; update inode cache
-  int child_inode = ((dirent_t*)buf)[i].inode;
-  dprintf("... found child_inode=%d\n", child_inode);
-  int sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-  if(sector != (*cached_inode_sector)) {
-    *cached_inode_sector = sector;
-    if(Disk_Read(sector, cached_inode_buffer) < 0) return -2;
-    dprintf("... load inode table for child\n");
+  if(n == 0) return;
+  __atomic_fetch_sub(&fs->log_dead, n, __ATOMIC_RELAXED);
+  dprintf("... release %d sectors given up before commit %d (%d empty segments)\n",
+          n, epoch, log_count_spare());
+}
+
+// return true if the log is running out of empty segments, and the
+// cleaner should run with the next commit; not if it found nothing to
+// clean last time, unless a segment's worth of sectors have been given
+// up since
+static int log_wants_clean()
+{
+  return fs->imap_start && __atomic_load_n(&fs->log_spare, __ATOMIC_RELAXED) < LOG_CLEAN_LOW &&
+    (!__atomic_load_n(&fs->log_stuck, __ATOMIC_RELAXED) ||
+     __atomic_load_n(&fs->log_dead, __ATOMIC_RELAXED) >= LOG_SEGMENT);
+}
+
+// allocate a free data sector; sectors waiting on the reclaim list are
+// given back first if the sector bitmap is full; return the sector, or
+// -1 if the disk is full
+static int sector_alloc()
+{
+  int sector;
+  if(fs->imap_start) return (log_alloc(1, &sector) < 0) ? -1 : sector;
+  sector = bitmap_alloc(&fs->sector_bitmap, &sector_bitmap_hint);
+  if(sector < 0 && reclaim_flush() > 0)
+    sector = bitmap_alloc(&fs->sector_bitmap, &sector_bitmap_hint);
+  return sector;
+}
+
+// allocate 'n' free data sectors at once and return them through
+// 'sectors'; either all 'n' sectors are allocated or none; return 0
+// if successful, -1 otherwise
+static int sector_alloc_batch(int n, int* sectors)
+{
+  green();
+  dprintf("sector_alloc_batch(%d)\n", n);
+  reset();
+  if(n <= 0) return 0;
+  if(fs->imap_start) return log_alloc(n, sectors);
+
+  for(int retry=0; retry<2; retry++) {
+    int found = 0;
+    while(found < n && (sectors[found] = bitmap_alloc(&fs->sector_bitmap, &sector_bitmap_hint)) >= 0)
+      found++;
+    if(found == n) return 0;
+    // not enough room; give back what was taken and the queued
+    // sectors, and try once more
+    for(int i=0; i<found; i++) bitmap_free(&fs->sector_bitmap, sectors[i]);
+    if(reclaim_flush() <= 0) break;
   }
-  return child_inode;
-      }
+  dprintf("---> not enough free sectors for %d\n", n);
+  return -1;
+}
+
+// load the reference count table from disk (all counts are zero if the
+// table hasn't been allocated yet); return 0 if successful, -1 otherwise
+static int refcount_load()
+{
+  if(fs->refcounts) return 0;
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  memcpy(fs->refcount_sectors, ((superblock_t*)buf)->refcount_table, sizeof(fs->refcount_sectors));
+  memset(fs->refcount_dirty, 0, sizeof(fs->refcount_dirty));
+
+  fs->refcounts = (unsigned char*)calloc(REFCOUNT_TABLE_SECTORS, SECTOR_SIZE);
+  if(!fs->refcounts) return -1;
+  if(fs->refcount_sectors[0] == 0) return 0;
+  for(int i=0; i<REFCOUNT_TABLE_SECTORS; i++) {
+    if(Disk_Read(fs->refcount_sectors[i], (char*)fs->refcounts+i*SECTOR_SIZE) < 0) {
+      free(fs->refcounts);
+      fs->refcounts = NULL;
+      return -1;
     }
-    idx++; nentries -= DIRENTS_PER_SECTOR;
   }
-  dprintf("... could not find child inode\n");
-  return -1; // not found
+  dprintf("... load sector reference counts from %d sectors\n", REFCOUNT_TABLE_SECTORS);
+  return 0;
 }
- 
-// follow the absolute path; if successful, return the inode of the
-// parent directory immediately before the last file/directory in the
-// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
-// the child is 'd.txt'; the child's inode is returned through the
-// parameter 'last_inode' and its file name is returned through the
-// parameter 'last_fname' (both are references); it's possible that
-// the last file/directory is not in its parent directory, in which
-// case, 'last_inode' points to -1; if the function returns -1, it
-// means that we cannot follow the path
-static int follow_path(char* path, int* last_inode, char* last_fname)
+
+// return the number of extra references to 'sector', -1 on error
+static int refcount_get(int sector)
+{
+  if(refcount_load() < 0) return -1;
+  return fs->refcounts[sector];
+}
+
+// add 'delta' to the reference count of 'sector' in memory; the
+// change reaches the disk with refcount_flush(); return 0 if
+// successful, -1 otherwise
+static int refcount_adjust(int sector, int delta)
+{
+  if(refcount_load() < 0) return -1;
+  if(fs->refcounts[sector]+delta < 0 || fs->refcounts[sector]+delta > MAX_REFCOUNT) return -1;
+  fs->refcounts[sector] += delta;
+  fs->refcount_dirty[sector/SECTOR_SIZE] = 1;
+  return 0;
+}
+
+// write the modified parts of the reference count table to disk; the
+// table is allocated (and recorded in the superblock) the first time
+// it's needed; return 0 if successful, -1 otherwise
+static int refcount_flush()
+{
+  if(!fs->refcounts) return 0;
+  if(fs->refcount_sectors[0] == 0) {
+    int dirty = 0;
+    for(int i=0; i<REFCOUNT_TABLE_SECTORS; i++) dirty |= fs->refcount_dirty[i];
+    if(!dirty) return 0;
+
+    char buf[SECTOR_SIZE];
+    for(int i=0; i<REFCOUNT_TABLE_SECTORS; i++) {
+      if((fs->refcount_sectors[i] = sector_alloc()) < 0) {
+        dprintf("... error: no space on disk for the reference count table\n");
+        memset(fs->refcount_sectors, 0, sizeof(fs->refcount_sectors));
+        return -1;
+      }
+      fs->refcount_dirty[i] = 1;
+    }
+    pthread_mutex_lock(&fs->super_lock);
+    int ret = Disk_Read(SUPERBLOCK_START_SECTOR, buf);
+    memcpy(((superblock_t*)buf)->refcount_table, fs->refcount_sectors, sizeof(fs->refcount_sectors));
+    if(ret == 0) ret = meta_write(SUPERBLOCK_START_SECTOR, buf);
+    pthread_mutex_unlock(&fs->super_lock);
+    if(ret < 0) return -1;
+    dprintf("... allocate sector reference count table at sector %d\n", fs->refcount_sectors[0]);
+  }
+
+  for(int i=0; i<REFCOUNT_TABLE_SECTORS; i++) {
+    if(!fs->refcount_dirty[i]) continue;
+    if(meta_write(fs->refcount_sectors[i], (char*)fs->refcounts+i*SECTOR_SIZE) < 0) return -1;
+    fs->refcount_dirty[i] = 0;
+  }
+  return 0;
+}
+
+// make sure the sector referenced by '*slot' is owned by a single
+// file before it's modified: a shared sector is replaced by a private
+// copy (its content is copied only if 'copy' is set); in the
+// log-structured layout, a sector not shared is moved to the head of
+// the log instead, unless fresh; return 0 if successful, -1 otherwise
+static int sector_unshare(int* slot, int copy)
+{
+  pthread_mutex_lock(&fs->refcount_lock);
+  int refs = refcount_get(*slot);
+  if(refs <= 0) {
+    pthread_mutex_unlock(&fs->refcount_lock);
+    return (refs < 0) ? -1 : log_relocate(slot, copy);
+  }
+
+  int ret = -1;
+  int newsec = sector_alloc();
+  char buf[SECTOR_SIZE];
+  if(newsec >= 0 && (!copy || (Disk_Read(*slot, buf) == 0 && Disk_Write(newsec, buf) == 0))) {
+    dprintf("... copy-on-write shared sector %d to %d\n", *slot, newsec);
+    if(refcount_adjust(*slot, -1) == 0 && refcount_flush() == 0) {
+      *slot = newsec;
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&fs->refcount_lock);
+  return ret;
+}
+
+// take one more reference to each data sector of the file 'node' (for
+// a clone of it); either all of them are taken or none; return 0 if
+// successful, -1 otherwise
+static int sector_share_all(inode_t* node)
+{
+  int sectors = (node->size+SECTOR_SIZE-1)/SECTOR_SIZE;
+  pthread_mutex_lock(&fs->refcount_lock);
+  // make sure every data sector can take one more reference before
+  // anything is changed
+  for(int i=0; i<sectors; i++) {
+    if(node->data[i] && refcount_get(node->data[i]) >= MAX_REFCOUNT) {
+      dprintf("... error: sector %d shared too many times\n", node->data[i]);
+      pthread_mutex_unlock(&fs->refcount_lock);
+      return -1;
+    }
+  }
+  for(int i=0; i<sectors; i++) {
+    if(node->data[i]) refcount_adjust(node->data[i], 1);
+  }
+  int ret = refcount_flush();
+  pthread_mutex_unlock(&fs->refcount_lock);
+  return ret;
+}
+
+// give up a reference to the data sector 'sector'; a sector shared by
+// cloned files just loses one reference, otherwise it's queued for
+// reclamation (or given up to the log, see log_kill()); return 0 if
+// successful, -1 otherwise
+static int reclaim_sector(int sector)
+{
+  pthread_mutex_lock(&fs->refcount_lock);
+  int refs = refcount_get(sector);
+  if(refs > 0 && (refcount_adjust(sector, -1) < 0 || refcount_flush() < 0)) refs = -1;
+  pthread_mutex_unlock(&fs->refcount_lock);
+  if(refs != 0) return (refs < 0) ? -1 : 0;
+  if(fs->imap_start) {
+    log_kill(sector);
+    return 0;
+  }
+
+  pthread_mutex_lock(&fs->reclaim_lock);
+  int ret = 0;
+  if(fs->reclaim_count == RECLAIM_LIST_SIZE && reclaim_flush_locked() < 0) ret = -1;
+  else fs->reclaim_list[fs->reclaim_count++] = sector;
+  pthread_mutex_unlock(&fs->reclaim_lock);
+  return ret;
+}
+
+// return 1 if the file name is illegal; otherwise, return 0; legal
+// characters for a file name include letters (case sensitive),
+// numbers, dots, dashes, and underscores; and a legal file name
+// should not be more than MAX_NAME-1 in length
+static int illegal_filename(char* name)
+{
+  // Check if name is non empty or too long
+  if(name==NULL || strlen(name)==0 || strlen(name)>=MAX_NAME)
+  {
+    dprintf("... Filename is null or too long: %s\n", name);    
+    return 1;
+  }
+ 
+  // Check if entries only contain allowed elements
+  for(int i=0; i < strlen(name);i++){
+    if(!(isalpha(name[i]) || isdigit(name[i]) ||
+        name[i] == '.' || name[i] == '_' || name[i] == '-'  || name[i] == '/'))
+        {
+          dprintf("... Invalid characters in filename: %s\n", name);
+          return 1; }
+  }
+ 
+  return 0;
+}
+
+// the inode table is initialized lazily: the sectors from the
+// high-water mark 'itable_hwm' on (recorded in the superblock) have
+// never been written, and read as zeroes whatever the disk holds; the
+// mark is raised past a sector before an inode in it is first written,
+// and the sectors skipped are zero-filled straight in the backstore,
+// which reaches stable storage before the commit that records the new
+// mark; the mark only goes up, with 'super_lock' held
+
+// read the inode table sector 'block' (with its lock held) into
+// 'buffer'; return 0 if successful, -1 otherwise
+static int itable_read(int block, char* buffer)
+{
+  if(block >= __atomic_load_n(&fs->itable_hwm, __ATOMIC_ACQUIRE)) {
+    memset(buffer, 0, SECTOR_SIZE);
+    return 0;
+  }
+  return Disk_Read(fs->imap[block], buffer);
+}
+
+// raise the high-water mark past the inode table sector 'block' (with
+// its lock held), which is about to be written; return 0 if
+// successful, -1 otherwise
+static int itable_extend(int block)
+{
+  if(block < __atomic_load_n(&fs->itable_hwm, __ATOMIC_ACQUIRE)) return 0;
+  char buf[SECTOR_SIZE], back[SECTOR_SIZE];
+  memset(buf, 0, SECTOR_SIZE);
+  pthread_mutex_lock(&fs->super_lock);
+  int ret = 0;
+  for(int i=fs->itable_hwm; i<block && ret == 0; i++) {
+    // nothing on disk refers to these yet, so they aren't journaled
+    int old = fs->imap[i];
+    ret = log_relocate(&fs->imap[i], 0);
+    if(fs->imap[i] != old) __atomic_store_n(&fs->imap_dirty, 1, __ATOMIC_RELEASE);
+    int r = 0;
+    if(ret == 0) ret = Disk_Write(fs->imap[i], buf);
+    if(ret == 0 && (r = Disk_Take(fs->imap[i], back)) > 0) ret = Disk_Put(fs->imap[i], back);
+    if(r < 0) ret = -1;
+  }
+  if(ret == 0 && block >= fs->itable_hwm) {
+    ret = Disk_Read(SUPERBLOCK_START_SECTOR, buf);
+    ((superblock_t*)buf)->itable_hwm = block+1;
+    if(ret == 0) ret = meta_write(SUPERBLOCK_START_SECTOR, buf);
+    if(ret == 0) {
+      dprintf("... inode table initialized up to sector %d\n", block);
+      __atomic_store_n(&fs->itable_hwm, block+1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&fs->super_lock);
+  return ret;
+}
+
+// copy the inode 'inode' out of the inode table into 'node'; return 0
+// if successful, -1 otherwise
+static int inode_read(int inode, inode_t* node)
+{
+  char inode_buffer[SECTOR_SIZE];
+  int block = inode/INODES_PER_SECTOR; // the inode table sector (see imap)
+  pthread_mutex_t* lock = &fs->itable_locks[block];
+  pthread_mutex_lock(lock);
+  int ret = itable_read(block, inode_buffer);
+  pthread_mutex_unlock(lock);
+  if(ret < 0) return -1;
+  int offset = inode-block*INODES_PER_SECTOR;
+  assert(0 <= offset && offset < INODES_PER_SECTOR);
+  memcpy(node, inode_buffer+offset*sizeof(inode_t), sizeof(inode_t));
+  return 0;
+}
+
+// store 'node' as the inode 'inode' in the inode table (the other
+// inodes sharing the same disk sector are preserved); return 0 if
+// successful, -1 otherwise
+static int inode_write(int inode, inode_t* node)
+{
+  char inode_buffer[SECTOR_SIZE];
+  int block = inode/INODES_PER_SECTOR;
+  int offset = inode-block*INODES_PER_SECTOR;
+  assert(0 <= offset && offset < INODES_PER_SECTOR);
+  // the other inodes of the sector may be written at the same time
+  pthread_mutex_t* lock = &fs->itable_locks[block];
+  pthread_mutex_lock(lock);
+  int ret = itable_read(block, inode_buffer);
+  if(ret == 0) ret = itable_extend(block);
+  if(ret == 0) {
+    memcpy(inode_buffer+offset*sizeof(inode_t), node, sizeof(inode_t));
+    int old = fs->imap[block];
+    ret = log_relocate(&fs->imap[block], 0);
+    if(fs->imap[block] != old) __atomic_store_n(&fs->imap_dirty, 1, __ATOMIC_RELEASE);
+    if(ret == 0) ret = meta_write(fs->imap[block], inode_buffer);
+  }
+  pthread_mutex_unlock(lock);
+  return ret;
+}
+
+// zero the inodes of the inode table sector 'block' given by 'mask'
+// (bit i for the i-th inode of the sector) with a single write of the
+// sector; return 0 if successful, -1 otherwise
+static int itable_clear(int block, int mask)
+{
+  char inode_buffer[SECTOR_SIZE];
+  pthread_mutex_t* lock = &fs->itable_locks[block];
+  pthread_mutex_lock(lock);
+  int ret = itable_read(block, inode_buffer);
+  if(ret == 0) ret = itable_extend(block);
+  if(ret == 0) {
+    for(int i=0; i<INODES_PER_SECTOR; i++)
+      if(mask & (1 << i)) memset(inode_buffer+i*sizeof(inode_t), 0, sizeof(inode_t));
+    int old = fs->imap[block];
+    ret = log_relocate(&fs->imap[block], 0);
+    if(fs->imap[block] != old) __atomic_store_n(&fs->imap_dirty, 1, __ATOMIC_RELEASE);
+    if(ret == 0) ret = meta_write(fs->imap[block], inode_buffer);
+  }
+  pthread_mutex_unlock(lock);
+  return ret;
+}
+
+// allocate a free inode; return it, or -1 if the inode table is full
+static int inode_alloc()
+{
+  return bitmap_alloc(&fs->inode_bitmap, &inode_bitmap_hint);
+}
+
+// change the size of the file represented by 'node' to 'newsize'
+// bytes; when shrinking, the sectors no longer needed are put on the
+// reclaim list; when growing, the new range is left as a hole; in
+// both cases whatever follows the end of file in its last sector is
+// zeroed; only the in-memory inode is updated, the caller is
+// responsible for writing it back; return 0 if successful, -1
+// otherwise
+static int inode_resize(inode_t* node, int newsize)
+{
+  int keep = (newsize+SECTOR_SIZE-1)/SECTOR_SIZE;
+  int sectors = (node->size+SECTOR_SIZE-1)/SECTOR_SIZE;
+  for(int i=keep; i<sectors; i++) {
+    if(node->data[i] && reclaim_sector(node->data[i]) < 0) return -1;
+    node->data[i] = 0;
+  }
+
+  // the sector that holds the end of file after the change
+  int eof = (newsize < node->size) ? newsize : node->size;
+  int last = eof/SECTOR_SIZE;
+  if(eof%SECTOR_SIZE && newsize != node->size && node->data[last]) {
+    char buf[SECTOR_SIZE];
+    if(Disk_Read(node->data[last], buf) < 0) return -1;
+    memset(buf+eof%SECTOR_SIZE, 0, SECTOR_SIZE-eof%SECTOR_SIZE);
+    if(sector_unshare(&node->data[last], 0) < 0) return -1;
+    if(Disk_Write(node->data[last], buf) < 0) return -1;
+  }
+  node->size = newsize;
+  return 0;
+}
+
+// return the child inode of the given file name 'fname' from the
+// parent inode; the function returns -1 if no such file is found; it
+// returns -2 is something else is wrong (such as parent is not
+// directory, or there's read error, etc.); the caller holds the lock
+// of the parent
+static int find_child_inode(int parent_inode, char* fname)
+{
+  inode_t parent;
+  if(inode_read(parent_inode, &parent) < 0) return -2;
+  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
+   parent_inode, parent.size, parent.type);
+  if(parent.type != 1) {
+    dprintf("... parent not a directory\n");
+    return -2;
+  }
+ 
+  int nentries = parent.size; // remaining number of directory entries
+  int idx = 0;
+  while(nentries > 0) {
+    char buf[SECTOR_SIZE]; // cached content of directory entries
+    if(Disk_Read(parent.data[idx], buf) < 0) return -2;
+    for(int i=0; i<DIRENTS_PER_SECTOR && i<nentries; i++) {
+      if(!strcmp(((dirent_t*)buf)[i].fname, fname)) {
+  int child_inode = ((dirent_t*)buf)[i].inode;
+  dprintf("... found child_inode=%d\n", child_inode);
+  return child_inode;
+      }
+    }
+    idx++; nentries -= DIRENTS_PER_SECTOR;
+  }
+  dprintf("... could not find child inode\n");
+  return -1; // not found
+}
+ 
+// split the absolute path into its file/directory names, which go in
+// 'tokens' (pointing into 'pathstore', of MAX_PATH bytes); return the
+// number of names, -1 if the path is not valid
+static int path_split(char* path, char* pathstore, char** tokens)
 {
   if(!path) {
     dprintf("... invalid path\n");
@@ -582,19 +1286,12 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
  
   // make a copy of the path (skip leading '/'); this is necessary
   // since the path is going to be modified by strsep()
-  char pathstore[MAX_PATH];
   strncpy(pathstore, path+1, MAX_PATH-1);
   pathstore[MAX_PATH-1] = '\0'; // for safety
   char* lpath = pathstore;
  
-  int parent_inode = -1, child_inode = 0; // start from root
-  // cache the disk sector containing the root inode
-  int cached_sector = INODE_TABLE_START_SECTOR;
-  char cached_buffer[SECTOR_SIZE];
-  if(Disk_Read(cached_sector, cached_buffer) < 0) return -1;
-  dprintf("... load inode table for root from disk sector %d\n", cached_sector);
- 
-  // for each file/directory name separated by '/'
+  // split the path into file/directory names separated by '/'
+  int ntokens = 0;
   char* token;
   while((token = strsep(&lpath, "/")) != NULL) {
     dprintf("... process token: '%s'\n", token);
@@ -603,96 +1300,127 @@ static int follow_path(char* path, int* last_inode, char* last_fname)
       dprintf("... illegal file name: '%s'\n", token);
       return -1;
     }
+    tokens[ntokens++] = token;
+  }
+  return ntokens;
+}
+
+static int dir_unlinked(int dir);
+
+// follow the absolute path; if successful, return the inode of the
+// parent directory immediately before the last file/directory in the
+// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
+// the child is 'd.txt'; the child's inode is returned through the
+// parameter 'last_inode' and its file name is returned through the
+// parameter 'last_fname' (both are references); it's possible that
+// the last file/directory is not in its parent directory, in which
+// case, 'last_inode' points to -1; if the function returns -1, it
+// means that we cannot follow the path; the directories on the way
+// are read-locked one after the other, and the parent returned is
+// left locked with 'lock' (the caller unlocks it) unless 'lock' is
+// LOCK_NONE; a path that doesn't start with '/' is followed from the
+// directory 'dir' instead of the root (if 'dir' is not -1), unless
+// that directory has been unlinked
+static int follow_path_at(int dir, char* path, int* last_inode, char* last_fname, int lock)
+{
+  char abspath[MAX_PATH];
+  if(path && path[0] != '/' && dir >= 0) {
+    if(snprintf(abspath, MAX_PATH, "/%s", path) >= MAX_PATH) return -1;
+    path = abspath;
+  } else dir = 0;
+  char pathstore[MAX_PATH];
+  char* tokens[MAX_PATH/2];
+  int ntokens = path_split(path, pathstore, tokens);
+  if(ntokens < 0) return -1;
+
+  // nothing to follow is a special case: parent=child=dir
+  if(ntokens == 0) {
+    inode_lock(dir, lock);
+    if(dir && dir_unlinked(dir)) {
+      if(lock) inode_unlock(dir);
+      return -1;
+    }
+    dprintf("... found parent_inode=%d, child_inode=%d\n", dir, dir);
+    *last_inode = dir;
+    return dir;
+  }
+
+  // start from root (or dir); each directory is locked before its
+  // parent is unlocked, so nothing on the way can be removed under us
+  int parent_inode = -1, child_inode = dir;
+  inode_lock(dir, (ntokens == 1 && lock) ? lock : LOCK_READ);
+  if(dir && dir_unlinked(dir)) {
+    dprintf("... directory inode %d has been unlinked\n", dir);
+    inode_unlock(dir);
+    return -1;
+  }
+  for(int i=0; i<ntokens; i++) {
+    parent_inode = child_inode;
+    child_inode = find_child_inode(parent_inode, tokens[i]);
+    if(i == ntokens-1) break;
     if(child_inode < 0) {
-      // regardless whether child_inode was not found previously, or
-      // there was issues related to the parent (say, not a
-      // directory), or there was a read error, we abort
+      // regardless whether child_inode was not found, or there was
+      // issues related to the parent (say, not a directory), or there
+      // was a read error, we abort
       dprintf("... parent inode can't be established\n");
+      inode_unlock(parent_inode);
       return -1;
     }
-    parent_inode = child_inode;
-    child_inode = find_child_inode(parent_inode, token,
-           &cached_sector, cached_buffer);
-    if(last_fname) strcpy(last_fname, token);
+    inode_lock(child_inode, (i+2 == ntokens && lock) ? lock : LOCK_READ);
+    inode_unlock(parent_inode);
   }
+  if(child_inode < -1 || !lock) inode_unlock(parent_inode);
   if(child_inode < -1) return -1; // if there was error, abort
-  else {
-    // there was no error, several possibilities:
-    // 1) '/': parent = -1, child = 0
-    // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
-    // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
-    // in the first case, we set parent=child=0 as special case
-    if(parent_inode==-1 && child_inode==0) parent_inode = 0;
-    dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
-    *last_inode = child_inode;
-    return parent_inode;
-  }
+
+  // there was no error, two possibilities:
+  // 1) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
+  // 2) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
+  if(last_fname) strcpy(last_fname, tokens[ntokens-1]);
+  dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
+  *last_inode = child_inode;
+  return parent_inode;
 }
- 
-// add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
-int add_inode(int type, int parent_inode, char* file)
+
+static int follow_path(char* path, int* last_inode, char* last_fname, int lock)
 {
-  // get a new inode for child
-  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
-  if(child_inode < 0) {
-    dprintf("... error: inode table is full\n");
-    return -1;
-  }
-  dprintf("... new child inode %d\n", child_inode);
- 
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
- 
-  // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = child_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
- 
-  // update the new child inode and write to disk
-  memset(child, 0, sizeof(inode_t));
-  child->type = type;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-     child_inode, child->size, child->type, inode_sector);
- 
-  // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for parent inode %d from disk sector %d\n",
-     parent_inode, inode_sector);
- 
-  // get the parent inode
-  inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  offset = parent_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  dprintf("... get parent inode %d (size=%d, type=%d)\n",
-     parent_inode, parent->size, parent->type);
+  return follow_path_at(-1, path, last_inode, last_fname, lock);
+}
+
+// move the lock held on the parent directory down to the child, which
+// is then locked with 'mode' (the path '/' has both the same, locked
+// already)
+static void lock_child(int parent_inode, int child_inode, int mode)
+{
+  if(child_inode == parent_inode) return;
+  inode_lock(child_inode, mode);
+  inode_unlock(parent_inode);
+}
  
-  // get the dirent sector
-  if(parent->type != 1) {
-    dprintf("... error: parent inode is not directory\n");
-    return -2; // parent not directory
-  }
+// return true if the directory whose inode is 'parent' has no room
+// for another entry
+static int dir_full(inode_t* parent)
+{
   int group = parent->size/DIRENTS_PER_SECTOR;
   //check if group has reach max sectors per directory and abort if true
-  if (group >= MAX_SECTORS_PER_FILE){
+  if (group >= MAX_SECTORS_PER_FILE-1 && group*DIRENTS_PER_SECTOR == parent->size){
     printf("... all sectors of parent director is filled\n");
-    return -1;
+    return 1;
   }
+  return 0;
+}
+
+// append the entry 'file' for 'child_inode' to the directory
+// 'parent_inode' (whose inode is 'parent', which has room for it);
+// return 0 if successful, -1 otherwise; the caller holds the write
+// lock of the parent
+static int dirent_add(int parent_inode, inode_t* parent, char* file, int child_inode)
+{
+  // get the dirent sector
+  int group = parent->size/DIRENTS_PER_SECTOR;
   char dirent_buffer[SECTOR_SIZE];
   if(group*DIRENTS_PER_SECTOR == parent->size) {
     // new disk sector is needed
-    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-    if(group == MAX_SECTORS_PER_FILE-1){
-      dprintf(".... error: all sectors referenced in data attribute of parent inode fully occupied. Parent size: %d\n", parent->size);
-      return -1;
-    }
+    int newsec = sector_alloc();
     if(newsec < 0) {
       dprintf("... error: disk is full\n");
       return -1;
@@ -701,1260 +1429,4332 @@ int add_inode(int type, int parent_inode, char* file)
     memset(dirent_buffer, 0, SECTOR_SIZE);
     dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
   } else {
-    if(Disk_Read(parent->data[group], dirent_buffer) < 0)
+    if(Disk_Read(parent->data[group], dirent_buffer) < 0 ||
+       log_relocate(&parent->data[group], 0) < 0)
       return -1;
     dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
   }
  
   // add the dirent and write to disk
-  int start_entry = group*DIRENTS_PER_SECTOR;
-  offset = parent->size-start_entry;
+  int offset = parent->size-group*DIRENTS_PER_SECTOR;
   dirent_t* dirent = (dirent_t*)(dirent_buffer+offset*sizeof(dirent_t));
   strncpy(dirent->fname, file, MAX_NAME);
   dirent->inode = child_inode;
-  if(Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
+  if(meta_write(parent->data[group], dirent_buffer) < 0) return -1;
   dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
       parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
  
   // update parent inode and write to disk
   parent->size++;
-  dprintf("... updating parent inode size: %d", parent->size);
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update parent inode on disk sector %d\n", inode_sector);
- 
+  if(inode_write(parent_inode, parent) < 0) return -1;
+  dprintf("... update parent inode %d size: %d\n", parent_inode, parent->size);
   return 0;
 }
+
+// add a new file or directory (determined by 'type') of given name
+// 'file' under parent directory represented by 'parent_inode'; return
+// the inode of the new file or directory, or a negative value on
+// error; the caller holds the write lock of the parent
+int add_inode(int type, int parent_inode, char* file)
+{
+  // get the parent inode
+  inode_t parent;
+  if(inode_read(parent_inode, &parent) < 0) return -1;
+  dprintf("... get parent inode %d (size=%d, type=%d)\n",
+     parent_inode, parent.size, parent.type);
+  if(parent.type != 1) {
+    dprintf("... error: parent inode is not directory\n");
+    return -2; // parent not directory
+  }
+  if(dir_full(&parent)) return -1;
+
+  // get a new inode for child; its bit in the inode bitmap is set and
+  // the inode written with the open files locked, so that
+  // File_OpenInode() never finds it half made
+  pthread_mutex_lock(&fs->open_lock);
+  int child_inode = inode_alloc();
+  if(child_inode < 0) {
+    pthread_mutex_unlock(&fs->open_lock);
+    dprintf("... error: inode table is full\n");
+    return -1;
+  }
+  dprintf("... new child inode %d\n", child_inode);
+ 
+  // update the new child inode and write to disk
+  inode_t child;
+  memset(&child, 0, sizeof(inode_t));
+  child.type = type;
+  int ret = inode_write(child_inode, &child);
+  pthread_mutex_unlock(&fs->open_lock);
+  if(ret < 0) return -1;
+  dprintf("... update child inode %d (size=%d, type=%d)\n",
+     child_inode, child.size, child.type);
+  if(dirent_add(parent_inode, &parent, file, child_inode) < 0) return -1;
+  return child_inode;
+}
  
-// used by both File_Create() and Dir_Create(); type=0 is file, type=1
-// is directory
-int create_file_or_directory(int type, char* pathname)
+// used by both File_Create() and Dir_Create(), and their *At()
+// variants; type=0 is file, type=1 is directory; a relative path is
+// followed from the directory 'dir' (-1 if none)
+int create_file_or_directory(int dir, int type, char* pathname)
 {
   int child_inode;
   char last_fname[MAX_NAME];
-  int parent_inode = follow_path(pathname, &child_inode, last_fname);
-  if(parent_inode >= 0)
-   {
-    if(child_inode >= 0)
-    {
-      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
-      osErrno = E_CREATE;
-      return -1;
-    } else
-      {
-      if(add_inode(type, parent_inode, last_fname) >= 0)
-      {
-      dprintf("... successfully created file/directory: '%s'\n", pathname);
-      return 0;
-      }
-      else {
-      dprintf("... error: something wrong with adding child inode\n");
-      osErrno = E_CREATE;
-      return -1;
-      }
-    }
-  } else {
+  int parent_inode = follow_path_at(dir, pathname, &child_inode, last_fname, LOCK_WRITE);
+  if(parent_inode < 0) {
     dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
     osErrno = E_CREATE;
     return -1;
   }
+  int ret = -1;
+  if(child_inode >= 0) {
+    dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
+  } else if(add_inode(type, parent_inode, last_fname) >= 0) {
+    dprintf("... successfully created file/directory: '%s'\n", pathname);
+    ret = 0;
+  } else {
+    dprintf("... error: something wrong with adding child inode\n");
+  }
+  inode_unlock(parent_inode);
+  if(ret < 0) osErrno = E_CREATE;
+  return ret;
 }
  
+// release the inode 'child_inode': the data sectors of a file go on
+// the reclaim list, the inode is cleared, and its bit in the inode
+// bitmap is reset; return 0 if successful, -1 otherwise
+static int inode_free(int child_inode)
+{
+  inode_t child;
+  if(inode_read(child_inode, &child) < 0) return -1;
+  dprintf("... free inode %d (size=%d, type=%d)\n", child_inode, child.size, child.type);
+
+  // the data sectors go on the reclaim list; there's no need to
+  // zero them, since a sector is never read past the end of a file
+  if(child.type == 0 && inode_resize(&child, 0) < 0) {
+    dprintf("... error: free sectors occupied by file unsuccessful\n");
+    return -1;
+  }
+
+  // delete the child inode
+  memset(&child, 0, sizeof(inode_t));
+  if(inode_write(child_inode, &child) < 0) return -1;
+
+  // reset bit of child inode in bitmap
+  if (bitmap_free(&fs->inode_bitmap, child_inode) < 0) {
+    dprintf("... error: reset inode in bitmap unsuccessful\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int dirent_remove(int parent_inode, inode_t* parent, int child_inode);
+
 // remove the child from parent; the function is called by both
-// File_Unlink() and Dir_Unlink(); the function returns 0 if success,
-// -1 if general error, -2 if directory not empty, -3 if wrong type
-int remove_inode(int type, int parent_inode, int child_inode)
+// File_Unlink() and Dir_Unlink(); if 'keep' is set, only the directory
+// entry is removed and the inode stays allocated until inode_free() is
+// called on it (this is for files still open when unlinked); the
+// function returns 0 if success, -1 if general error, -2 if directory
+// not empty, -3 if wrong type; the caller holds the write locks of
+// both the parent and the child
+int remove_inode(int type, int parent_inode, int child_inode, int keep)
 {
  
   dprintf("... remove inode %d\n", child_inode);
  
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
- 
   // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = child_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+  inode_t child;
+  if(inode_read(child_inode, &child) < 0) return -1;
  
   // check for right type
-  if(child->type!=type){
+  if(child.type!=type){
     dprintf("... error: the type parameter does not match the actual inode type\n");
     return -3;
   }
  
   // check if child is non-empty directory
-  if(child->type==1 && child->size>0){
+  if(child.type==1 && child.size>0){
     dprintf("... error: inode is non-empty directory\n");
     return -2;
   }
  
-  // reset data blocks of file
-  if(type==0){
- 
-    /**
-      * DEBUGGING PRINT
-    */
-    dprintf("Inode size: %d, data sector 0: %d\n", child->size, child->data[0]);
- 
-    char data_buffer[SECTOR_SIZE];
-    int sectors = child->size/SECTOR_SIZE+(child->size%SECTOR_SIZE != 0 ? 1 : 0);
-    for(int i=0; i<sectors; i++){
-      if(Disk_Read(child->data[i], data_buffer) < 0) return -1;
-      dprintf("... delete contents of file with inode %d from sector %d\n",
-        child_inode, child->data[i]);
-      bzero(data_buffer, SECTOR_SIZE);
-      if(Disk_Write(child->data[i], data_buffer) < 0) return -1;
-      if (bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, child->data[i]) < 0) {
-      dprintf("... error: free sector occupied by file in sector bitmap unsuccessful\n");
-      return -1;
-      }
-    }
- 
-  }
- 
-  // delete the child inode
-  memset(child, 0, sizeof(inode_t));
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... delete inode %d, update disk sector %d\n",
-    child_inode, inode_sector);
- 
-  // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for parent inode %d from disk sector %d\n",
-   parent_inode, inode_sector);
- 
   // get the parent inode
-  inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  offset = parent_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+  inode_t parent;
+  if(inode_read(parent_inode, &parent) < 0) return -1;
   dprintf("... get parent inode %d (size=%d, type=%d)\n",
-   parent_inode, parent->size, parent->type);
+   parent_inode, parent.size, parent.type);
  
   // check if parent is directory
-  if(parent->type != 1) {
+  if(parent.type != 1) {
     dprintf("... error: parent inode is not directory\n");
     return -3;
   }
+  if(dirent_remove(parent_inode, &parent, child_inode) < 0) return -1;
+
+  // the child is gone from the directory; release it unless it's kept
+  if(!keep && inode_free(child_inode) < 0) return -1;
  
-  // check if parent is non-empty
-  if(parent->size < 1) {
-    dprintf("... error: parent directory has no entries\n");
+  return 0;
+}
+
+// remove the entry of 'child_inode' from the directory 'parent_inode'
+// (whose inode is 'parent'), the last entry taking its place; return
+// 0 if successful, -1 otherwise; the caller holds the write lock of
+// the parent
+static int dirent_remove(int parent_inode, inode_t* parent, int child_inode)
+{
+  // search for the dirent in every group
+  char dirent_buffer[SECTOR_SIZE];
+  int found = -1;
+  for(int i=0; i*DIRENTS_PER_SECTOR < parent->size && found < 0; i++) {
+    if(Disk_Read(parent->data[i], dirent_buffer) < 0) return -1;
+    dprintf("... search for child in disk sector %d for dirent group %d\n", parent->data[i], i);
+    int n = min(DIRENTS_PER_SECTOR, parent->size-i*DIRENTS_PER_SECTOR);
+    for(int j=0; j<n && found < 0; j++) {
+      if(((dirent_t*)dirent_buffer)[j].inode == child_inode) found = i*DIRENTS_PER_SECTOR+j;
+    }
+  }
+  if(found < 0) {
+    dprintf("... error: child inode could not be found in parent directory\n");
     return -1;
   }
+
+  // the last dirent takes the place of the removed one
+  int group = found/DIRENTS_PER_SECTOR;
+  int last = parent->size-1;
+  int last_group = last/DIRENTS_PER_SECTOR;
+  if(log_relocate(&parent->data[group], 0) < 0 ||
+     (last_group != group && log_relocate(&parent->data[last_group], 1) < 0)) return -1;
+  dirent_t* dirent = (dirent_t*)dirent_buffer+found%DIRENTS_PER_SECTOR;
+  if(last_group == group) {
+    dirent_t* last_dirent = (dirent_t*)dirent_buffer+last%DIRENTS_PER_SECTOR;
+    memcpy(dirent, last_dirent, sizeof(dirent_t));
+    memset(last_dirent, 0, sizeof(dirent_t));
+    if(meta_write(parent->data[group], dirent_buffer) < 0) return -1;
+  } else {
+    char last_dirent_buffer[SECTOR_SIZE];
+    if(Disk_Read(parent->data[last_group], last_dirent_buffer) < 0) return -1;
+    dirent_t* last_dirent = (dirent_t*)last_dirent_buffer+last%DIRENTS_PER_SECTOR;
+    memcpy(dirent, last_dirent, sizeof(dirent_t));
+    memset(last_dirent, 0, sizeof(dirent_t));
+    if(meta_write(parent->data[group], dirent_buffer) < 0) return -1;
+    if(meta_write(parent->data[last_group], last_dirent_buffer) < 0) return -1;
+  }
+  dprintf("... delete dirent %d (inode=%d) from group %d, move dirent %d in its place\n",
+          found, child_inode, group, last);
  
-  // reset bit of child inode in bitmap
-  if (bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, child_inode) < 0) {
-    dprintf("... error: reset inode in bitmap unsuccessful\n");
-    return -1;
+  // the last dirent sector is freed once it has no entries left
+  if(last%DIRENTS_PER_SECTOR == 0) {
+    if(reclaim_sector(parent->data[last_group]) < 0) {
+      dprintf("... error: free sector %d unsuccessful\n", parent->data[last_group]);
+      return -1;
+    }
+    parent->data[last_group] = 0;
   }
  
-  int remainder = parent->size % DIRENTS_PER_SECTOR;
-  int group = (parent->size)/DIRENTS_PER_SECTOR;
+  // update parent inode and write to disk
+  parent->size--;
+  if(inode_write(parent_inode, parent) < 0) return -1;
+  dprintf("... update parent inode %d size: %d\n", parent_inode, parent->size);
+  return 0;
+}
+
+// change the entry of 'child_inode' in the directory 'parent_inode'
+// (whose inode is 'parent') to be that of 'new_child', and named
+// 'file' unless NULL; return 0 if successful, -1 otherwise; the
+// caller holds the write lock of the parent
+static int dirent_replace(int parent_inode, inode_t* parent, int child_inode, int new_child, char* file)
+{
   char dirent_buffer[SECTOR_SIZE];
-  dirent_t* dirent;
-  int counter = 0;
-  int found = 0;
- 
-  // search for the dirent in every group
-  for(int i = 0; i<=group; i++){
- 
+  for(int i=0; i*DIRENTS_PER_SECTOR < parent->size; i++) {
     if(Disk_Read(parent->data[i], dirent_buffer) < 0) return -1;
-      dprintf("... search for child in disk sector %d for dirent group %d\n", parent->data[i], i);
- 
-    for(int j=0; j<DIRENTS_PER_SECTOR; j++){
-      counter ++;
-      dirent = (dirent_t*)(dirent_buffer+j*sizeof(dirent_t));
-      if(counter < parent->size && (!found)) {
- 
-        // Case 1: Child node found and last dirent in the same sector
-        if(dirent->inode == child_inode && i == group) {
-          dirent_t* last_dirent = (dirent_t*)(dirent_buffer+(remainder-1)*sizeof(dirent_t));
-          memcpy(dirent, last_dirent, sizeof(dirent_t));
-          memset(last_dirent, 0, sizeof(dirent_t));
-          if(Disk_Write(parent->data[i], dirent_buffer) < 0) return -1;
-          dprintf("... delete dirent (inode=%d) from group %d, update disk sector %d\n",
-          child_inode, i, parent->data[i]);
-          found=1;
- 
-        // Case 2: Child node found, but last dirent in other sector
-        } else if(dirent->inode == child_inode) {
-            char last_dirent_buffer[SECTOR_SIZE];
-            if(Disk_Read(parent->data[group], last_dirent_buffer) < 0) return -1;
-            dprintf("... load last dirent from parent %d in disk sector %d for dirent group %d\n",
-            parent_inode, parent->data[group], group);
-            dirent_t* last_dirent = (dirent_t*)(last_dirent_buffer+(remainder-1)*sizeof(dirent_t));
-            memcpy(dirent, last_dirent, sizeof(dirent_t));
-            memset(last_dirent, 0, sizeof(dirent_t));
-            if(Disk_Write(parent->data[i], dirent_buffer) < 0) return -1;
-            dprintf("...delete dirent (inode=%d) from group %d, update disk sector %d\n",
-              child_inode, i, parent->data[i]);
-            if(Disk_Write(parent->data[group], last_dirent_buffer) < 0) return -1;
-            dprintf("...copy last dirent with inode %d into group %d, update disk sector %d\n",
-              dirent->inode, group-1, parent->data[group]);
-            found=1;
-        }
- 
-      } else if(!found) {
- 
-        // Case 3: Child found and last dirent from parent
-        if(dirent->inode == child_inode) {
-          memset(dirent, 0, sizeof(dirent_t));
-          if(Disk_Write(parent->data[i], dirent_buffer) < 0) return -1;
-          dprintf("... delete dirent (inode=%d) from group %d, update disk sector %d\n",
-          child_inode, group, parent->data[i]);
-          found=1;
- 
-        // Case 4: Child node not found, and reached last dirent from parent
-        } else if(counter >= parent->size) {
-          dprintf("Counter: %d, Parent size: %d\n", counter, parent->size);
-          dprintf("... error: child inode could not be found in parent directory\n");
-          return -1;
-        }
+    int n = min(DIRENTS_PER_SECTOR, parent->size-i*DIRENTS_PER_SECTOR);
+    for(int j=0; j<n; j++) {
+      dirent_t* dirent = (dirent_t*)dirent_buffer+j;
+      if(dirent->inode != child_inode) continue;
+      dirent->inode = new_child;
+      if(file) {
+        memset(dirent->fname, 0, MAX_NAME);
+        strncpy(dirent->fname, file, MAX_NAME);
       }
+      int old = parent->data[i];
+      if(log_relocate(&parent->data[i], 0) < 0 || meta_write(parent->data[i], dirent_buffer) < 0)
+        return -1;
+      dprintf("... dirent %d of group %d (inode=%d) is now inode %d, name '%s'\n",
+              j, i, child_inode, new_child, dirent->fname);
+      // in the log, the sector has moved
+      if(parent->data[i] != old && inode_write(parent_inode, parent) < 0) return -1;
+      return 0;
     }
   }
+  dprintf("... error: child inode could not be found in parent directory\n");
+  return -1;
+}
  
-  // check for remaining dirents from parent in that sector (otherwise reset sector bitmap)
-  if (remainder == 1) {
-    // disk sector has to be freed
-  if(parent->data[group] == 0){dprintf("... parent->data[group]=%d\n", parent->data[group]);}
-    if (bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, parent->data[group]) < 0) {
-    dprintf("... error: free sector in bitmap unsuccessful\n");
-    return -1;
+// representing a file that is open; shared by all file descriptors
+// opened on the same inode, so they see the same size and data; the
+// cached inode is used with the inode lock held
+typedef struct _open_inode {
+  int inode;    // the inode of the file
+  int refcount; // number of file descriptors referring to this entry
+  int unlinked; // the file was unlinked while open, free it on last close
+  inode_t node; // cached copy of the inode, written through on change
+  uint64_t resv; // sectors reserved for the file and not used yet (see RESV)
+} open_inode_t;
+
+// the sectors of an open file are taken from a small run of
+// consecutive sectors reserved for it in the sector bitmap, so that
+// files written at the same time by several threads don't interleave
+// their sectors, and so that most allocations don't touch the bitmap;
+// the run is only refilled with the inode write locked, but it may be
+// given back at any time (on the last close of the file, by FS_Sync(),
+// or when the disk looks full), so it's kept in a single word changed
+// atomically: the next unused sector in the low half, and one past the
+// last reserved sector in the high half (0 if none ever)
+#define SECTOR_RESERVE 16
+#define RESV(next, end) ((uint64_t)(end) << 32 | (uint32_t)(next))
+#define RESV_NEXT(resv) ((int)(uint32_t)(resv))
+#define RESV_END(resv) ((int)((resv) >> 32))
+
+// take the next sector reserved for the open file; return -1 if none
+// is left
+static int file_sector_take(open_inode_t* of)
+{
+  uint64_t old = __atomic_load_n(&of->resv, __ATOMIC_ACQUIRE);
+  while(RESV_NEXT(old) < RESV_END(old)) {
+    if(__atomic_compare_exchange_n(&of->resv, &old, RESV(RESV_NEXT(old)+1, RESV_END(old)),
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return RESV_NEXT(old);
+  }
+  return -1;
+}
+
+// give the unused sectors reserved for the open file back to the
+// sector bitmap
+static void file_sector_release(open_inode_t* of)
+{
+  uint64_t old = __atomic_load_n(&of->resv, __ATOMIC_ACQUIRE);
+  while(RESV_NEXT(old) < RESV_END(old)) {
+    if(__atomic_compare_exchange_n(&of->resv, &old, RESV(RESV_END(old), RESV_END(old)),
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      dprintf("... release reserved sectors %d..%d of inode %d\n",
+              RESV_NEXT(old), RESV_END(old)-1, of->inode);
+      for(int i=RESV_NEXT(old); i<RESV_END(old); i++) bitmap_free(&fs->sector_bitmap, i);
+      return;
     }
-    parent->data[group] = 0;
   }
- 
-  // update parent inode and write to disk
-  parent->size--;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update parent inode on disk sector %d\n", inode_sector);
- 
-  return 0;
 }
- 
-// representing an open file
+
+// give the sectors reserved for all open files back to the sector
+// bitmap
+static void open_files_release()
+{
+  pthread_mutex_lock(&fs->open_lock);
+  for(int i=0; i<MAX_FILES; i++)
+    if(fs->open_inodes[i]) file_sector_release(fs->open_inodes[i]);
+  pthread_mutex_unlock(&fs->open_lock);
+}
+
+// allocate 'n' free data sectors for the open file, which is
+// write-locked, and return them through 'sectors', taking them from
+// the sectors reserved for the file and reserving more as needed;
+// either all 'n' sectors are allocated or none; return 0 if
+// successful, -1 otherwise
+static int file_sector_alloc(open_inode_t* of, int n, int* sectors)
+{
+  // in the log-structured layout, all files are written at the head of
+  // the log instead
+  if(fs->imap_start) return log_alloc(n, sectors);
+  int found = 0;
+  while(found < n) {
+    if((sectors[found] = file_sector_take(of)) >= 0) { found++; continue; }
+    // the next run goes right after the previous one if possible
+    int end = RESV_END(__atomic_load_n(&of->resv, __ATOMIC_ACQUIRE));
+    int first, hint = end/64;
+    int want = (n-found > SECTOR_RESERVE) ? n-found : SECTOR_RESERVE;
+    int got = bitmap_alloc_run(&fs->sector_bitmap, end ? &hint : &sector_bitmap_hint, want, &first);
+    if(got < 0) break;
+    dprintf("... reserve sectors %d..%d for inode %d\n", first, first+got-1, of->inode);
+    __atomic_store_n(&of->resv, RESV(first, first+got), __ATOMIC_RELEASE);
+  }
+  if(found == n) return 0;
+  // the disk looks full; give back what was taken and the sectors
+  // reserved for all open files, and let sector_alloc_batch() reclaim
+  // the queued sectors
+  for(int i=0; i<found; i++) bitmap_free(&fs->sector_bitmap, sectors[i]);
+  open_files_release();
+  return sector_alloc_batch(n, sectors);
+}
+
+// representing an open file descriptor
 typedef struct _open_file {
-  int inode; // pointing to the inode of the file (0 means entry not used)
-  int size;  // file size cached here for convenience
+  open_inode_t* file; // the shared open file (NULL means entry not used)
   int pos;   // read/write position within the data array
   int posByte; //starting byte to read from
+  int next_free; // next unused entry on the free list (-1 ends the list)
 } open_file_t;
-static open_file_t open_files[MAX_OPEN_FILES];
+
+// the file descriptor table grows by chunks of MAX_OPEN_FILES entries
+// whenever it runs out, up to MAX_OPEN_FILES_LIMIT; a chunk never
+// moves once allocated, so an fd in use can be looked up without
+// locking the table; unused entries are chained on a free list
+
+// the entry of file descriptor 'fd', which must be below open_files_limit()
+#define OPEN_FILE(fd) (fs->open_file_chunks[(fd)/MAX_OPEN_FILES][(fd)%MAX_OPEN_FILES])
+
+// return the number of file descriptors in the table
+static int open_files_limit()
+{
+  return __atomic_load_n(&fs->open_files_size, __ATOMIC_ACQUIRE);
+}
  
+// return the open file entry of the inode, NULL if it's not open
+static open_inode_t* find_open_inode(int inode)
+{
+  if(inode < 0 || inode >= MAX_FILES) return NULL;
+  return fs->open_inodes[inode];
+}
+
 // return true if the file pointed to by inode has already been open
 int is_file_open(int inode)
 {
-  for(int i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode == inode)
-      return 1;
-  }
-  return 0;
+  pthread_mutex_lock(&fs->open_lock);
+  int open = find_open_inode(inode) != NULL;
+  pthread_mutex_unlock(&fs->open_lock);
+  return open;
 }
+
+// return true if the directory, which the caller holds a lock of, has
+// been unlinked while a handle was open on it (it's left empty, and
+// kept until the last handle is closed)
+static int dir_unlinked(int dir)
+{
+  pthread_mutex_lock(&fs->open_lock);
+  open_inode_t* of = find_open_inode(dir);
+  int unlinked = of && of->unlinked;
+  pthread_mutex_unlock(&fs->open_lock);
+  return unlinked;
+}
+
  
-// return a new file descriptor not used; -1 if full
+// take a file descriptor off the free list, growing the table if the
+// list is empty; return -1 if the table can't grow any more
 int new_file_fd()
 {
-  for(int i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode <= 0)
-      return i;
+  pthread_mutex_lock(&fs->open_lock);
+  if(fs->open_files_free < 0 && fs->open_files_size < MAX_OPEN_FILES_LIMIT) {
+    int size = fs->open_files_size;
+    open_file_t* chunk = (open_file_t*)calloc(MAX_OPEN_FILES, sizeof(open_file_t));
+    if(chunk) {
+      dprintf("... grow file descriptor table to %d entries\n", size+MAX_OPEN_FILES);
+      // chain the new entries so that lower fds are handed out first
+      for(int i=0; i<MAX_OPEN_FILES; i++)
+        chunk[i].next_free = (i+1 < MAX_OPEN_FILES) ? size+i+1 : -1;
+      fs->open_file_chunks[size/MAX_OPEN_FILES] = chunk;
+      fs->open_files_free = size;
+      __atomic_store_n(&fs->open_files_size, size+MAX_OPEN_FILES, __ATOMIC_RELEASE);
+    }
   }
-  return -1;
+  int fd = fs->open_files_free;
+  if(fd >= 0) fs->open_files_free = OPEN_FILE(fd).next_free;
+  pthread_mutex_unlock(&fs->open_lock);
+  return fd;
 }
- 
-/* end of internal helper functions, start of API functions */
- 
-int FS_Boot(char* backstore_fname)
+
+// put an unused file descriptor back on the free list
+static void free_file_fd(int fd)
 {
-  dprintf("FS_Boot('%s'):\n", backstore_fname);
-  // initialize a new disk (this is a simulated disk)
-  if(Disk_Init() < 0) {
-    dprintf("... disk init failed\n");
-    osErrno = E_GENERAL;
-    return -1;
+  pthread_mutex_lock(&fs->open_lock);
+  OPEN_FILE(fd).file = NULL;
+  OPEN_FILE(fd).next_free = fs->open_files_free;
+  fs->open_files_free = fd;
+  pthread_mutex_unlock(&fs->open_lock);
+}
+
+// the rest of open_inode_get(), with the open files locked
+static open_inode_t* open_inode_get_locked(int inode)
+{
+  open_inode_t* of = find_open_inode(inode);
+  if(of) {
+    of->refcount++;
+    dprintf("... inode %d already open, refcount=%d\n", inode, of->refcount);
+  } else if((of = (open_inode_t*)calloc(1, sizeof(open_inode_t)))) {
+    if(inode_read(inode, &of->node) < 0) {
+      free(of);
+      of = NULL;
+    } else {
+      of->inode = inode;
+      of->refcount = 1;
+      fs->open_inodes[inode] = of;
+    }
   }
-  dprintf("... disk initialized\n");
- 
-  // we should copy the filename down; if not, the user may change the
-  // content pointed to by 'backstore_fname' after calling this function
-  strncpy(bs_filename, backstore_fname, 1024);
-  bs_filename[1023] = '\0'; // for safety
- 
-  // we first try to load disk from this file
-  if(Disk_Load(bs_filename) < 0) {
-    dprintf("... load disk from file '%s' failed\n", bs_filename);
- 
-    // if we can't open the file; it means the file does not exist, we
-    // need to create a new file system on disk
-    if(diskErrno == E_OPENING_FILE) {
-      dprintf("... couldn't open file, create new file system\n");
- 
-      // format superblock
-      char buf[SECTOR_SIZE];
-      memset(buf, 0, SECTOR_SIZE);
-      *(int*)buf = OS_MAGIC;
-      if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
-  dprintf("... failed to format superblock\n");
-  osErrno = E_GENERAL;
-  return -1;
-      }
-      dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
- 
-      // format inode bitmap (reserve the first inode to root)
-      //type for inode bitmap sector = 0
-       dprintf("... calling  bitmap int for inode bitmap with start=%d, num=%d, nbits=1\n",
-                    INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS);
-      bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1, 0);
-      dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
-       (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
-     
-      // format sector bitmap (reserve the first few sectors to
-      // superblock, inode bitmap, sector bitmap, and inode table)
-      //type for sector bitmap = 1
-      dprintf("... calling  bitmap int for sector bitmap with start=%d, num=%d, nbits=%ld\n",
-                SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, DATABLOCK_START_SECTOR);
-      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
-      DATABLOCK_START_SECTOR, 1);
-      dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
-       (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
-     
-      // format inode tables
-      for(int i=0; i<INODE_TABLE_SECTORS; i++) {
-  memset(buf, 0, SECTOR_SIZE);
-  if(i==0) {
-    // the first inode table entry is the root directory
-    ((inode_t*)buf)->size = 0;
-    ((inode_t*)buf)->type = 1;
+  return of;
+}
+
+// take a reference to the open file entry of the inode, loading the
+// inode into a new entry if the file isn't open yet; return NULL if
+// the inode can't be read; the caller holds a lock of the parent
+// directory, so the file can't be unlinked meanwhile
+static open_inode_t* open_inode_get(int inode)
+{
+  pthread_mutex_lock(&fs->open_lock);
+  open_inode_t* of = open_inode_get_locked(inode);
+  pthread_mutex_unlock(&fs->open_lock);
+  return of;
+}
+
+// drop a reference to the open file entry; the last reference to a
+// file unlinked while open releases its inode and data; return 0 if
+// successful, -1 otherwise
+static int open_inode_put(open_inode_t* of)
+{
+  pthread_mutex_lock(&fs->open_lock);
+  int last = (--of->refcount == 0);
+  int inode = of->inode, unlinked = of->unlinked;
+  if(last) {
+    fs->open_inodes[inode] = NULL;
+    file_sector_release(of);
+    free(of);
   }
-  if(Disk_Write(INODE_TABLE_START_SECTOR+i, buf) < 0) {
-    dprintf("... failed to format inode table\n");
-    osErrno = E_GENERAL;
-    return -1;
+  // nothing refers to the inode any more; it's freed with the open
+  // files still locked, like by an unlink, so that File_OpenInode()
+  // can't open it meanwhile
+  int ret = 0;
+  if(last && unlinked) {
+    dprintf("... last close of unlinked inode %d\n", inode);
+    ret = inode_free(inode);
   }
-      }
-      dprintf("... formatted inode table (start=%d, num=%d)\n",
-       (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
-     
-      // we need to synchronize the disk to the backstore file (so
-      // that we don't lose the formatted disk)
-      if(Disk_Save(bs_filename) < 0) {
-  // if can't write to file, something's wrong with the backstore
-  dprintf("... failed to save disk to file '%s'\n", bs_filename);
-  osErrno = E_GENERAL;
-  return -1;
-      } else {
-  // everything's good now, boot is successful
-  dprintf("... successfully formatted disk, boot successful\n");
-  memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
-  return 0;
-      }
-    } else {
-      // something wrong loading the file: invalid param or error reading
-      dprintf("... couldn't read file '%s', boot failed\n", bs_filename);
-      osErrno = E_GENERAL;
-      return -1;
-    }
-  } else {
-    dprintf("... load disk from file '%s' successful\n", bs_filename);
-   
-    // we successfully loaded the disk, we need to do two more checks,
-    // first the file size must be exactly the size as expected (thiis
-    // supposedly should be folded in Disk_Load(); and it's not)
-    int sz = 0;
-    FILE* f = fopen(bs_filename, "r");
-    if(f) {
-      fseek(f, 0, SEEK_END);
-      sz = ftell(f);
-      fclose(f);
-    }
-    if(sz != SECTOR_SIZE*TOTAL_SECTORS) {
-      dprintf("... check size of file '%s' failed\n", bs_filename);
-      osErrno = E_GENERAL;
-      return -1;
-    }
-    dprintf("... check size of file '%s' successful\n", bs_filename);
-   
-    // check magic
-    if(check_magic()) {
-      // everything's good by now, boot is successful
-      dprintf("... check magic successful\n");
-      memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
-      return 0;
-    } else {      
-      // mismatched magic number
-      dprintf("... check magic failed, boot failed\n");
-      osErrno = E_GENERAL;
-      return -1;
-    }
+  pthread_mutex_unlock(&fs->open_lock);
+  return ret;
+}
+
+// forget all open files, as when the file system is booted
+static void open_files_reset()
+{
+  for(int i=0; i<MAX_FILES; i++) {
+    free(fs->open_inodes[i]);
+    fs->open_inodes[i] = NULL;
   }
+  for(int i=0; i<OPEN_FILE_CHUNKS; i++) {
+    free(fs->open_file_chunks[i]);
+    fs->open_file_chunks[i] = NULL;
+  }
+  memset(fs->dir_handles, 0, sizeof(fs->dir_handles));
+  fs->open_files_size = 0;
+  fs->open_files_free = -1;
 }
  
-int FS_Sync()
+// metadata reaches the backstore file through the journal, in
+// transactions grouping all the operations done since the last
+// commit: each operation changing metadata runs between txn_begin()
+// and txn_end(), and a commit waits until no operation is running, so
+// that it logs whole operations only; an operation doesn't start while
+// a commit waits, nor if the metadata it may change could overflow the
+// journal (or when the log runs out of empty segments, so that the
+// cleaner runs), in which case it commits first; the file system
+// checker keeps operations from starting in the same way; an operation
+// that may change more metadata than most reserves room for it with
+// txn_reserve()
+#define TXN_MAX_SECTORS 32 // most metadata sectors changed by an operation
+#define TXN_MAX_RESERVE (JOURNAL_CAPACITY-INODE_BITMAP_SECTORS-SECTOR_BITMAP_SECTORS- \
+                         IMAP_SECTORS-TXN_MAX_SECTORS) // most room an operation reserves
+static __thread int txn_depth;   // operations nested in the calling thread
+static __thread int txn_sectors; // journal room reserved by the outermost one
+
+static int log_clean();
+static int imap_flush();
+
+static int flush_commit();
+
+// start an operation that changes at most 'sectors' metadata sectors
+// (no more than TXN_MAX_RESERVE)
+static void txn_reserve(int sectors)
 {
-  dprintf("FS_Sync():\n");
-  if(Disk_Save(bs_filename) < 0) {
-    // if can't write to file, something's wrong with the backstore
-    dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
-    osErrno = E_GENERAL;
-    return -1;
-  } else {
-    // everything's good now, sync is successful
-    dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
-    return 0;
+  if(txn_depth++ > 0) return;
+  pthread_mutex_lock(&fs->txn_lock);
+  for(;;) {
+    while(fs->txn_committing) pthread_cond_wait(&fs->txn_cond, &fs->txn_lock);
+    int room = JOURNAL_CAPACITY-INODE_BITMAP_SECTORS-SECTOR_BITMAP_SECTORS-IMAP_SECTORS-
+      __atomic_load_n(&fs->meta_dirty_count, __ATOMIC_RELAXED);
+    int full = fs->txn_reserved+sectors > room;
+    if(!full && !log_wants_clean()) break;
+    pthread_mutex_unlock(&fs->txn_lock);
+    dprintf(full ? "... journal full, commit before the operation\n" :
+            "... log out of empty segments, commit before the operation\n");
+    flush_commit();
+    pthread_mutex_lock(&fs->txn_lock);
   }
+  fs->txn_active++;
+  fs->txn_reserved += sectors;
+  txn_sectors = sectors;
+  pthread_mutex_unlock(&fs->txn_lock);
 }
- 
-int File_Create(char* file)
+
+static void txn_begin()
 {
-  dprintf("File_Create('%s'):\n", file);
-  return create_file_or_directory(0, file);
+  txn_reserve(TXN_MAX_SECTORS);
 }
- 
-int File_Unlink(char* file)
+
+static void txn_end()
 {
-  boldBlue();
-  dprintf("File_Unlink('%s'):\n", file);
-  reset();
+  if(--txn_depth > 0) return;
+  pthread_mutex_lock(&fs->txn_lock);
+  fs->txn_reserved -= txn_sectors;
+  if(--fs->txn_active == 0) pthread_cond_broadcast(&fs->txn_cond);
+  pthread_mutex_unlock(&fs->txn_lock);
+}
 
-  int child_inode;
- 
-  int parent_inode = follow_path(file, &child_inode, NULL);
- 
- 
-  if(child_inode >= 0) //file exists
-  {
-     //check if file is open
-    if(is_file_open(child_inode)){
-       dprintf("... %s is an open file. Cannot unlink\n", file);
-       osErrno = E_FILE_IN_USE;
-       return -1;
-    }
-   
-   
-   int remove = remove_inode(0, parent_inode, child_inode);
-   if(remove == -1){
-      dprintf("... error: general error when unlinking file\n");
-      osErrno = E_GENERAL;
-      return -1;
-   }
-   else if(remove == -3){
-      dprintf("... error: no file, incorrect type\n");
-      osErrno = E_NO_SUCH_FILE;
-      return -1;
-   }
-   else{
-       return 0;
-   }
- 
+// keep operations from starting until txn_resume(), and wait for those
+// running to end; calls may be nested
+static void txn_quiesce()
+{
+  pthread_mutex_lock(&fs->txn_lock);
+  fs->txn_committing++;
+  while(fs->txn_active > 0) pthread_cond_wait(&fs->txn_cond, &fs->txn_lock);
+  pthread_mutex_unlock(&fs->txn_lock);
+}
+
+static void txn_resume()
+{
+  pthread_mutex_lock(&fs->txn_lock);
+  if(--fs->txn_committing == 0) pthread_cond_broadcast(&fs->txn_cond);
+  pthread_mutex_unlock(&fs->txn_lock);
+}
+
+static unsigned journal_checksum(int seq, int count)
+{
+  // FNV-1a
+  unsigned h = 2166136261u;
+  unsigned char* p = (unsigned char*)&seq;
+  for(int i=0; i<sizeof(int); i++) h = (h^p[i])*16777619u;
+  p = (unsigned char*)fs->journal_tags;
+  for(int i=0; i<count*sizeof(int); i++) h = (h^p[i])*16777619u;
+  p = (unsigned char*)fs->journal_data;
+  for(int i=0; i<count*SECTOR_SIZE; i++) h = (h^p[i])*16777619u;
+  return h;
+}
+
+// write the journal header to disk and make it reach the backstore;
+// return 0 if successful, -1 otherwise
+static int journal_header(int seq, int count)
+{
+  char buf[SECTOR_SIZE];
+  memset(buf, 0, SECTOR_SIZE);
+  journal_header_t* hdr = (journal_header_t*)buf;
+  if(count > 0) {
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->seq = seq;
+    hdr->count = count;
+    hdr->checksum = journal_checksum(seq, count);
   }
- 
-  else{ //file does not exist
-    dprintf("... %s file does not exist\n", file);
-    osErrno = E_NO_SUCH_FILE;
+  if(Disk_Write(fs->journal_start, buf) < 0 || Disk_Flush(fs->journal_start, fs->journal_start+1) < 0)
     return -1;
- 
-  }
+  return 0;
 }
- 
-int File_Open(char* file)
+
+// write back what has changed since the last commit, with the flush
+// lock held: first a snapshot of the metadata is taken while no
+// operation runs; then the other sectors are written in place, so that
+// the metadata never points at data that hasn't landed yet; then the
+// metadata is logged to the journal, which commits it with a single
+// sequential write, and last copied in place (checkpointed); without a
+// journal, the metadata is just written in place after the data; in
+// the log-structured layout, the cleaner runs first if needed, and the
+// sectors given up before the commit are released after it; return 0
+// if successful, -1 otherwise
+static int flush_disk()
 {
-  boldBlue();
-  dprintf("File_Open('%s'):\n", file);
-  reset();
+  txn_quiesce();
 
-  int fd = new_file_fd();
- 
-  if(fd < 0) {
-    dprintf("... max open files reached\n");
-    osErrno = E_TOO_MANY_OPEN_FILES;
-    return -1;
-  }
- 
-  int child_inode;
-  follow_path(file, &child_inode, NULL);
- 
-  if(child_inode >= 0) { // child is the one, file exists
-    //check if file is already open
-    if(is_file_open(child_inode)){
-      dprintf("... error: %s is an open file already.\n", file);
-      osErrno = E_FILE_IN_USE;
-      return -1;
-    }
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
- 
-    // get the inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = child_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-    dprintf("... inode %d (size=%d, type=%d)\n",
-      child_inode, child->size, child->type);
- 
-    if(child->type != 0) {
-      dprintf("... error: '%s' is not a file\n", file);
-      osErrno = E_GENERAL;
-      return -1;
+  // the bitmaps and the inode map are only kept in memory until now
+  int ret = 0, n = 0;
+  if(log_wants_clean() && log_clean() < 0) ret = -1;
+  if(ret == 0 && (bitmap_flush(&fs->inode_bitmap) < 0 || bitmap_flush(&fs->sector_bitmap) < 0 ||
+                  imap_flush() < 0)) ret = -1;
+  for(int i=0; i<TOTAL_SECTORS && ret == 0; i++) {
+    if(!fs->meta_dirty[i]) continue;
+    if(n == JOURNAL_CAPACITY) {
+      // can't happen, as operations leave room for what they change
+      dprintf("... error: too many metadata sectors for the journal\n");
+      break;
     }
- 
-    // initialize open file entry and return its index
-    open_files[fd].inode = child_inode;
-    open_files[fd].size = child->size;
-    open_files[fd].pos = 0;
-    open_files[fd].posByte = 0;
- 
- 
-       
- 
-    return fd;
-  } else {
-    dprintf("... file '%s' is not found\n", file);
-    osErrno = E_NO_SUCH_FILE;
-    return -1;
-  }  
+    fs->meta_dirty[i] = 0;
+    int r = Disk_Take(i, fs->journal_data[n]);
+    if(r < 0) ret = -1;
+    else if(r > 0) fs->journal_tags[n++] = i;
+  }
+  __atomic_store_n(&fs->meta_dirty_count, 0, __ATOMIC_RELAXED);
+  // what's taken from the log from now on belongs to the next commit
+  int epoch = __atomic_fetch_add(&fs->log_epoch, 1, __ATOMIC_RELAXED);
+  txn_resume();
+  if(ret < 0) return -1;
+
+  // runs of consecutive sectors (most of them, with the log-structured
+  // layout) are written with a single write
+  int len = 0, start = 0;
+  for(int i=DATABLOCK_START_SECTOR; i<=TOTAL_SECTORS; i++) {
+    int r = 0;
+    if(i < TOTAL_SECTORS && !__atomic_load_n(&fs->meta_sectors[i], __ATOMIC_RELAXED) &&
+       (r = Disk_Take(i, fs->flush_run[len])) < 0) return -1;
+    if(r > 0 && len++ == 0) start = i;
+    if(len == 0 || (r > 0 && len < LOG_SEGMENT)) continue;
+    if(Disk_PutRun(start, len, fs->flush_run[0]) < 0) return -1;
+    len = 0;
+  }
+  if(Disk_Sync() < 0) return -1;
+
+  if(n > 0 && fs->journal_start) {
+    dprintf("... commit %d metadata sectors to the journal\n", n);
+    int first = fs->journal_start+1+JOURNAL_TAG_SECTORS;
+    for(int i=0; i<JOURNAL_TAG_SECTORS; i++)
+      if(Disk_Write(fs->journal_start+1+i, (char*)fs->journal_tags+i*SECTOR_SIZE) < 0) return -1;
+    for(int i=0; i<n; i++)
+      if(Disk_Write(first+i, fs->journal_data[i]) < 0) return -1;
+    if(Disk_Flush(fs->journal_start+1, first+n) < 0) return -1;
+    if(journal_header(fs->journal_seq+1, n) < 0) return -1;
+    fs->journal_seq++;
+  }
+  if(n > 0) {
+    for(int i=0; i<n; i++)
+      if(Disk_Put(fs->journal_tags[i], fs->journal_data[i]) < 0) return -1;
+    if(Disk_Sync() < 0) return -1;
+    // the transaction must not be replayed once its sectors are reused
+    if(fs->journal_start && journal_header(0, 0) < 0) return -1;
+  }
+  if(fs->imap_start) log_release(epoch);
+  return 0;
 }
 
-//Case 1: Size to read is bigger than the remaining size of file ->
-//        ask user if they wish to read the remaining size or nothing at all
-//Case 2: size to read is less than or equal to total file size -> read size to read
-int File_Read(int fd, void* buffer, int size)
+// commit now (when the journal is full)
+static int flush_commit()
 {
-  boldBlue();
-  dprintf("File_Read(%d, buffer, %d):\n", fd, size);
-  reset();
- 
-  //check if fd is valid index
-  if(fd < 0 || fd > MAX_OPEN_FILES){
-    blue();
-    dprintf("... fd=%d out of bound", fd);  
-    reset();  
-    osErrno = E_BAD_FD;
-    return -1;
+  pthread_mutex_lock(&fs->flush_lock);
+  int ret = flush_disk();
+  pthread_mutex_unlock(&fs->flush_lock);
+  return ret;
+}
+
+// replay the transaction left in the journal if the file system
+// wasn't shut down cleanly: its sectors may have been copied in place
+// only in part; return 0 if successful, -1 otherwise
+static int journal_replay()
+{
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(fs->journal_start, buf) < 0) return -1;
+  journal_header_t hdr = *(journal_header_t*)buf;
+  if(hdr.magic != JOURNAL_MAGIC) return 0;
+  fs->journal_seq = hdr.seq;
+  if(hdr.count <= 0 || hdr.count > JOURNAL_CAPACITY) return 0;
+  int first = fs->journal_start+1+JOURNAL_TAG_SECTORS;
+  for(int i=0; i<JOURNAL_TAG_SECTORS; i++)
+    if(Disk_Read(fs->journal_start+1+i, (char*)fs->journal_tags+i*SECTOR_SIZE) < 0) return -1;
+  for(int i=0; i<hdr.count; i++)
+    if(Disk_Read(first+i, fs->journal_data[i]) < 0) return -1;
+  if(hdr.checksum != journal_checksum(hdr.seq, hdr.count)) {
+    dprintf("... journal header doesn't match its transaction, ignored\n");
+    return 0;
   }
- 
-  open_file_t file = open_files[fd];
- 
-  //check if not an open file
-  if(file.inode <= 0){
-    blue();
-    dprintf("... fd=%d not an open file\n", fd);
-    reset();
-    osErrno = E_BAD_FD;
-    return -1;
+  dprintf("... replay %d sectors of journal transaction %d\n", hdr.count, hdr.seq);
+  for(int i=0; i<hdr.count; i++) {
+    if(fs->journal_tags[i] < 0 || fs->journal_tags[i] >= TOTAL_SECTORS ||
+       Disk_Write(fs->journal_tags[i], fs->journal_data[i]) < 0) return -1;
   }
- 
-   
-  //check if file size is empty
-  if(file.size == 0)
-  {
-    //none to read
-    blue();
-    dprintf("... file fd=%d is empty\n", fd);
-    reset();
-    return 0;
+  if(Disk_Flush(0, TOTAL_SECTORS) < 0) return -1;
+  return journal_header(0, 0);
+}
+
+// find the journal and replay it; return 0 if successful, -1
+// otherwise
+static int journal_find()
+{
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  fs->journal_start = ((superblock_t*)buf)->journal;
+  fs->journal_seq = 0;
+  return fs->journal_start ? journal_replay() : 0;
+}
+
+// mark a run of 'len' unused sectors used in the sector bitmap, for a
+// structure allocated while booting; return its first sector, or 0 if
+// there's no room
+static int sector_run_alloc(int len)
+{
+  int run = 0;
+  for(int i=DATABLOCK_START_SECTOR; i<TOTAL_SECTORS; i++) {
+    if(fs->sector_bitmap.words[i/64] & (1ULL << (i%64))) run = 0;
+    else if(++run == len) {
+      for(int j=i-len+1; j<=i; j++) fs->sector_bitmap.words[j/64] |= 1ULL << (j%64);
+      fs->sector_bitmap.dirty = 1;
+      return i-len+1;
+    }
   }
- 
-  /***determine how many sectors can actually be read***/
- 
-  //none to read, position at end of file
-  if(file.size - ((file.pos+1)*SECTOR_SIZE-(SECTOR_SIZE-file.posByte)) == 0)
-  {
-    blue();
-    dprintf("... file fd=%d is at end of file\n", fd);  
-    reset();  
+  return 0;
+}
+
+// make a journal if the file system has none yet (when it's first
+// booted), from a run of unused sectors; the sectors are marked used
+// on disk before the superblock records them; return 0 if successful,
+// -1 otherwise
+static int journal_alloc()
+{
+  // a read-only file system without a journal never needs one
+  if(fs->journal_start || fs->fs_readonly) return 0;
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  if(!(fs->journal_start = sector_run_alloc(JOURNAL_SECTORS))) {
+    dprintf("... no room for a journal, metadata is written in place\n");
     return 0;
   }
-  //something to read
-  //remaining file size left to read
-  int remFileSize = file.size - ((file.pos+1)*SECTOR_SIZE-(SECTOR_SIZE-file.posByte));
-  int sectorsToRead = 0;
- 
-  int sizeToRead = 0;
- 
-  sizeToRead = min(remFileSize,size);
+  if(journal_header(0, 0) < 0 || bitmap_flush(&fs->sector_bitmap) < 0 ||
+     Disk_Flush(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS) < 0)
+    return -1;
+  ((superblock_t*)buf)->journal = fs->journal_start;
+  if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0 || Disk_Flush(0, 1) < 0) return -1;
+  dprintf("... allocate journal at sectors %d..%d\n", fs->journal_start, (int)(fs->journal_start+JOURNAL_SECTORS-1));
+  return 0;
+}
 
-  //let user know that reading less than the initial size given
-  if(sizeToRead == remFileSize){
-    printf("... file fd=%d can only read remaining bytes of %d, not %d bytes\n", fd, remFileSize, size);
+// load the inode map if the file system is log-structured (otherwise
+// it points at the inode table), and start a new log; return 0 if
+// successful, -1 otherwise
+static int log_load()
+{
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  fs->imap_start = ((superblock_t*)buf)->imap;
+  fs->itable_hwm = ((superblock_t*)buf)->itable_hwm;
+  if(fs->itable_hwm <= 0 || fs->itable_hwm > INODE_TABLE_SECTORS) fs->itable_hwm = INODE_TABLE_SECTORS;
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) fs->imap[i] = INODE_TABLE_START_SECTOR+i;
+  for(int i=0; fs->imap_start && i<IMAP_SECTORS; i++)
+    if(Disk_Read(fs->imap_start+i, (char*)fs->imap+i*SECTOR_SIZE) < 0) return -1;
+  fs->imap_dirty = 0;
+  fs->log_head = -1;
+  fs->log_epoch = 1;
+  fs->log_dead = fs->log_stuck = 0;
+  memset(fs->sector_epoch, 0, sizeof(fs->sector_epoch));
+  memset(fs->dead_epoch, 0, sizeof(fs->dead_epoch));
+  if(fs->imap_start) dprintf("... log-structured, inode map at sector %d\n", fs->imap_start);
+  return 0;
+}
+
+// write the inode map to disk if it has changed; return 0 if
+// successful, -1 otherwise
+static int imap_flush()
+{
+  if(!fs->imap_start || !__atomic_exchange_n(&fs->imap_dirty, 0, __ATOMIC_ACQ_REL)) return 0;
+  for(int i=0; i<IMAP_SECTORS; i++) {
+    if(meta_write(fs->imap_start+i, (char*)fs->imap+i*SECTOR_SIZE) < 0) {
+      fs->imap_dirty = 1;
+      return -1;
+    }
   }
- 
- 
-  //if less than size is remaining, read only remaining
-  //else pick initial given size to read
- 
- 
-  //if posByte is at part of current sector
-  if(file.posByte != 0){
-    sectorsToRead++;//read only one sector
-    if(SECTOR_SIZE - file.posByte < sizeToRead){//need to read more sectors
-      int remSize = sizeToRead - (SECTOR_SIZE - file.posByte);
-      sectorsToRead += remSize/SECTOR_SIZE;
- 
-      //check for remainder
-      if(remSize%SECTOR_SIZE){
-        sectorsToRead++;
-      }
+  return 0;
+}
+
+// return the number of data sectors used by the file or directory
+static int inode_sectors(inode_t* node)
+{
+  int n = (node->type == 1) ? (node->size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR :
+    (node->size+SECTOR_SIZE-1)/SECTOR_SIZE;
+  return (n < MAX_SECTORS_PER_FILE) ? n : MAX_SECTORS_PER_FILE;
+}
+
+// find the sectors of the inode table, files and directories; return
+// 0 if successful, -1 otherwise
+static int log_scan()
+{
+  memset(fs->log_owned, 0, sizeof(fs->log_owned));
+  char buf[SECTOR_SIZE];
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) {
+    pthread_mutex_lock(&fs->itable_locks[i]);
+    int sector = fs->imap[i];
+    int ret = itable_read(i, buf);
+    pthread_mutex_unlock(&fs->itable_locks[i]);
+    if(ret < 0) return -1;
+    fs->log_owned[sector] = 1;
+    for(int j=0; j<INODES_PER_SECTOR && i*INODES_PER_SECTOR+j<MAX_FILES; j++) {
+      int inode = i*INODES_PER_SECTOR+j;
+      inode_t* node = (inode_t*)buf+j;
+      if(!(__atomic_load_n(&fs->inode_bitmap.words[inode/64], __ATOMIC_RELAXED) & (1ULL << (inode%64))))
+        continue;
+      for(int k=0; k<inode_sectors(node); k++)
+        if(node->data[k] > 0 && node->data[k] < TOTAL_SECTORS) fs->log_owned[node->data[k]] = 1;
     }
   }
-  else{//if posByte is at beginning of a sector
-    sectorsToRead = sizeToRead/SECTOR_SIZE;
- 
-    //check remainder
-    if(sizeToRead%SECTOR_SIZE){
-      sectorsToRead++;
+  return 0;
+}
+
+// the cleaner, run by a commit while no operation runs: it picks the
+// segments with the fewest sectors in use, skipping those that hold
+// anything but files, directories and the inode table (such as the
+// journal), copies those sectors in order to the head of the log, and
+// makes the inode map and the inodes refer to the copies; the segments
+// are empty once the commit is on disk; return 0 if successful, -1
+// otherwise
+static int log_clean()
+{
+  int* moved = fs->clean_moved;
+  int* copies = fs->clean_copies;
+  if(log_scan() < 0) return -1;
+
+  // the sectors in use (-1 if the segment can't be cleaned)
+  int live[LOG_SEGMENTS];
+  for(int w=0; w<LOG_SEGMENTS; w++) {
+    uint64_t used = __atomic_load_n(&fs->sector_bitmap.words[w], __ATOMIC_RELAXED);
+    live[w] = (w == fs->log_head || used == 0) ? -1 : 0;
+    for(int b=0; b<LOG_SEGMENT && live[w] >= 0; b++) {
+      int sector = w*LOG_SEGMENT+b;
+      if(!(used & (1ULL << b))) continue;
+      if(sector < DATABLOCK_START_SECTOR || sector >= TOTAL_SECTORS) live[w] = -1;
+      else if(fs->log_owned[sector]) live[w]++;
+      else if(!__atomic_load_n(&fs->dead_epoch[sector], __ATOMIC_RELAXED)) live[w] = -1;
     }
   }
-   
-  blue();
-  dprintf("... sectors to read=%d with size to read=%d of file size=%d at data[%d] at byte position=%d\n",
-            sectorsToRead, sizeToRead, file.size, file.pos, file.posByte);
-  reset();
- 
- /***get file inode***/
- 
-  //load file's inode disk sectors
-  int inode = file.inode;
-  int inode_sector = INODE_TABLE_START_SECTOR+inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
- 
-  blue();
-  dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-  reset();
- 
-  //get inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* fileInode = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
- 
-  blue();
-  dprintf("... inode %d (size=%d, type=%d)\n",
-            inode, fileInode->size, fileInode->type);
-  reset();
-   
-  int position = file.pos;
- 
-  /***read contents of data blocks***/
- 
-  //temp buffer to read entire sector in
-  char tempBuff[SECTOR_SIZE];
-  memset(buffer,0,sizeToRead);
- 
-  //will position buffer ptr to next available space to copy data into
-  int ctrSize = 0;
-  for(int i = 0; i < sectorsToRead; i++){
-    bzero(tempBuff, SECTOR_SIZE);
- 
-    if(Disk_Read(fileInode->data[position], tempBuff) < 0){
-      blue();
-      dprintf("... error: can't read sector %d\n", fileInode->data[position]);
-      reset();
-      osErrno=E_GENERAL;
-      return -1;      
+
+  // the emptiest segments first, until enough room is made; a segment
+  // mostly in use isn't worth copying
+  char victim[LOG_SEGMENTS];
+  memset(victim, 0, sizeof(victim));
+  int want = (LOG_CLEAN_HIGH-log_count_spare())*LOG_SEGMENT, won = 0, moves = 0, segs = 0;
+  for(int n=0; n<=LOG_SEGMENT*3/4 && won < want; n++) {
+    for(int w=0; w<LOG_SEGMENTS && won < want; w++) {
+      if(live[w] != n) continue;
+      victim[w] = 1;
+      won += LOG_SEGMENT-n;
+      moves += n;
+      segs++;
     }
- 
-    blue();
-    dprintf("... Reading data[%d]=%d at positionByte=%d\n",
-              position, fileInode->data[position], file.posByte);
-    reset();
- 
-    int currBytes = 0;  //keep track of what's currently read from sector
- 
-    if(file.posByte != 0){//starting out at arbitrary point in currsector
-      currBytes = SECTOR_SIZE - file.posByte;
+  }
+  if(segs == 0 || (moves > 0 && log_alloc(moves, copies) < 0)) {
+    dprintf("... cleaner found no segment to clean\n");
+    __atomic_store_n(&fs->log_stuck, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  __atomic_store_n(&fs->log_stuck, 0, __ATOMIC_RELAXED);
+  dprintf("... cleaner moves %d sectors out of %d segments\n", moves, segs);
+
+  memset(moved, 0, sizeof(fs->clean_moved));
+  int k = 0;
+  char buf[SECTOR_SIZE];
+  pthread_mutex_lock(&fs->refcount_lock);
+  for(int i=DATABLOCK_START_SECTOR; i<TOTAL_SECTORS && k<moves; i++) {
+    if(!victim[i/LOG_SEGMENT] || !fs->log_owned[i]) continue;
+    moved[i] = copies[k++];
+    int refs = refcount_get(i);
+    if(Disk_Read(i, buf) < 0 || Disk_Write(moved[i], buf) < 0 || refs < 0 ||
+       (refs > 0 && (refcount_adjust(i, -refs) < 0 || refcount_adjust(moved[i], refs) < 0))) {
+      pthread_mutex_unlock(&fs->refcount_lock);
+      return -1;
     }
-    else if(i == sectorsToRead - 1){//at last sector to read from
-      currBytes = sizeToRead - ctrSize;
-    }  
-    else{//full sectors
-      currBytes = SECTOR_SIZE;
+  }
+  int ret = refcount_flush();
+  pthread_mutex_unlock(&fs->refcount_lock);
+  if(ret < 0) return -1;
+
+  // the inode map first, so that the inodes are written to the copies
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) {
+    pthread_mutex_lock(&fs->itable_locks[i]);
+    if(moved[fs->imap[i]]) {
+      fs->imap[i] = moved[fs->imap[i]];
+      __atomic_store_n(&fs->imap_dirty, 1, __ATOMIC_RELEASE);
     }
-   
-    blue();
-    dprintf("... Copying data of %d bytes at %d into buffer ptr at %d\n",
-                currBytes, file.posByte, ctrSize);
-    reset();
- 
-    //copy what's needed into buffer from buff
-    memcpy(buffer+ctrSize, tempBuff+file.posByte, currBytes);
-   
-    ctrSize += currBytes;
- 
-    //specify new byte position if didn't read the entire last sector
-    if(i == sectorsToRead - 1 && file.posByte + currBytes < SECTOR_SIZE){
-      file.posByte = currBytes;
+    pthread_mutex_unlock(&fs->itable_locks[i]);
+  }
+  for(int inode=0; inode<MAX_FILES; inode++) {
+    if(!(__atomic_load_n(&fs->inode_bitmap.words[inode/64], __ATOMIC_RELAXED) & (1ULL << (inode%64))))
+      continue;
+    inode_t node;
+    int changed = 0;
+    inode_lock(inode, LOCK_WRITE);
+    ret = inode_read(inode, &node);
+    for(int i=0; ret == 0 && i<inode_sectors(&node); i++) {
+      if(node.data[i] <= 0 || node.data[i] >= TOTAL_SECTORS || !moved[node.data[i]]) continue;
+      node.data[i] = moved[node.data[i]];
+      changed = 1;
     }
-    else{//new byte position and block position if read entire sectors
-      position++;
-      file.posByte = 0;
+    if(changed) {
+      ret = inode_write(inode, &node);
+      // an open file refers to its sectors through its cached inode
+      pthread_mutex_lock(&fs->open_lock);
+      open_inode_t* of = find_open_inode(inode);
+      if(of) memcpy(of->node.data, node.data, sizeof(node.data));
+      pthread_mutex_unlock(&fs->open_lock);
     }
- 
- 
+    inode_unlock(inode);
+    if(ret < 0) return -1;
   }
- 
- 
-  //set new read/write position and new posbyte to read at  
-  open_files[fd].pos = position;
-  open_files[fd].posByte = file.posByte;  
- 
-  blue();
-  dprintf("... file=%d is now at pos=%d with byte pos=%d\n", fd, open_files[fd].pos, open_files[fd].posByte);
- 
-  dprintf("... successfully read %d sectors with size=%d\n", sectorsToRead, sizeToRead);
-  reset();
- 
-  return sizeToRead;
- 
-}
- 
-//helper function
-//gets user input on what action to take related to overwriting a file
-//when the file recently opens and is non-empty
-int toOverwriteOrNot(int fd){
-  int action = 0;
-  do{
-    printf("File of fd=%d is non-empty. Do you\n"
-          "1. wish to overwrite from position 0 (will delete entire file's contents)?\n"
-          "2. wish to append data from first empty position?\n"
-          "3. wish to not write?\n"
-          "Please input 1, 2 or 3 indicating your desired action.\n", fd);
-   
-    scanf("%d", &action);
-  }while(action != 1 && action != 2 && action != 3);
- 
-  return action;
+  for(int i=DATABLOCK_START_SECTOR; i<TOTAL_SECTORS; i++)
+    if(moved[i]) log_kill(i);
+  return 0;
 }
- 
-//ask user if want to write in only remaining available space or not
-//case: when size > sizeRem
-int ifWriteRem(int fd, int size, int sizeRem){
-  int action = 0;
 
-  do{
-    printf("File of fd=%d cannot write requested size=%d bytes. It has a space of size=%d bytes remaining. Do you\n"
-            "1. wish to write %d bytes from data given?\n"
-            "2. wish to not write at all?\n"
-            "Please input 1 or 2 indicating your desired actions.\n", fd, size, sizeRem, sizeRem);
-    scanf("%d", &action);
-  }while(action != 1 && action != 2);
+// rebuild the sector bitmap of a log-structured file system from what
+// the inode map and the inodes refer to: the sectors given up before
+// the last commit are still marked used on disk, since the bitmap was
+// written with that commit; return 0 if successful, -1 otherwise
+static int log_rebuild()
+{
+  if(log_scan() < 0) return -1;
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  for(int i=0; i<REFCOUNT_TABLE_SECTORS; i++) {
+    int sector = ((superblock_t*)buf)->refcount_table[i];
+    if(sector > 0 && sector < TOTAL_SECTORS) fs->log_owned[sector] = 1;
+  }
+  for(int i=0; fs->journal_start && i<JOURNAL_SECTORS; i++) fs->log_owned[fs->journal_start+i] = 1;
+  for(int i=0; i<IMAP_SECTORS; i++) fs->log_owned[fs->imap_start+i] = 1;
+  for(int i=0; i<DATABLOCK_START_SECTOR; i++) fs->log_owned[i] = 1;
 
-  return action;
+  int freed = 0;
+  for(int i=0; i<TOTAL_SECTORS; i++) {
+    uint64_t bit = 1ULL << (i%64);
+    if(!fs->log_owned[i] && (fs->sector_bitmap.words[i/64] & bit)) freed++;
+    if(fs->log_owned[i]) fs->sector_bitmap.words[i/64] |= bit;
+    else fs->sector_bitmap.words[i/64] &= ~bit;
+  }
+  if(freed > 0) {
+    dprintf("... %d sectors given up before the last commit are free\n", freed);
+    fs->sector_bitmap.dirty = 1;
+  }
+  log_count_spare();
+  return 0;
 }
 
-//case 1: file_write first called on empty file -> no checks, write into file
-//case 2: file_write first called on a recently opened non-empty file 
-//        or file ptr is at arbitrary point within file contents
-//        -> check if user wishes to overwrite
-//        if 1 -> overwrite from given position
-//        if 2 -> write only from the first empty position
-//        if 3 -> do not overwrite
-//Case 3: file_write called with a size bigger than remaining available space in a file 
-//        -> check if user wishes to write into remaining space 
-//        if 1 -> write into remaining space from data given 
-//        if 2 -> do not write
-int File_Write(int fd, void* buffer, int size)
+// switch the file system to the log-structured layout: the inode map,
+// which points at the inode table to start with, is written to a run
+// of unused sectors, which are marked used on disk before the
+// superblock records them; return 0 if successful, -1 otherwise
+static int log_format()
 {
-  boldBlue();
-  dprintf("File_Write(%d, buffer, %d):\n",fd, size);
-  reset();
-
-  //check if fd is valid index
-  if(fd < 0 || fd > MAX_OPEN_FILES){
-    blue();
-    dprintf("... error: fd=%d out of bound\n", fd);
-    reset();
-    osErrno = E_BAD_FD;
+  if(fs->imap_start) return 0;
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  int start = sector_run_alloc(IMAP_SECTORS);
+  if(!start) {
+    dprintf("... no room for the inode map\n");
     return -1;
   }
+  for(int i=0; i<IMAP_SECTORS; i++)
+    if(Disk_Write(start+i, (char*)fs->imap+i*SECTOR_SIZE) < 0) return -1;
+  if(Disk_Flush(start, start+IMAP_SECTORS) < 0 || bitmap_flush(&fs->sector_bitmap) < 0 ||
+     Disk_Flush(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS) < 0)
+    return -1;
+  ((superblock_t*)buf)->imap = start;
+  if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0 || Disk_Flush(0, 1) < 0) return -1;
+  fs->imap_start = start;
+  log_count_spare();
+  dprintf("... switch to the log-structured layout, inode map at sector %d\n", fs->imap_start);
+  return 0;
+}
 
-  open_file_t file = open_files[fd];
+// find out which sectors hold metadata; return 0 if successful, -1
+// otherwise
+static int meta_scan()
+{
+  memset(fs->meta_sectors, 0, sizeof(fs->meta_sectors));
+  memset(fs->meta_dirty, 0, sizeof(fs->meta_dirty));
+  fs->meta_dirty_count = 0;
+  for(int i=0; i<DATABLOCK_START_SECTOR; i++) fs->meta_sectors[i] = 1;
+  for(int i=0; fs->journal_start && i<JOURNAL_SECTORS; i++) fs->meta_sectors[fs->journal_start+i] = 1;
+  for(int i=0; fs->imap_start && i<IMAP_SECTORS; i++) fs->meta_sectors[fs->imap_start+i] = 1;
 
-  //check if not an open file
-  if(file.inode <= 0){
-    blue();
-    dprintf("... error: fd=%d not an open file\n", fd);
-    reset();
-    osErrno = E_BAD_FD;
-    return -1;
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  for(int i=0; i<REFCOUNT_TABLE_SECTORS; i++) {
+    int sector = ((superblock_t*)buf)->refcount_table[i];
+    if(sector > 0 && sector < TOTAL_SECTORS) fs->meta_sectors[sector] = 1;
   }
-    
-  //check if file size is full
-  if(file.size == MAX_SECTORS_PER_FILE*SECTOR_SIZE)
-  {
-    blue();
-    dprintf("... error: file fd=%d is full\n", fd);  
-    reset();
-    osErrno = E_FILE_TOO_BIG;
-    return 0;
+  // in the log-structured layout, directories are written like data
+  for(int i=0; i<INODE_TABLE_SECTORS && !fs->imap_start; i++) {
+    if(itable_read(i, buf) < 0) return -1;
+    for(int j=0; j<INODES_PER_SECTOR && i*INODES_PER_SECTOR+j<MAX_FILES; j++) {
+      int inode = i*INODES_PER_SECTOR+j;
+      inode_t* node = (inode_t*)buf+j;
+      if(!(fs->inode_bitmap.words[inode/64] & (1ULL << (inode%64))) || node->type != 1) continue;
+      for(int k=0; k*DIRENTS_PER_SECTOR < node->size && k<MAX_SECTORS_PER_FILE; k++)
+        if(node->data[k] > 0 && node->data[k] < TOTAL_SECTORS) fs->meta_sectors[node->data[k]] = 1;
+    }
   }
+  return 0;
+}
 
-  //load file's inode disk sectors
-  int inode = file.inode;
-  int inode_sector = INODE_TABLE_START_SECTOR+inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
+// set up the in-memory state for the disk just booted; return 0 if
+// successful, -1 otherwise
+static int boot_reset()
+{
+  open_files_reset();
+  fs->reclaim_count = 0;
+  free(fs->refcounts); fs->refcounts = NULL;
+  // the journal is replayed before anything else is read
+  if(journal_find() < 0) {
+    dprintf("... failed to replay journal\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(bitmap_load(&fs->inode_bitmap) < 0 || bitmap_load(&fs->sector_bitmap) < 0) {
+    dprintf("... failed to load bitmaps\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(log_load() < 0 || journal_alloc() < 0 || (fs->imap_start && log_rebuild() < 0) ||
+     meta_scan() < 0) {
+    dprintf("... failed to set up journal\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+ 
+/* end of internal helper functions, start of API functions */
+ 
+// boot from the backstore file with the given disk backend; shared by
+// FS_Boot(), FS_BootFile() and FS_BootReadOnly()
+static int boot(char* backstore_fname, int backend)
+{
+  pthread_once(&default_fs_once, default_fs_init);
+  Disk_SetBackend(backend);
+  fs->fs_readonly = (backend == DISK_READONLY);
+  // initialize a new disk (this is a simulated disk)
+  if(Disk_Init() < 0) {
+    dprintf("... disk init failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... disk initialized\n");
+ 
+  // we should copy the filename down; if not, the user may change the
+  // content pointed to by 'backstore_fname' after calling this function
+  strncpy(fs->bs_filename, backstore_fname, 1024);
+  fs->bs_filename[1023] = '\0'; // for safety
+ 
+  // we first try to load disk from this file
+  if(Disk_Load(fs->bs_filename) < 0) {
+    dprintf("... load disk from file '%s' failed\n", fs->bs_filename);
+ 
+    // if we can't open the file; it means the file does not exist, we
+    // need to create a new file system on disk (unless read-only)
+    if(diskErrno == E_OPENING_FILE && !fs->fs_readonly) {
+      dprintf("... couldn't open file, create new file system\n");
+ 
+      // format superblock
+      char buf[SECTOR_SIZE];
+      memset(buf, 0, SECTOR_SIZE);
+      *(int*)buf = OS_MAGIC;
+      ((superblock_t*)buf)->itable_hwm = 1; // only the root's inode table sector
+      if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
+  dprintf("... failed to format superblock\n");
+  osErrno = E_GENERAL;
+  return -1;
+      }
+      dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
+ 
+      // format inode bitmap (reserve the first inode to root)
+      //type for inode bitmap sector = 0
+       dprintf("... calling  bitmap int for inode bitmap with start=%d, num=%d, nbits=1\n",
+                    INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS);
+      bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1, 0);
+      dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
+       (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
+     
+      // format sector bitmap (reserve the first few sectors to
+      // superblock, inode bitmap, sector bitmap, and inode table)
+      //type for sector bitmap = 1
+      dprintf("... calling  bitmap int for sector bitmap with start=%d, num=%d, nbits=%ld\n",
+                SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, DATABLOCK_START_SECTOR);
+      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+      DATABLOCK_START_SECTOR, 1);
+      dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
+       (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
+     
+      // format the first sector of the inode table; the others are
+      // initialized when first used (see itable_hwm)
+      memset(buf, 0, SECTOR_SIZE);
+      // the first inode table entry is the root directory
+      ((inode_t*)buf)->size = 0;
+      ((inode_t*)buf)->type = 1;
+      if(Disk_Write(INODE_TABLE_START_SECTOR, buf) < 0) {
+  dprintf("... failed to format inode table\n");
+  osErrno = E_GENERAL;
+  return -1;
+      }
+      dprintf("... formatted inode table (start=%d, num=1 of %d)\n",
+       (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
+     
+      // we need to synchronize the disk to the backstore file (so
+      // that we don't lose the formatted disk)
+      if(Disk_Save(fs->bs_filename) < 0) {
+  // if can't write to file, something's wrong with the backstore
+  dprintf("... failed to save disk to file '%s'\n", fs->bs_filename);
+  osErrno = E_GENERAL;
+  return -1;
+      } else {
+  // everything's good now, boot is successful
+  dprintf("... successfully formatted disk, boot successful\n");
+  return boot_reset();
+      }
+    } else {
+      // something wrong loading the file: invalid param or error reading
+      dprintf("... couldn't read file '%s', boot failed\n", fs->bs_filename);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  } else {
+    // we successfully loaded the disk (Disk_Load() checks the file
+    // size), we need to do one more check
+    dprintf("... load disk from file '%s' successful\n", fs->bs_filename);
+   
+    // check magic
+    if(check_magic()) {
+      // everything's good by now, boot is successful
+      dprintf("... check magic successful\n");
+      return boot_reset();
+    } else {      
+      // mismatched magic number
+      dprintf("... check magic failed, boot failed\n");
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+}
 
-  blue();
-  dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-  reset();
+int FS_Boot(char* backstore_fname)
+{
+  dprintf("FS_Boot('%s'):\n", backstore_fname);
+  return boot(backstore_fname, DISK_MEMORY);
+}
 
-  //get inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* fileInode = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  blue();
-  dprintf("... inode %d (size=%d, type=%d)\n",
-            inode, fileInode->size, fileInode->type);
-  reset();
-   
-   /***check if user wishes to overwrite or not***/
+int FS_BootFile(char* backstore_fname)
+{
+  dprintf("FS_BootFile('%s'):\n", backstore_fname);
+  return boot(backstore_fname, DISK_FILE);
+}
 
-  //write data from after the given data pointer
-  int position = file.pos;
-  int action = 0;
-  int positionByte = file.posByte;
+int FS_BootReadOnly(char* backstore_fname)
+{
+  dprintf("FS_BootReadOnly('%s'):\n", backstore_fname);
+  return boot(backstore_fname, DISK_READONLY);
+}
 
-  //check cases for potential overwriting:
-  //if recently opened file is non-empty
-  //if current pointer is at arbitrary point within file contents
-  if(file.size - ((file.pos+1)*SECTOR_SIZE-(SECTOR_SIZE-file.posByte)) != 0){
-    //check if user wishes to overwrite
-    action = toOverwriteOrNot(fd);
-    if(action == 3){
-      blue();
-      printf("... User wishes to not overwrite already existing file. No write done\n");
-      reset();
-      return 0;
-    }
-    else if(action == 2){ //write only from the first empty position
-      position = file.size/SECTOR_SIZE;
-      positionByte = 0;
+int FS_BootLog(char* backstore_fname)
+{
+  dprintf("FS_BootLog('%s'):\n", backstore_fname);
+  if(boot(backstore_fname, DISK_MEMORY) < 0) return -1;
+  if(log_format() < 0 || meta_scan() < 0) {
+    dprintf("... failed to switch to the log-structured layout\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+ 
+// the disk is written back to the backstore file by FS_Sync(), and
+// in between by the background flusher if it's set up; the flusher
+// wakes up every 'flusher_interval' ms, or earlier once the writes
+// leave 'flusher_threshold' dirty sectors; 'flusher_lock' protects its
+// state and is never held with another lock
+
+// wake up the flusher early if enough sectors are dirty
+static void flush_poke()
+{
+  if(!__atomic_load_n(&fs->flusher_running, __ATOMIC_ACQUIRE) ||
+     __atomic_load_n(&fs->flusher_poked, __ATOMIC_RELAXED) ||
+     Disk_Dirty() < fs->flusher_threshold) return;
+  pthread_mutex_lock(&fs->flusher_lock);
+  __atomic_store_n(&fs->flusher_poked, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&fs->flusher_wake);
+  pthread_mutex_unlock(&fs->flusher_lock);
+}
+
+static void* flusher_main(void* arg)
+{
+  fs_enter((fs_t*)arg);
+  pthread_mutex_lock(&fs->flusher_lock);
+  while(!fs->flusher_stop) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += fs->flusher_interval/1000;
+    until.tv_nsec += fs->flusher_interval%1000*1000000L;
+    if(until.tv_nsec >= 1000000000L) { until.tv_sec++; until.tv_nsec -= 1000000000L; }
+    while(!fs->flusher_stop && !fs->flusher_poked &&
+          pthread_cond_timedwait(&fs->flusher_wake, &fs->flusher_lock, &until) == 0);
+    if(fs->flusher_stop) break;
+    __atomic_store_n(&fs->flusher_poked, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->flusher_lock);
+
+    if(flush_commit() < 0) dprintf("... flusher failed to write back dirty sectors\n");
+    pthread_mutex_lock(&fs->flusher_lock);
+  }
+  pthread_mutex_unlock(&fs->flusher_lock);
+  return NULL;
+}
+
+int FS_FlushSetup(int interval, int threshold)
+{
+  dprintf("FS_FlushSetup(%d, %d):\n", interval, threshold);
+  if(check_writable() < 0) return -1;
+  if(interval <= 0 || threshold <= 0 || fs->flusher_running) {
+    dprintf("... error: bad parameters, or already set up\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  fs->flusher_interval = interval;
+  fs->flusher_threshold = threshold;
+  fs->flusher_stop = 0;
+  __atomic_store_n(&fs->flusher_poked, 0, __ATOMIC_RELAXED);
+  if(pthread_create(&fs->flusher, NULL, flusher_main, fs)) {
+    dprintf("... error: can't start flusher thread\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  __atomic_store_n(&fs->flusher_running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int FS_FlushTeardown()
+{
+  dprintf("FS_FlushTeardown():\n");
+  if(!fs->flusher_running) return 0;
+  pthread_mutex_lock(&fs->flusher_lock);
+  fs->flusher_stop = 1;
+  pthread_cond_signal(&fs->flusher_wake);
+  pthread_mutex_unlock(&fs->flusher_lock);
+  pthread_join(fs->flusher, NULL);
+  __atomic_store_n(&fs->flusher_running, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int FS_Sync()
+{
+  dprintf("FS_Sync():\n");
+  // nothing is ever written back to a read-only backstore
+  if(fs->fs_readonly) return 0;
+  // only what the flusher hasn't written back yet is left to write
+  pthread_mutex_lock(&fs->flush_lock);
+  int ret = 0;
+  // sectors still waiting to be reclaimed or reserved for open files
+  // must not leak into the image
+  open_files_release();
+  if(reclaim_flush() < 0) {
+    dprintf("... failed to reclaim freed sectors\n");
+    ret = -1;
+  } else if(flush_disk() < 0) {
+    // if can't write to file, something's wrong with the backstore
+    dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", fs->bs_filename);
+    ret = -1;
+  } else {
+    // everything's good now, sync is successful
+    dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", fs->bs_filename);
+  }
+  pthread_mutex_unlock(&fs->flush_lock);
+  if(ret < 0) osErrno = E_GENERAL;
+  return ret;
+}
+
+// the file system checker, run with the flush lock held and operations
+// kept from starting: one pass over the inode table, split among a few
+// threads, copies the inodes and the entries of the directories; the
+// directory tree is then walked from the root in memory, and what the
+// files and directories reached use is compared with the bitmaps and
+// the reference counts
+#define CHECK_THREADS 4
+
+// find the sectors that hold the structures of the file system (and
+// that files and directories must not use); return 0 if successful, -1
+// otherwise
+static int check_mark_structures()
+{
+  char buf[SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+  memset(fs->check_struct, 0, sizeof(fs->check_struct));
+  for(int i=0; i<DATABLOCK_START_SECTOR; i++) fs->check_struct[i] = 1;
+  for(int i=0; fs->journal_start && i<JOURNAL_SECTORS; i++) fs->check_struct[fs->journal_start+i] = 1;
+  for(int i=0; fs->imap_start && i<IMAP_SECTORS; i++) fs->check_struct[fs->imap_start+i] = 1;
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) fs->check_struct[fs->imap[i]] = 1;
+  for(int i=0; i<REFCOUNT_TABLE_SECTORS; i++) {
+    int sector = ((superblock_t*)buf)->refcount_table[i];
+    if(sector > 0 && sector < TOTAL_SECTORS) fs->check_struct[sector] = 1;
+  }
+  return 0;
+}
+
+// return true if a file or directory may use the sector
+static int check_data_sector(int sector)
+{
+  return sector >= DATABLOCK_START_SECTOR && sector < TOTAL_SECTORS && !fs->check_struct[sector];
+}
 
-      if(file.size%SECTOR_SIZE){
-        positionByte = file.size%SECTOR_SIZE;
+// return true if the inode makes sense as a file or a directory (the
+// sectors of a file are checked later, as they can be fixed)
+static int check_inode(inode_t* node)
+{
+  if(node->type == 0) return node->size >= 0 && node->size <= MAX_FILE_SIZE;
+  if(node->type != 1 || node->size < 0 ||
+     node->size > MAX_SECTORS_PER_FILE*DIRENTS_PER_SECTOR) return 0;
+  for(int i=0; i<inode_sectors(node); i++)
+    if(!check_data_sector(node->data[i])) return 0;
+  return 1;
+}
+
+typedef struct _check_scan {
+  fs_t* fs;        // the file system checked
+  int first, last; // the inode table sectors to scan
+  int ret;         // 0 if successful, -1 otherwise
+} check_scan_t;
+
+// copy the inodes of a range of the inode table, and the entries of
+// the directories among them
+static void* check_scan(void* arg)
+{
+  check_scan_t* scan = (check_scan_t*)arg;
+  char buf[SECTOR_SIZE], dirent_buffer[SECTOR_SIZE];
+  fs_enter(scan->fs);
+  scan->ret = -1;
+  for(int i=scan->first; i<scan->last; i++) {
+    if(itable_read(i, buf) < 0) return NULL;
+    for(int j=0; j<INODES_PER_SECTOR && i*INODES_PER_SECTOR+j<MAX_FILES; j++) {
+      int inode = i*INODES_PER_SECTOR+j;
+      inode_t* node = &fs->check_nodes[inode];
+      memcpy(node, buf+j*sizeof(inode_t), sizeof(inode_t));
+      fs->check_valid[inode] = check_inode(node);
+      if(!fs->check_valid[inode] || node->type != 1 || node->size == 0) continue;
+      if(!(fs->check_dirents[inode] = (dirent_t*)malloc(node->size*sizeof(dirent_t)))) return NULL;
+      for(int k=0; k<inode_sectors(node); k++) {
+        if(Disk_Read(node->data[k], dirent_buffer) < 0) return NULL;
+        memcpy(fs->check_dirents[inode]+k*DIRENTS_PER_SECTOR, dirent_buffer,
+               min(DIRENTS_PER_SECTOR, node->size-k*DIRENTS_PER_SECTOR)*sizeof(dirent_t));
       }
-      blue();
-      dprintf("... User wishes to write from first empty byte position=%d in block position=%d with file size=%d\n",
-              positionByte, position, file.size);
-      reset();
     }
-    else{//wishes to overwrite. delete file contents
-      int pos = 0;
-      char dataBuffer[SECTOR_SIZE];
-      bzero(dataBuffer, SECTOR_SIZE);
-      while(fileInode->data[pos] != 0){
-        // disk sector has to be freed
-        if(Disk_Write(fileInode->data[pos], dataBuffer) < 0) return -1;
-        if (bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, fileInode->data[pos]) < 0) {
-          blue();
-          dprintf("... error: free sector occupied by file in sector bitmap unsuccessful\n");
-          reset();
-          return -1;
-        }
-        pos++;
+  }
+  scan->ret = 0;
+  return NULL;
+}
+
+// walk the directory tree from the root: an entry is bad if its name
+// is empty or not terminated, or if the inode it names is out of
+// range, makes no sense, or has been reached already (which also
+// breaks cycles); a bad entry gets inode -1; return the number of bad
+// entries
+static int check_walk()
+{
+  int* queue = fs->check_queue;
+  int head = 0, tail = 0, bad = 0;
+  memset(fs->check_live, 0, sizeof(fs->check_live));
+  memset(fs->check_bad, 0, sizeof(fs->check_bad));
+  fs->check_live[0] = 1;
+  queue[tail++] = 0;
+  while(head < tail) {
+    int dir = queue[head++];
+    for(int i=0; i<fs->check_nodes[dir].size; i++) {
+      dirent_t* dirent = &fs->check_dirents[dir][i];
+      int child = dirent->inode;
+      if(!dirent->fname[0] || !memchr(dirent->fname, 0, MAX_NAME) || child <= 0 ||
+         child >= MAX_FILES || !fs->check_valid[child] || fs->check_live[child]) {
+        dprintf("... bad entry %d of directory inode %d (inode=%d)\n", i, dir, child);
+        dirent->inode = -1;
+        fs->check_bad[dir]++;
+        bad++;
+        continue;
       }
-      position = 0;
-      positionByte = 0;
-      file.size = 0;
-      fileInode->size = 0;
-      blue();
-      dprintf("... User wishes to overwrite entire file. Starting at block position=%d with file size=%d\n",
-              position, file.size);
-      reset();
+      fs->check_live[child] = 1;
+      if(fs->check_nodes[child].type == 1) queue[tail++] = child;
     }
   }
+  return bad;
+}
 
-  int sizeToWrite = size;
+// commit if the journal may not have room for the next repair; return
+// 0 if successful, -1 otherwise
+static int check_room()
+{
+  int room = JOURNAL_CAPACITY-INODE_BITMAP_SECTORS-SECTOR_BITMAP_SECTORS-IMAP_SECTORS-
+    __atomic_load_n(&fs->meta_dirty_count, __ATOMIC_RELAXED);
+  return (room < TXN_MAX_SECTORS) ? flush_disk() : 0;
+}
 
-  //check if the rem space left is less than size to write
-  if(SECTOR_SIZE*MAX_SECTORS_PER_FILE - file.size < size){
-    blue();
-    dprintf("... error: fd=%d of size=%d at block position=%d at byte position=%d cannot add size=%d bytes.\n" 
-              "Ask user what they want to do\n", fd, file.size, position, positionByte, size);
-    reset();
-    if(ifWriteRem(fd, size, SECTOR_SIZE*MAX_SECTORS_PER_FILE - file.size) == 1){
-      sizeToWrite = SECTOR_SIZE*MAX_SECTORS_PER_FILE - file.size;
-      blue();
-      dprintf("... User chose to write only %d bytes to file=%d\n", sizeToWrite, fd);
-      reset();
-    }
-    else{
-      blue();
-      dprintf("... User chose to not write remaining %d bytes. Ending call\n", SECTOR_SIZE*MAX_SECTORS_PER_FILE - file.size);
-      osErrno = E_FILE_TOO_BIG;
-      return 0;
-    }
+// drop the bad entries of the directory, which is write-locked: the
+// others are packed and written back, and the sectors left empty are
+// given back; return 0 if successful, -1 otherwise
+static int check_fix_dir(int dir)
+{
+  inode_t node;
+  if(inode_read(dir, &node) < 0) return -1;
+  dirent_t* dirents = fs->check_dirents[dir];
+  int n = 0;
+  for(int i=0; i<fs->check_nodes[dir].size; i++)
+    if(dirents[i].inode >= 0) dirents[n++] = dirents[i];
+  char buf[SECTOR_SIZE];
+  for(int k=0; k*DIRENTS_PER_SECTOR<n; k++) {
+    memset(buf, 0, SECTOR_SIZE);
+    memcpy(buf, dirents+k*DIRENTS_PER_SECTOR, min(DIRENTS_PER_SECTOR, n-k*DIRENTS_PER_SECTOR)*sizeof(dirent_t));
+    if(log_relocate(&node.data[k], 0) < 0 || meta_write(node.data[k], buf) < 0) return -1;
+  }
+  for(int k=(n+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR; k<inode_sectors(&node); k++) {
+    if(reclaim_sector(node.data[k]) < 0) return -1;
+    node.data[k] = 0;
   }
+  dprintf("... drop %d bad entries of directory inode %d\n", node.size-n, dir);
+  node.size = n;
+  return inode_write(dir, &node);
+}
 
-  /***determine how many sectors need to be written in***/
+// find the sectors of the file, which is write-locked, that lie
+// outside the data blocks, and make them holes if 'repair' is set;
+// return their number, -1 on error
+static int check_fix_file(int inode, int repair)
+{
+  inode_t node;
+  if(inode_read(inode, &node) < 0) return -1;
+  int bad = 0;
+  for(int i=0; i<inode_sectors(&node); i++) {
+    if(node.data[i] == 0 || check_data_sector(node.data[i])) continue;
+    dprintf("... bad sector %d at data[%d] of file inode %d\n", node.data[i], i, inode);
+    node.data[i] = 0;
+    bad++;
+  }
+  if(bad == 0 || !repair) return bad;
+  if(inode_write(inode, &node) < 0) return -1;
+  pthread_mutex_lock(&fs->open_lock);
+  open_inode_t* of = find_open_inode(inode);
+  if(of) memcpy(of->node.data, node.data, sizeof(node.data));
+  pthread_mutex_unlock(&fs->open_lock);
+  return bad;
+}
 
-  int sectorsToWrite = 0;
+// the rest of FS_Check(), with the flush lock held and operations kept
+// from starting; return the number of problems found, -1 on error
+static int check_locked(int repair, fs_check_t* report)
+{
+  // the sectors reserved for open files and those waiting on the
+  // reclaim list aren't in use
+  open_files_release();
+  if(reclaim_flush() < 0 || check_mark_structures() < 0) return -1;
 
-  if(positionByte != 0){//if posByte is at part of current sector
-    sectorsToWrite++;
-    if(SECTOR_SIZE - positionByte < sizeToWrite){//need to write more sectors
-      int remSize = sizeToWrite - (SECTOR_SIZE - positionByte);
-      sectorsToWrite += remSize/SECTOR_SIZE;
+  pthread_t threads[CHECK_THREADS];
+  check_scan_t scans[CHECK_THREADS];
+  int ret = 0;
+  for(int i=0; i<CHECK_THREADS; i++) {
+    scans[i].fs = fs;
+    scans[i].first = i*INODE_TABLE_SECTORS/CHECK_THREADS;
+    scans[i].last = (i+1)*INODE_TABLE_SECTORS/CHECK_THREADS;
+    if(i > 0 && pthread_create(&threads[i], NULL, check_scan, &scans[i])) return -1;
+  }
+  check_scan(&scans[0]);
+  for(int i=0; i<CHECK_THREADS; i++) {
+    if(i > 0) pthread_join(threads[i], NULL);
+    if(scans[i].ret < 0) ret = -1;
+  }
+  if(ret < 0) return -1;
+  if(!fs->check_valid[0] || fs->check_nodes[0].type != 1) {
+    dprintf("... error: the root directory is damaged\n");
+    return -1;
+  }
+  report->bad_entries = check_walk();
+  // a file unlinked while open is kept until closed
+  pthread_mutex_lock(&fs->open_lock);
+  for(int i=0; i<MAX_FILES; i++)
+    if(find_open_inode(i) && bitmap_test(&fs->inode_bitmap, i)) fs->check_live[i] = 1;
+  pthread_mutex_unlock(&fs->open_lock);
 
-      //check for remainder
-      if(remSize%SECTOR_SIZE){
-        sectorsToWrite++;
+  for(int i=0; i<MAX_FILES; i++) {
+    if(!fs->check_live[i]) continue;
+    if(fs->check_nodes[i].type == 1) report->dirs++;
+    else report->files++;
+    int bad = 0;
+    if(fs->check_nodes[i].type == 1 && fs->check_bad[i] && repair) {
+      if((ret = check_room()) == 0) {
+        inode_lock(i, LOCK_WRITE);
+        ret = check_fix_dir(i);
+        inode_unlock(i);
       }
+    } else if(fs->check_nodes[i].type == 0 && (ret = check_room()) == 0) {
+      inode_lock(i, LOCK_WRITE);
+      ret = bad = check_fix_file(i, repair);
+      inode_unlock(i);
     }
+    if(ret < 0) return -1;
+    report->bad_sectors += bad;
   }
-  else{//if posByte is at beginning of a sector
-    sectorsToWrite = sizeToWrite/SECTOR_SIZE;
 
-    //check remainder
-    if(sizeToWrite%SECTOR_SIZE){
-      sectorsToWrite++;
+  char zero[SECTOR_SIZE];
+  memset(zero, 0, SECTOR_SIZE);
+  for(int i=0; i<MAX_FILES; i++) {
+    // formatting marks the inodes numbered like the sectors of the
+    // inode bitmap as used (see bitmap_init()), and they're never given out
+    if(!fs->check_live[i] && i >= INODE_BITMAP_START_SECTOR &&
+       i < INODE_BITMAP_START_SECTOR+INODE_BITMAP_SECTORS) continue;
+    int used = bitmap_test(&fs->inode_bitmap, i);
+    if(used && !fs->check_live[i]) {
+      dprintf("... inode %d is marked used but isn't reached\n", i);
+      report->lost_inodes++;
+      if(repair && ((ret = check_room()) < 0 ||
+                    (ret = inode_write(i, (inode_t*)zero)) < 0)) return -1;
+      if(repair) bitmap_free(&fs->inode_bitmap, i);
+    } else if(!used && fs->check_live[i]) {
+      dprintf("... inode %d is reached but isn't marked used\n", i);
+      report->unmarked_inodes++;
+      if(repair) bitmap_set(&fs->inode_bitmap, i);
     }
   }
 
-  blue();
-  dprintf("... extra sectors needed=%d for fd=%d at data[%d] at byte position=%d\n", sectorsToWrite,
-                  fd, position, positionByte);
-  reset();
+  // what the files and directories use once repaired
+  if(reclaim_flush() < 0 || check_room() < 0) return -1;
+  memset(fs->check_uses, 0, sizeof(fs->check_uses));
+  for(int i=0; i<MAX_FILES; i++) {
+    inode_t node;
+    if(!fs->check_live[i]) continue;
+    if(inode_read(i, &node) < 0) return -1;
+    for(int k=0; k<inode_sectors(&node); k++)
+      if(check_data_sector(node.data[k])) fs->check_uses[node.data[k]]++;
+  }
 
-  /***write into data blocks***/
-  
-  char tempBuff[SECTOR_SIZE];
-  int ctrSize = 0;
-  for(int i = 0; i < sectorsToWrite; i++){
-    //find first sector to use if starting at new position
-    int newsec = 0;
-    if(positionByte == 0){
-      newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-      
-      //check if space exists on disk for write
-      if(newsec < 0){
-        blue();
-        dprintf("... error: no space on disk, write cannot complete\n");
-        reset();
-        osErrno = E_NO_SPACE;
-        return -1;
-      }
-      fileInode->data[position] = newsec;
-    } 
-    
-    bzero(tempBuff, SECTOR_SIZE);
-    if(Disk_Read(fileInode->data[position], tempBuff) < 0){
-      blue();
-      dprintf("... error: can't read sector %d\n", fileInode->data[position]);
-      reset();
-      osErrno=E_GENERAL;
-      return -1;       
+  // a sector used n times has n-1 extra references
+  ret = 0;
+  pthread_mutex_lock(&fs->refcount_lock);
+  for(int i=DATABLOCK_START_SECTOR; i<TOTAL_SECTORS && ret == 0; i++) {
+    int want = (fs->check_uses[i] > 1) ? min(fs->check_uses[i]-1, MAX_REFCOUNT) : 0;
+    int refs = refcount_get(i);
+    if(refs < 0) ret = -1;
+    else if(refs != want) {
+      dprintf("... sector %d has %d extra references instead of %d\n", i, refs, want);
+      report->bad_refcounts++;
+      if(repair) ret = refcount_adjust(i, want-refs);
     }
-    
-    blue();
-    dprintf("... going to write into disk in sector %d\n", newsec);
-    reset();
-
-    int currBytes = 0;  //keep track of what's currently needed to extract from buffer
+  }
+  if(ret == 0 && repair) ret = refcount_flush();
+  pthread_mutex_unlock(&fs->refcount_lock);
+  // the reference count table may have just been allocated
+  if(ret < 0 || check_mark_structures() < 0) return -1;
 
-    if(positionByte != 0){//starting out at arbitrary point in currsector
-      currBytes = SECTOR_SIZE - positionByte;
-    }
-    else if(i == sectorsToWrite - 1){//at last sector to write into 
-      currBytes = sizeToWrite - ctrSize;
-    }   
-    else{//full sectors
-      currBytes = SECTOR_SIZE;
+  for(int i=0; i<TOTAL_SECTORS; i++) {
+    int used = bitmap_test(&fs->sector_bitmap, i);
+    int want = fs->check_struct[i] || fs->check_uses[i] ||
+      (fs->imap_start && __atomic_load_n(&fs->dead_epoch[i], __ATOMIC_RELAXED));
+    if(fs->check_uses[i]) report->sectors++;
+    if(used && !want) {
+      dprintf("... sector %d is marked used but isn't in use\n", i);
+      report->lost_sectors++;
+      if(repair) {
+        __atomic_store_n(&fs->meta_sectors[i], 0, __ATOMIC_RELAXED);
+        bitmap_free(&fs->sector_bitmap, i);
+      }
+    } else if(!used && want) {
+      dprintf("... sector %d is in use but isn't marked used\n", i);
+      report->unmarked_sectors++;
+      if(repair) bitmap_set(&fs->sector_bitmap, i);
     }
-    
-    blue();
-    dprintf("... copying data %d bytes from ptr position %d in buffer into tempbuff at position %d\n",
-            currBytes, ctrSize, positionByte);
-    reset();
+  }
+  if(fs->imap_start) log_count_spare();
+  return report->bad_entries+report->bad_sectors+report->lost_inodes+report->unmarked_inodes+
+    report->lost_sectors+report->unmarked_sectors+report->bad_refcounts;
+}
 
-    //copy what's needed from buffer into tempbuff
-    memcpy(tempBuff+positionByte, buffer+ctrSize, currBytes);
+int FS_Check(int repair, fs_check_t* report)
+{
+  dprintf("FS_Check(%d):\n", repair);
+  if(repair && check_writable() < 0) return -1;
+  fs_check_t counts;
+  memset(&counts, 0, sizeof(counts));
+  pthread_mutex_lock(&fs->flush_lock);
+  txn_quiesce();
+  int ret = check_locked(repair, &counts);
+  for(int i=0; i<MAX_FILES; i++) {
+    free(fs->check_dirents[i]);
+    fs->check_dirents[i] = NULL;
+  }
+  txn_resume();
+  // the repairs are committed right away
+  if(ret > 0 && repair && flush_disk() < 0) ret = -1;
+  pthread_mutex_unlock(&fs->flush_lock);
+  if(ret < 0) {
+    dprintf("... error: can't check the file system\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... %d problems found%s\n", ret, (ret > 0 && repair) ? " and fixed" : "");
+  if(report) *report = counts;
+  return ret;
+}
+ 
+int File_Create(char* file)
+{
+  dprintf("File_Create('%s'):\n", file);
+  if(check_writable() < 0) return -1;
+  txn_begin();
+  int ret = create_file_or_directory(-1, 0, file);
+  txn_end();
+  return ret;
+}
+ 
+// the rest of File_Clone(), within a transaction
+static int file_clone(char* src, char* dst)
+{
+  dprintf("File_Clone('%s', '%s'):\n", src, dst);
 
-    ctrSize += currBytes;//where to next extract from buffer
+  // the source must be an existing file
+  int src_inode;
+  int src_parent = follow_path(src, &src_inode, NULL, LOCK_READ);
+  if(src_parent >= 0 && src_inode < 0) inode_unlock(src_parent);
+  if(src_parent < 0 || src_inode < 0) {
+    dprintf("... error: file '%s' not found\n", src);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  lock_child(src_parent, src_inode, LOCK_READ);
+  inode_t node;
+  int ret = inode_read(src_inode, &node);
+  if(ret == 0 && node.type != 0) {
+    dprintf("... error: '%s' is not a file\n", src);
+    inode_unlock(src_inode);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
 
-    if(Disk_Write(fileInode->data[position], tempBuff) < 0) {
-      blue();
-      dprintf("... error: failed to write buffer data\n");
-      reset();
-      osErrno = E_GENERAL;
-      return -1;
+  // the clone shares all data sectors with the source; they will be
+  // copied only when one of the files writes to them; the references
+  // are taken now, so that the sectors stay even if the source is
+  // changed or unlinked before the clone is in place
+  if(ret == 0) ret = sector_share_all(&node);
+  inode_unlock(src_inode);
+  if(ret < 0) {
+    dprintf("... error: failed to share data sectors with clone\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // the destination must not exist yet
+  int dst_inode;
+  char last_fname[MAX_NAME];
+  int parent_inode = follow_path(dst, &dst_inode, last_fname, LOCK_WRITE);
+  if(parent_inode >= 0 && dst_inode >= 0) {
+    dprintf("... error: '%s' already exists\n", dst);
+    dst_inode = -1;
+  } else if(parent_inode >= 0 && (dst_inode = add_inode(0, parent_inode, last_fname)) >= 0 &&
+            inode_write(dst_inode, &node) < 0) {
+    dst_inode = -1;
+  }
+  if(parent_inode >= 0) inode_unlock(parent_inode);
+  if(dst_inode < 0) {
+    dprintf("... error: can't create clone '%s'\n", dst);
+    // give back the references taken above
+    int sectors = (node.size+SECTOR_SIZE-1)/SECTOR_SIZE;
+    for(int i=0; i<sectors; i++) {
+      if(node.data[i]) reclaim_sector(node.data[i]);
     }
-    blue();
-    dprintf("... Writing data[%d]=%d\n", position, fileInode->data[position]);
-    reset();
+    osErrno = E_CREATE;
+    return -1;
+  }
+  dprintf("... cloned inode %d to inode %d (size=%d)\n", src_inode, dst_inode, node.size);
+  return 0;
+}
+
+int File_Clone(char* src, char* dst)
+{
+  if(check_writable() < 0) return -1;
+  txn_begin();
+  int ret = file_clone(src, dst);
+  txn_end();
+  return ret;
+}
+
+// replace the content of the file 'inode' with the 'size' bytes at
+// 'map'; all the data sectors are allocated in one pass and filled
+// straight from 'map'; return 0 if successful, -1 otherwise (osErrno
+// is set)
+static int import_sectors(int inode, char* map, int size)
+{
+  inode_t node;
+  if(inode_read(inode, &node) < 0) { osErrno = E_GENERAL; return -1; }
+  if(node.type != 0) {
+    dprintf("... error: inode %d is not a file\n", inode);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(inode_resize(&node, 0) < 0) { osErrno = E_GENERAL; return -1; }
+
+  int sectors = (size+SECTOR_SIZE-1)/SECTOR_SIZE;
+  if(sector_alloc_batch(sectors, node.data) < 0) {
+    dprintf("... error: no space on disk for %d sectors\n", sectors);
+    inode_write(inode, &node);
+    osErrno = E_NO_SPACE;
+    return -1;
+  }
+  dprintf("... copy %d bytes into %d sectors starting at sector %d\n", size, sectors, node.data[0]);
 
-    //specify new byte position if didn't write the entire last sector
-    if(i == sectorsToWrite - 1 && positionByte + currBytes < SECTOR_SIZE){
-      positionByte = currBytes;
+  for(int i=0; i<sectors; i++) {
+    char* from = map+i*SECTOR_SIZE;
+    char buf[SECTOR_SIZE];
+    if((i+1)*SECTOR_SIZE > size) {
+      // the last sector is only partially covered by the host file
+      memset(buf, 0, SECTOR_SIZE);
+      memcpy(buf, from, size-i*SECTOR_SIZE);
+      from = buf;
     }
-    else{//new byte position and block position if read entire sectors
-      position++;
-      positionByte = 0;
+    if(Disk_Write(node.data[i], from) < 0) {
+      dprintf("... error: failed to write sector %d\n", node.data[i]);
+      node.size = i*SECTOR_SIZE;
+      inode_write(inode, &node);
+      osErrno = E_GENERAL;
+      return -1;
     }
-  } 
+  }
 
-  /***update file and file inode***/
+  node.size = size;
+  if(inode_write(inode, &node) < 0) { osErrno = E_GENERAL; return -1; }
+  return 0;
+}
 
-  //update file and inode size
-  open_files[fd].size = file.size + sizeToWrite;
-  open_files[fd].pos = position;
-  open_files[fd].posByte = positionByte;
+// the rest of File_ImportHost(), within a transaction
+static int file_import(char* file, char* hostfile)
+{
+  dprintf("File_ImportHost('%s', '%s'):\n", file, hostfile);
 
-  //set new inode size
-  fileInode->size = open_files[fd].size;
- 
+  // map the host file
+  int hfd = open(hostfile, O_RDONLY);
+  struct stat st;
+  if(hfd < 0 || fstat(hfd, &st) < 0) {
+    dprintf("... error: can't open host file '%s'\n", hostfile);
+    if(hfd >= 0) close(hfd);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(st.st_size > MAX_FILE_SIZE) {
+    dprintf("... error: host file '%s' has %ld bytes, too big\n", hostfile, (long)st.st_size);
+    close(hfd);
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
+  int size = (int)st.st_size;
+  char* map = NULL;
+  if(size > 0) {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, hfd, 0);
+    if(map == MAP_FAILED) {
+      dprintf("... error: can't map host file '%s'\n", hostfile);
+      close(hfd);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  close(hfd);
 
-  //write to disk the updated inode
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  blue();
-  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-                  inode, fileInode->size, fileInode->type, inode_sector); 
+  // find the destination, create it if needed; the parent stays
+  // locked until the content is in place
+  int child_inode;
+  char last_fname[MAX_NAME];
+  int parent_inode = follow_path(file, &child_inode, last_fname, LOCK_WRITE);
+  int ret = -1;
+  if(parent_inode < 0) {
+    dprintf("... error: something wrong with the file/path: '%s'\n", file);
+    osErrno = E_NO_SUCH_FILE;
+  } else if(child_inode >= 0 && is_file_open(child_inode)) {
+    dprintf("... error: %s is an open file\n", file);
+    osErrno = E_FILE_IN_USE;
+  } else if(child_inode < 0 && (child_inode = add_inode(0, parent_inode, last_fname)) < 0) {
+    dprintf("... error: can't create file '%s'\n", file);
+    osErrno = E_CREATE;
+  } else if(import_sectors(child_inode, map, size) == 0) {
+    dprintf("... imported %d bytes into '%s'\n", size, file);
+    ret = size;
+  }
+  if(parent_inode >= 0) inode_unlock(parent_inode);
 
-  dprintf("... file=%d is now at block pos=%d and byte position=%d with size=%d\n", 
-              fd, open_files[fd].pos, open_files[fd].posByte, open_files[fd].size);
-  reset();
-  return sizeToWrite;
+  if(map) munmap(map, size);
+  return ret;
 }
-int File_Seek(int fd, int offset)
+
+int File_ImportHost(char* file, char* hostfile)
 {
-  boldBlue();
-  dprintf("File_Seek(%d, %d):\n", fd, offset);
-  reset();
-  //check if fd is valid index
-  if(fd < 0 || fd > MAX_OPEN_FILES){
-    dprintf("... error: fd=%d out of bound\n", fd);
-    osErrno = E_BAD_FD;
-    return -1;    
+  if(check_writable() < 0) return -1;
+  txn_begin();
+  int ret = file_import(file, hostfile);
+  txn_end();
+  return ret;
+}
+
+// write the content of the file 'inode' to the host file 'hostfile';
+// return the number of bytes written, -1 otherwise (osErrno is set)
+static int export_sectors(int inode, char* hostfile)
+{
+  inode_t node;
+  if(inode_read(inode, &node) < 0) { osErrno = E_GENERAL; return -1; }
+  if(node.type != 0) {
+    dprintf("... error: inode %d is not a file\n", inode);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
   }
-  //check if open file
- if(open_files[fd].inode <= 0) {
-    dprintf("... error: fd=%d not an open file\n", fd);
-    osErrno = E_BAD_FD;
+
+  // size the host file up front and map it; holes are left as the
+  // zeros the host file starts out with
+  int hfd = open(hostfile, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if(hfd < 0 || ftruncate(hfd, node.size) < 0) {
+    dprintf("... error: can't create host file '%s'\n", hostfile);
+    if(hfd >= 0) close(hfd);
+    osErrno = E_GENERAL;
     return -1;
   }
-   
-  //check if offset is within bounds and if not at end of file
-  if(offset >= open_files[fd].size || offset == -1){
-     dprintf("... error: offset=%d out of bound\n", fd);
-     osErrno = E_SEEK_OUT_OF_BOUNDS;
+  if(node.size == 0) { close(hfd); return 0; }
+  char* map = mmap(NULL, node.size, PROT_READ|PROT_WRITE, MAP_SHARED, hfd, 0);
+  close(hfd);
+  if(map == MAP_FAILED) {
+    dprintf("... error: can't map host file '%s'\n", hostfile);
+    osErrno = E_GENERAL;
     return -1;
   }
- 
-  open_files[fd].pos = offset/SECTOR_SIZE;
-  open_files[fd].posByte = offset%SECTOR_SIZE;
- 
- dprintf("... file=%d now at position=%d at byte position=%d\n",
-          fd, open_files[fd].pos, open_files[fd].posByte);
 
-  return open_files[fd].pos;  
+  int sectors = (node.size+SECTOR_SIZE-1)/SECTOR_SIZE;
+  for(int i=0; i<sectors; i++) {
+    if(node.data[i] == 0) continue;
+    char buf[SECTOR_SIZE];
+    int partial = (i+1)*SECTOR_SIZE > node.size;
+    char* to = partial ? buf : map+i*SECTOR_SIZE;
+    if(Disk_Read(node.data[i], to) < 0) {
+      dprintf("... error: can't read sector %d\n", node.data[i]);
+      munmap(map, node.size);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    if(partial) memcpy(map+i*SECTOR_SIZE, buf, node.size-i*SECTOR_SIZE);
+  }
+
+  munmap(map, node.size);
+  return node.size;
 }
- 
-int File_Close(int fd)
+
+int File_ExportHost(char* file, char* hostfile)
 {
-  dprintf("File_Close(%d):\n", fd);
-  if(0 > fd || fd > MAX_OPEN_FILES) {
-    dprintf("... error: fd=%d out of bound\n", fd);
-    osErrno = E_BAD_FD;
-    return -1;
-  }
-  if(open_files[fd].inode <= 0) {
-    dprintf("... error: fd=%d not an open file\n", fd);
-    osErrno = E_BAD_FD;
+  dprintf("File_ExportHost('%s', '%s'):\n", file, hostfile);
+
+  int child_inode;
+  int parent_inode = follow_path(file, &child_inode, NULL, LOCK_READ);
+  if(parent_inode >= 0 && child_inode < 0) inode_unlock(parent_inode);
+  if(parent_inode < 0 || child_inode < 0) {
+    dprintf("... error: file '%s' not found\n", file);
+    osErrno = E_NO_SUCH_FILE;
     return -1;
   }
+  lock_child(parent_inode, child_inode, LOCK_READ);
+  int ret = export_sectors(child_inode, hostfile);
+  inode_unlock(child_inode);
+  if(ret >= 0) dprintf("... exported %d bytes from '%s'\n", ret, file);
+  return ret;
+}
+
+// the rest of File_Unlink(), within a transaction
+static int file_unlink(char* file)
+{
+  boldBlue();
+  dprintf("File_Unlink('%s'):\n", file);
+  reset();
+
+  int child_inode;
  
+  int parent_inode = follow_path(file, &child_inode, NULL, LOCK_WRITE);
  
  
-  dprintf("... file closed successfully\n");
-  open_files[fd].inode = 0;
-  return 0;
-}
+  if(parent_inode >= 0 && child_inode >= 0) //file exists
+  {
+    //the child is locked too, so that nobody is still reading it when
+    //it's freed
+    inode_lock(child_inode, LOCK_WRITE);
+
+    //an open file only loses its name now; the inode and data are
+    //released when the last file descriptor on it is closed
+    pthread_mutex_lock(&fs->open_lock);
+    open_inode_t* of = find_open_inode(child_inode);
+    if(of){
+       dprintf("... %s is an open file, defer freeing inode %d until closed\n", file, child_inode);
+    }
+   
+   int remove = remove_inode(0, parent_inode, child_inode, of != NULL);
+   if(remove == 0 && of) of->unlinked = 1;
+   pthread_mutex_unlock(&fs->open_lock);
+   inode_unlock(child_inode);
+   inode_unlock(parent_inode);
+
+   if(remove == -1){
+      dprintf("... error: general error when unlinking file\n");
+      osErrno = E_GENERAL;
+      return -1;
+   }
+   else if(remove == -3){
+      dprintf("... error: no file, incorrect type\n");
+      osErrno = E_NO_SUCH_FILE;
+      return -1;
+   }
+   else{
+       return 0;
+   }
  
-int Dir_Create(char* path)
+  }
+ 
+  else{ //file does not exist
+    if(parent_inode >= 0) inode_unlock(parent_inode);
+    dprintf("... %s file does not exist\n", file);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+ 
+  }
+}
+
+int File_Unlink(char* file)
 {
-  dprintf("Dir_Create('%s'):\n", path);
-  return create_file_or_directory(1, path);
+  if(check_writable() < 0) return -1;
+  txn_begin();
+  int ret = file_unlink(file);
+  txn_end();
+  return ret;
 }
- 
-int Dir_Unlink(char* path)
+
+// the rest of rename_inode(), with both parents write-locked
+static int rename_locked(int type, int from_parent, char* from, int to_parent, char* to)
 {
-   dprintf("Dir_Unlink('%s'):\n", path);
-     // no empty path and no root directory allowed
-  if(path==NULL) {
-    dprintf("... error: empty path (NULL) for directory unlink");
-    osErrno = E_GENERAL;
+  int src = find_child_inode(from_parent, from);
+  inode_t node;
+  if(src < 0 || inode_read(src, &node) < 0 || node.type != type) {
+    dprintf("... error: no %s '%s' to move\n", type ? "directory" : "file", from);
+    osErrno = type ? E_NO_SUCH_DIR : E_NO_SUCH_FILE;
     return -1;
   }
- 
-  if(strcmp(path, "/")==0) {
-    dprintf("... error: not allowed to unlink root directory");
-    osErrno = E_ROOT_DIR;
+  int dst = find_child_inode(to_parent, to);
+  if(dst == src) return 0;
+  if(dst < -1 || (dst >= 0 && (type == 1 || inode_read(dst, &node) < 0 || node.type != 0))) {
+    dprintf("... error: can't move to '%s' (inode=%d)\n", to, dst);
+    osErrno = E_CREATE;
     return -1;
   }
- 
-  // find parent and children (if theres any)
-  int child_inode;
-  int parent_inode = follow_path(path, &child_inode, NULL);
-  if(parent_inode < 0) {
-    dprintf("... error: directory '%s' not found\n", path);
-      osErrno = E_NO_SUCH_DIR;
+
+  inode_t parent;
+  int ret = 0;
+  if(dst >= 0) {
+    // the file replaced is locked, so nobody is reading it when it's
+    // freed; if it's open, it's only unlinked, like with File_Unlink()
+    dprintf("... replace inode %d with inode %d\n", dst, src);
+    inode_lock(dst, LOCK_WRITE);
+    pthread_mutex_lock(&fs->open_lock);
+    if(inode_read(from_parent, &parent) < 0 || dirent_remove(from_parent, &parent, src) < 0 ||
+       inode_read(to_parent, &parent) < 0 || dirent_replace(to_parent, &parent, dst, src, NULL) < 0)
+      ret = -1;
+    open_inode_t* of = find_open_inode(dst);
+    if(ret == 0 && of) of->unlinked = 1;
+    else if(ret == 0) ret = inode_free(dst);
+    pthread_mutex_unlock(&fs->open_lock);
+    inode_unlock(dst);
+  } else if(from_parent == to_parent) {
+    // only the name changes
+    if(inode_read(from_parent, &parent) < 0 || dirent_replace(from_parent, &parent, src, src, to) < 0)
+      ret = -1;
+  } else {
+    if(inode_read(to_parent, &parent) < 0) ret = -1;
+    else if(dir_full(&parent)) {
+      osErrno = E_CREATE;
       return -1;
+    }
+    if(ret == 0 && (dirent_add(to_parent, &parent, to, src) < 0 ||
+                    inode_read(from_parent, &parent) < 0 ||
+                    dirent_remove(from_parent, &parent, src) < 0))
+      ret = -1;
   }
- 
-  int remove = remove_inode(1, parent_inode, child_inode);
- 
-  if (remove==-1) {
-    dprintf("... error: general error when unlinking directory\n");
-    osErrno = E_GENERAL;
-    return -1;
-  } else if (remove==-3) {
-    dprintf("... error: no directory, wrong type\n");
-    osErrno = E_NO_SUCH_DIR;
+  if(ret < 0) osErrno = E_GENERAL;
+  return ret;
+}
+
+// move the file or directory (given by 'type') 'from' to 'to', which
+// only moves its directory entry; a file already at 'to' is replaced;
+// return 0 if successful, -1 on error (osErrno is set)
+static int rename_inode(int type, char* from, char* to)
+{
+  char from_store[MAX_PATH], to_store[MAX_PATH];
+  char* from_tokens[MAX_PATH/2];
+  char* to_tokens[MAX_PATH/2];
+  int nfrom = path_split(from, from_store, from_tokens);
+  int nto = path_split(to, to_store, to_tokens);
+  if(nfrom <= 0) {
+    dprintf("... error: can't move '%s'\n", from ? from : "(null)");
+    osErrno = (nfrom == 0) ? E_ROOT_DIR : type ? E_NO_SUCH_DIR : E_NO_SUCH_FILE;
     return -1;
-  } else if (remove==-2) {
-    dprintf("... error: directory %s not empty", path);
-    osErrno = E_DIR_NOT_EMPTY;
+  }
+  if(nto <= 0) {
+    dprintf("... error: can't move to '%s'\n", to ? to : "(null)");
+    osErrno = E_CREATE;
     return -1;
-  } else {
-    return 0;
   }
- 
- 
-}
- 
-int Dir_Size(char* path)
-{
-  dprintf("Dir_Size('%s'):\n", path);
-  // no empty path allowed
-  if(path==NULL) {
-    dprintf("... error: empty path (NULL) given as parameter\n");
+
+  // the names the two paths start with
+  int common = 0;
+  while(common < nfrom && common < nto && !strcmp(from_tokens[common], to_tokens[common])) common++;
+  if(type == 1 && common == nfrom && nto > nfrom) {
+    dprintf("... error: can't move '%s' under itself\n", from);
     osErrno = E_GENERAL;
     return -1;
   }
- 
-  // directory has to exist
-  int child_inode;
-  int parent_inode = follow_path(path, &child_inode, NULL);
-  if(parent_inode < 0) {
-    dprintf("... error: directory '%s' not found\n", path);
-      osErrno = E_NO_SUCH_DIR;
-      return -1;
+
+  int from_parent, to_parent, child;
+  int same = (nfrom == nto && common >= nfrom-1);
+  if(same) from_parent = to_parent = follow_path(from, &child, NULL, LOCK_WRITE);
+  else {
+    // no directory moves or goes away meanwhile, so the parents stay
+    // what the paths lead to; one above the other is locked first
+    pthread_rwlock_wrlock(&fs->rename_lock);
+    from_parent = follow_path(from, &child, NULL, LOCK_NONE);
+    to_parent = follow_path(to, &child, NULL, LOCK_NONE);
+    if(from_parent >= 0 && to_parent >= 0) {
+      int to_first = (nto < nfrom && common >= nto-1);
+      inode_lock(to_first ? to_parent : from_parent, LOCK_WRITE);
+      if(to_parent != from_parent) inode_lock(to_first ? from_parent : to_parent, LOCK_WRITE);
+    }
   }
- 
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
- 
-  // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = child_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
- 
-  // check for type
-  if (child->type!=1) {
-    dprintf("... error: wrong type, path leads to file\n");
-    osErrno = E_GENERAL;
+  if(from_parent < 0 || to_parent < 0) {
+    if(!same) pthread_rwlock_unlock(&fs->rename_lock);
+    dprintf("... error: the directory of '%s' not found\n", from_parent < 0 ? from : to);
+    osErrno = (from_parent < 0) ? (type ? E_NO_SUCH_DIR : E_NO_SUCH_FILE) : E_CREATE;
     return -1;
   }
- 
-  return child->size*sizeof(dirent_t);
+
+  int ret = rename_locked(type, from_parent, from_tokens[nfrom-1], to_parent, to_tokens[nto-1]);
+  if(to_parent != from_parent) inode_unlock(to_parent);
+  inode_unlock(from_parent);
+  if(!same) pthread_rwlock_unlock(&fs->rename_lock);
+  return ret;
+}
+
+int File_Rename(char* from, char* to)
+{
+  dprintf("File_Rename('%s', '%s'):\n", from, to);
+  if(check_writable() < 0) return -1;
+  txn_begin();
+  int ret = rename_inode(0, from, to);
+  txn_end();
+  return ret;
 }
  
-int Dir_Read(char* path, void* buffer, int size)
+// the rest of file_open_at() and File_OpenInode(), given the open
+// file entry 'of' of the inode: the file descriptor 'fd' is set up if
+// the inode is a file; otherwise both are released; return the file
+// descriptor if successful, -1 otherwise
+static int file_open_fd(int fd, open_inode_t* of)
 {
-  dprintf("Dir_Read('%s', buffer, %d):\n", path, size);
+  inode_lock(of->inode, LOCK_READ);
+  int type = of->node.type;
+  dprintf("... inode %d (size=%d, type=%d)\n",
+    of->inode, of->node.size, type);
+  inode_unlock(of->inode);
  
-  // no empty path allowed
-  if(path==NULL) {
-    dprintf("... error: empty path (NULL) given as parameter\n");
+  if(type != 0) {
+    dprintf("... error: inode %d is not a file\n", of->inode);
+    open_inode_put(of);
+    free_file_fd(fd);
     osErrno = E_GENERAL;
     return -1;
   }
  
-  // directory has to exist
-  int inode;
-  int parent_inode = follow_path(path, &inode, NULL);
-  if(parent_inode < 0) {
-    dprintf("... error: directory '%s' not found\n", path);
-      osErrno = E_NO_SUCH_DIR;
-      return -1;
-  }
+  // initialize open file entry and return its index
+  OPEN_FILE(fd).pos = 0;
+  OPEN_FILE(fd).posByte = 0;
+  OPEN_FILE(fd).file = of;
  
-  // check if size parameter matches the actual directory size
-  int act_size = Dir_Size(path);
-  if (size>act_size) {
-    dprintf("... error: size parameter %d does not match actual directory size of %d bytes.\n",
-      size, act_size);
-    osErrno=E_GENERAL;
+  return fd;
+}
+
+// the rest of File_Open() and File_OpenAt(); a relative path is
+// followed from the directory 'dir' (-1 if none)
+static int file_open_at(int dir, char* file)
+{
+  int fd = new_file_fd();
+ 
+  if(fd < 0) {
+    dprintf("... max open files reached\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
     return -1;
   }
  
-  // check if size of buffer is large enough to hold all elements in the directory
-  int buf_size = (int)malloc_usable_size(buffer);
-  if (size>buf_size) {
-    dprintf("... error: buffer provided has size %d, but %d bytes required\n",
-      buf_size, size);
-    osErrno=E_BUFFER_TOO_SMALL;
+  int child_inode;
+  int parent_inode = follow_path_at(dir, file, &child_inode, NULL, LOCK_READ);
+ 
+  if(parent_inode >= 0 && child_inode >= 0) { // child is the one, file exists
+    //a file open already shares its entry (and cached inode) with the
+    //new file descriptor; otherwise the inode is loaded from disk
+    open_inode_t* of = open_inode_get(child_inode);
+    inode_unlock(parent_inode);
+    if(!of) { free_file_fd(fd); osErrno = E_GENERAL; return -1; }
+    return file_open_fd(fd, of);
+  } else {
+    if(parent_inode >= 0) inode_unlock(parent_inode);
+    dprintf("... file '%s' is not found\n", file);
+    free_file_fd(fd);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }  
+}
+
+int File_Open(char* file)
+{
+  boldBlue();
+  dprintf("File_Open('%s'):\n", file);
+  reset();
+  return file_open_at(-1, file);
+}
+
+int File_OpenInode(int inode)
+{
+  dprintf("File_OpenInode(%d):\n", inode);
+  int fd = new_file_fd();
+  if(fd < 0) {
+    dprintf("... max open files reached\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+
+  // an inode is allocated and freed with the open files locked, so
+  // with them locked, an inode marked used in the bitmap is whole, and
+  // stays in use once it has an open file entry; a file unlinked while
+  // open has no name left, and can't be opened again
+  open_inode_t* of = NULL;
+  pthread_mutex_lock(&fs->open_lock);
+  if(inode >= 0 && inode < MAX_FILES && bitmap_test(&fs->inode_bitmap, inode)) {
+    open_inode_t* old = find_open_inode(inode);
+    if(!old || !old->unlinked) of = open_inode_get_locked(inode);
+  }
+  pthread_mutex_unlock(&fs->open_lock);
+  if(!of) {
+    dprintf("... inode %d is not in use\n", inode);
+    free_file_fd(fd);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  return file_open_fd(fd, of);
+}
+
+//helper function
+//copy n bytes between buf and the vector, starting at buffer *iv and
+//byte *ivoff within it, and move that position forward; out set
+//copies from buf into the vector, otherwise from the vector into buf
+static void iovec_copy(fs_iovec_t* iov, int* iv, int* ivoff, char* buf, int n, int out)
+{
+  while(n > 0){
+    int len = min(n, iov[*iv].len - *ivoff);
+    if(out) memcpy((char*)iov[*iv].base + *ivoff, buf, len);
+    else memcpy(buf, (char*)iov[*iv].base + *ivoff, len);
+    buf += len;
+    n -= len;
+    *ivoff += len;
+    if(*ivoff == iov[*iv].len){
+      (*iv)++;
+      *ivoff = 0;
+    }
+  }
+}
+
+//helper function
+//read size bytes from byte offsetByte of the open file into the
+//vector; each sector is read once, holes read as zeros; the caller
+//holds the inode lock and has checked that the bytes exist
+static int read_vector(open_inode_t* of, fs_iovec_t* iov, int size, int offsetByte)
+{
+  inode_t* fileInode = &of->node;
+
+  char tempBuff[SECTOR_SIZE];
+  int iv = 0, ivoff = 0;
+  int ctrSize = 0;
+  while(ctrSize < size){
+    int position = (offsetByte+ctrSize)/SECTOR_SIZE;
+    int positionByte = (offsetByte+ctrSize)%SECTOR_SIZE;
+    //read up to the end of the current sector
+    int currBytes = min(SECTOR_SIZE - positionByte, size - ctrSize);
+
+    if(fileInode->data[position] == 0){//a hole reads as zeros, no disk access
+      blue();
+      dprintf("... Reading hole data[%d] at positionByte=%d\n", position, positionByte);
+      reset();
+      memset(tempBuff, 0, SECTOR_SIZE);
+    }
+    else{
+      if(Disk_Read(fileInode->data[position], tempBuff) < 0){
+        blue();
+        dprintf("... error: can't read sector %d\n", fileInode->data[position]);
+        reset();
+        osErrno=E_GENERAL;
+        return -1;
+      }
+      blue();
+      dprintf("... Reading data[%d]=%d at positionByte=%d, %d bytes\n",
+                position, fileInode->data[position], positionByte, currBytes);
+      reset();
+    }
+
+    iovec_copy(iov, &iv, &ivoff, tempBuff+positionByte, currBytes, 1);
+    ctrSize += currBytes;
+  }
+  return size;
+}
+
+//helper function
+//write size bytes from the vector at byte startByte of the open file;
+//the sectors missing (past the end of file or in a hole) are allocated
+//in one pass, then each sector touched is written once and the inode
+//once at the end; the caller holds the inode write lock and has
+//checked that the bytes fit in the file
+static int write_vector(open_inode_t* of, fs_iovec_t* iov, int size, int startByte)
+{
+  inode_t* fileInode = &of->node;
+  int endByte = startByte+size;
+  if(size <= 0) return 0;
+  int first = startByte/SECTOR_SIZE;
+  int last = (endByte-1)/SECTOR_SIZE;
+
+  //allocate all the new sectors needed before writing anything
+  int fresh[MAX_SECTORS_PER_FILE] = {0};
+  int missing[MAX_SECTORS_PER_FILE], newsecs[MAX_SECTORS_PER_FILE], n = 0;
+  for(int i=first; i<=last; i++){
+    if(i*SECTOR_SIZE >= fileInode->size || fileInode->data[i] == 0)
+      missing[n++] = i;
+  }
+  if(file_sector_alloc(of, n, newsecs) < 0){
+    blue();
+    dprintf("... error: no space on disk for %d sectors, write cannot complete\n", n);
+    reset();
+    osErrno = E_NO_SPACE;
     return -1;
   }
+  for(int k=0; k<n; k++){
+    fileInode->data[missing[k]] = newsecs[k];
+    fresh[missing[k]] = 1;
+  }
+
+  char tempBuff[SECTOR_SIZE];
+  int iv = 0, ivoff = 0;
+  int ctrSize = 0;
+  for(int position=first; position<=last; position++){
+    int positionByte = (position == first) ? startByte%SECTOR_SIZE : 0;
+    int currBytes = min(SECTOR_SIZE - positionByte, size - ctrSize);
+
+    if(fresh[position]){
+      //the bytes not covered by this write stay zero
+      bzero(tempBuff, SECTOR_SIZE);
+    }
+    else{
+      //a sector only partly overwritten keeps the rest of its data
+      if(currBytes < SECTOR_SIZE){
+        if(Disk_Read(fileInode->data[position], tempBuff) < 0){
+          blue();
+          dprintf("... error: can't read sector %d\n", fileInode->data[position]);
+          reset();
+          osErrno=E_GENERAL;
+          return -1;
+        }
+        //whatever follows the end of file in its last sector is stale;
+        //clear it in case this write leaves a gap after the end of file
+        if((position+1)*SECTOR_SIZE > fileInode->size){
+          memset(tempBuff+fileInode->size%SECTOR_SIZE, 0, SECTOR_SIZE-fileInode->size%SECTOR_SIZE);
+        }
+      }
+      //a sector shared with a cloned file gets a private copy first
+      if(sector_unshare(&fileInode->data[position], 0) < 0){
+        blue();
+        dprintf("... error: no space on disk to copy shared sector\n");
+        reset();
+        osErrno = E_NO_SPACE;
+        return -1;
+      }
+    }
+
+    iovec_copy(iov, &iv, &ivoff, tempBuff+positionByte, currBytes, 0);
+    ctrSize += currBytes;
+
+    if(Disk_Write(fileInode->data[position], tempBuff) < 0) {
+      blue();
+      dprintf("... error: failed to write buffer data\n");
+      reset();
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    blue();
+    dprintf("... Writing data[%d]=%d at positionByte=%d, %d bytes\n",
+            position, fileInode->data[position], positionByte, currBytes);
+    reset();
+  }
+
+  //update inode size; the file only grows if written past its end
+  if(endByte > fileInode->size) fileInode->size = endByte;
+
+  //write to disk the updated inode
+  if(inode_write(of->inode, fileInode) < 0) { osErrno = E_GENERAL; return -1; }
+  blue();
+  dprintf("... update child inode %d (size=%d, type=%d)\n",
+                  of->inode, fileInode->size, fileInode->type);
+  reset();
+  flush_poke();
+  return size;
+}
+
+//helper function
+//move the read/write position of fd to byte offset
+static void set_position(int fd, int offset)
+{
+  OPEN_FILE(fd).pos = offset/SECTOR_SIZE;
+  OPEN_FILE(fd).posByte = offset%SECTOR_SIZE;
+}
+
+//helper function
+//the rest of File_Read(), with the inode of fd read-locked
+static int read_locked(int fd, open_file_t* file, void* buffer, int size)
+{
+  //the inode is cached in the open file entry shared by all of its fds
+  inode_t* fileInode = &file->file->node;
+   
+  //check if file size is empty
+  if(fileInode->size == 0)
+  {
+    //none to read
+    blue();
+    dprintf("... file fd=%d is empty\n", fd);
+    reset();
+    return 0;
+  }
  
-  // initialize buffer
-  bzero(buffer, size);
+  /***determine how much can actually be read***/
  
-  // load disk sector from directory
-  char inode_buffer[SECTOR_SIZE];
-  int inode_sector = INODE_TABLE_START_SECTOR+inode/INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for parent inode %d from disk sector %d\n",
-     inode, inode_sector);
- 
-  // get the directory inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* dir_inode = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  dprintf("... get inode %d (size=%d, type=%d)\n",
-     inode, dir_inode->size, dir_inode->type);
+  //none to read, position at (or past) end of file
+  int offsetByte = file->pos*SECTOR_SIZE+file->posByte;
+  if(offsetByte >= fileInode->size)
+  {
+    blue();
+    dprintf("... file fd=%d is at end of file\n", fd);  
+    reset();  
+    return 0;
+  }
+  //something to read
+  //remaining file size left to read
+  int remFileSize = fileInode->size - offsetByte;
+  int sizeToRead = min(remFileSize,size);
+
+  //let user know that reading less than the initial size given
+  if(sizeToRead == remFileSize){
+    printf("... file fd=%d can only read remaining bytes of %d, not %d bytes\n", fd, remFileSize, size);
+  }
  
-  // read the directory entries into the buffer
-  int remainder=dir_inode->size%DIRENTS_PER_SECTOR;
-  int group=dir_inode->size/DIRENTS_PER_SECTOR;
-  int buf_offset = (int)(SECTOR_SIZE-SECTOR_SIZE%sizeof(dirent_t));
+  blue();
+  dprintf("... size to read=%d of file size=%d at data[%d] at byte position=%d\n",
+            sizeToRead, fileInode->size, file->pos, file->posByte);
+  reset();
  
-  // a) completely filled sectors
-  for(int i=0; i<group;i++) {
-    if(Disk_Read(dir_inode->data[i], buffer+i*buf_offset) < 0) {
-        dprintf("... error: cant read sector %d\n", dir_inode->data[i]);
-        osErrno=E_GENERAL;
-        return -1;
-    }
+  fs_iovec_t iov = { buffer, sizeToRead };
+  if(read_vector(file->file, &iov, sizeToRead, offsetByte) < 0) return -1;
+  set_position(fd, offsetByte+sizeToRead);
+ 
+  blue();
+  dprintf("... file=%d is now at pos=%d with byte pos=%d\n", fd, OPEN_FILE(fd).pos, OPEN_FILE(fd).posByte);
+ 
+  dprintf("... successfully read size=%d\n", sizeToRead);
+  reset();
+ 
+  return sizeToRead;
+ 
+}
+ 
+//Case 1: Size to read is bigger than the remaining size of file ->
+//        ask user if they wish to read the remaining size or nothing at all
+//Case 2: size to read is less than or equal to total file size -> read size to read
+int File_Read(int fd, void* buffer, int size)
+{
+  boldBlue();
+  dprintf("File_Read(%d, buffer, %d):\n", fd, size);
+  reset();
+ 
+  //check if fd is valid index
+  if(fd < 0 || fd >= open_files_limit()){
+    blue();
+    dprintf("... fd=%d out of bound", fd);  
+    reset();  
+    osErrno = E_BAD_FD;
+    return -1;
   }
  
-  // b) partly filled sector
-  if(remainder) {
-      char buff[SECTOR_SIZE];
-      if(Disk_Read(dir_inode->data[group], buff) < 0){
-        dprintf("... error: cant read sector %d\n", dir_inode->data[group]);
-            osErrno=E_GENERAL;
-            return -1;
-      }
+  open_file_t* file = &OPEN_FILE(fd);
  
-    memcpy(buffer+group*buf_offset, buff, remainder*sizeof(dirent_t));
-   
+  //check if not an open file
+  if(file->file == NULL){
+    blue();
+    dprintf("... fd=%d not an open file\n", fd);
+    reset();
+    osErrno = E_BAD_FD;
+    return -1;
   }
  
-  return dir_inode->size;
-}
\ No newline at end of file
+  int inode = file->file->inode;
+  inode_lock(inode, LOCK_READ);
+  int ret = read_locked(fd, file, buffer, size);
+  inode_unlock(inode);
+  return ret;
+}
+ 
+//helper function
+//gets user input on what action to take related to overwriting a file
+//when the file recently opens and is non-empty
+int toOverwriteOrNot(int fd){
+  int action = 0;
+  do{
+    printf("File of fd=%d is non-empty. Do you\n"
+          "1. wish to overwrite from position 0 (will delete entire file's contents)?\n"
+          "2. wish to append data from first empty position?\n"
+          "3. wish to not write?\n"
+          "Please input 1, 2 or 3 indicating your desired action.\n", fd);
+   
+    scanf("%d", &action);
+  }while(action != 1 && action != 2 && action != 3);
+ 
+  return action;
+}
+ 
+//ask user if want to write in only remaining available space or not
+//case: when size > sizeRem
+int ifWriteRem(int fd, int size, int sizeRem){
+  int action = 0;
+
+  do{
+    printf("File of fd=%d cannot write requested size=%d bytes. It has a space of size=%d bytes remaining. Do you\n"
+            "1. wish to write %d bytes from data given?\n"
+            "2. wish to not write at all?\n"
+            "Please input 1 or 2 indicating your desired actions.\n", fd, size, sizeRem, sizeRem);
+    scanf("%d", &action);
+  }while(action != 1 && action != 2);
+
+  return action;
+}
+
+//helper function
+//the rest of File_Write(), with the inode of fd write-locked
+static int write_locked(int fd, open_file_t* file, void* buffer, int size)
+{
+  //check if file pointer is at the maximum file size
+  if(file->pos*SECTOR_SIZE+file->posByte >= MAX_SECTORS_PER_FILE*SECTOR_SIZE)
+  {
+    blue();
+    dprintf("... error: file fd=%d is full\n", fd);  
+    reset();
+    osErrno = E_FILE_TOO_BIG;
+    return 0;
+  }
+
+  //the inode is cached in the open file entry shared by all of its
+  //fds; it's written through to disk at the end
+  int inode = file->file->inode;
+  inode_t* fileInode = &file->file->node;
+  blue();
+  dprintf("... inode %d (size=%d, type=%d)\n",
+            inode, fileInode->size, fileInode->type);
+  reset();
+   
+   /***check if user wishes to overwrite or not***/
+
+  //write data from after the given data pointer
+  int position = file->pos;
+  int action = 0;
+  int positionByte = file->posByte;
+
+  //check cases for potential overwriting:
+  //if recently opened file is non-empty
+  //if current pointer is at arbitrary point within file contents
+  //(a pointer past the end of file leaves a hole and needs no check)
+  if(file->pos*SECTOR_SIZE+file->posByte < fileInode->size){
+    //check if user wishes to overwrite
+    action = toOverwriteOrNot(fd);
+    if(action == 3){
+      blue();
+      printf("... User wishes to not overwrite already existing file. No write done\n");
+      reset();
+      return 0;
+    }
+    else if(action == 2){ //write only from the first empty position
+      position = fileInode->size/SECTOR_SIZE;
+      positionByte = 0;
+
+      if(fileInode->size%SECTOR_SIZE){
+        positionByte = fileInode->size%SECTOR_SIZE;
+      }
+      blue();
+      dprintf("... User wishes to write from first empty byte position=%d in block position=%d with file size=%d\n",
+              positionByte, position, fileInode->size);
+      reset();
+    }
+    else{//wishes to overwrite. delete file contents
+      if(inode_resize(fileInode, 0) < 0) {
+        blue();
+        dprintf("... error: free sectors occupied by file unsuccessful\n");
+        reset();
+        osErrno = E_GENERAL;
+        return -1;
+      }
+      position = 0;
+      positionByte = 0;
+      blue();
+      dprintf("... User wishes to overwrite entire file. Starting at block position=%d with file size=%d\n",
+              position, fileInode->size);
+      reset();
+    }
+  }
+
+  int sizeToWrite = size;
+  int spaceRem = SECTOR_SIZE*MAX_SECTORS_PER_FILE - (position*SECTOR_SIZE+positionByte);
+
+  //check if the rem space left is less than size to write
+  if(spaceRem < size){
+    blue();
+    dprintf("... error: fd=%d of size=%d at block position=%d at byte position=%d cannot add size=%d bytes.\n" 
+              "Ask user what they want to do\n", fd, fileInode->size, position, positionByte, size);
+    reset();
+    if(ifWriteRem(fd, size, spaceRem) == 1){
+      sizeToWrite = spaceRem;
+      blue();
+      dprintf("... User chose to write only %d bytes to file=%d\n", sizeToWrite, fd);
+      reset();
+    }
+    else{
+      blue();
+      dprintf("... User chose to not write remaining %d bytes. Ending call\n", spaceRem);
+      osErrno = E_FILE_TOO_BIG;
+      return 0;
+    }
+  }
+
+  /***write into data blocks***/
+
+  int startByte = position*SECTOR_SIZE+positionByte;
+  fs_iovec_t iov = { buffer, sizeToWrite };
+  if(write_vector(file->file, &iov, sizeToWrite, startByte) < 0) return -1;
+  set_position(fd, startByte+sizeToWrite);
+  blue();
+  dprintf("... file=%d is now at block pos=%d and byte position=%d with size=%d\n", 
+              fd, file->pos, file->posByte, file->file->node.size);
+  reset();
+  return sizeToWrite;
+}
+
+//case 1: file_write first called on empty file -> no checks, write into file
+//case 2: file_write first called on a recently opened non-empty file 
+//        or file ptr is at arbitrary point within file contents
+//        -> check if user wishes to overwrite
+//        if 1 -> overwrite from given position
+//        if 2 -> write only from the first empty position
+//        if 3 -> do not overwrite
+//Case 3: file_write called with a size bigger than remaining available space in a file 
+//        -> check if user wishes to write into remaining space 
+//        if 1 -> write into remaining space from data given 
+//        if 2 -> do not write
+int File_Write(int fd, void* buffer, int size)
+{
+  boldBlue();
+  dprintf("File_Write(%d, buffer, %d):\n",fd, size);
+  reset();
+  if(check_writable() < 0) return -1;
+
+  //check if fd is valid index
+  if(fd < 0 || fd >= open_files_limit()){
+    blue();
+    dprintf("... error: fd=%d out of bound\n", fd);
+    reset();
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  open_file_t* file = &OPEN_FILE(fd);
+
+  //check if not an open file
+  if(file->file == NULL){
+    blue();
+    dprintf("... error: fd=%d not an open file\n", fd);
+    reset();
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+    
+  int inode = file->file->inode;
+  txn_begin();
+  inode_lock(inode, LOCK_WRITE);
+  int ret = write_locked(fd, file, buffer, size);
+  inode_unlock(inode);
+  txn_end();
+  return ret;
+}
+
+//helper function
+//check fd and the vector for the vectored calls; return the total
+//size of the vector, -1 if something's wrong
+static int check_vector(int fd, fs_iovec_t* iov, int iovcnt)
+{
+  if(fd < 0 || fd >= open_files_limit() || OPEN_FILE(fd).file == NULL){
+    dprintf("... error: fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(iovcnt < 0 || (iovcnt > 0 && iov == NULL)){
+    dprintf("... error: bad vector of %d buffers\n", iovcnt);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int total = 0;
+  for(int i=0; i<iovcnt; i++){
+    if(iov[i].len < 0 || (iov[i].len > 0 && iov[i].base == NULL) ||
+       iov[i].len > MAX_FILE_SIZE-total){
+      dprintf("... error: bad buffer %d of %d bytes in vector\n", i, iov[i].len);
+      osErrno = (iov[i].len > MAX_FILE_SIZE-total) ? E_FILE_TOO_BIG : E_GENERAL;
+      return -1;
+    }
+    total += iov[i].len;
+  }
+  return total;
+}
+
+//helper function
+//read into the vector from byte offset of the file of fd, or from the
+//read/write position of fd (which then moves past the bytes read) if
+//offset is -1; return the number of bytes read, -1 on error
+static int readv_at(int fd, fs_iovec_t* iov, int iovcnt, int offset)
+{
+  int total = check_vector(fd, iov, iovcnt);
+  if(total < 0) return -1;
+
+  open_inode_t* of = OPEN_FILE(fd).file;
+  int offsetByte = (offset < 0) ? OPEN_FILE(fd).pos*SECTOR_SIZE+OPEN_FILE(fd).posByte : offset;
+  inode_lock(of->inode, LOCK_READ);
+  int remFileSize = of->node.size - offsetByte;
+  int sizeToRead = (remFileSize > 0) ? min(total, remFileSize) : 0;
+  int ret = read_vector(of, iov, sizeToRead, offsetByte);
+  inode_unlock(of->inode);
+  if(ret >= 0 && offset < 0) set_position(fd, offsetByte+ret);
+  return ret;
+}
+
+//helper function
+//write the vector at byte offset of the file of fd, or at the
+//read/write position of fd (which then moves past the bytes written)
+//if offset is -1; return the number of bytes written, -1 on error
+static int writev_at(int fd, fs_iovec_t* iov, int iovcnt, int offset)
+{
+  if(check_writable() < 0) return -1;
+  int total = check_vector(fd, iov, iovcnt);
+  if(total < 0) return -1;
+
+  open_inode_t* of = OPEN_FILE(fd).file;
+  int offsetByte = (offset < 0) ? OPEN_FILE(fd).pos*SECTOR_SIZE+OPEN_FILE(fd).posByte : offset;
+  if(offsetByte+total > MAX_FILE_SIZE){
+    dprintf("... error: fd=%d at byte position=%d cannot add size=%d bytes\n",
+            fd, offsetByte, total);
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
+  txn_begin();
+  inode_lock(of->inode, LOCK_WRITE);
+  int ret = write_vector(of, iov, total, offsetByte);
+  inode_unlock(of->inode);
+  txn_end();
+  if(ret >= 0 && offset < 0) set_position(fd, offsetByte+ret);
+  return ret;
+}
+
+//read into the buffers of the vector in order, up to the end of file
+int File_ReadV(int fd, fs_iovec_t* iov, int iovcnt)
+{
+  boldBlue();
+  dprintf("File_ReadV(%d, iov, %d):\n", fd, iovcnt);
+  reset();
+
+  int sizeToRead = readv_at(fd, iov, iovcnt, -1);
+  if(sizeToRead < 0) return -1;
+  dprintf("... successfully read size=%d into %d buffers\n", sizeToRead, iovcnt);
+  return sizeToRead;
+}
+
+//write the buffers of the vector in order as one write; unlike
+//File_Write, nothing is asked of the user: the write is done from the
+//current position, or not at all if it doesn't fit in the file
+int File_WriteV(int fd, fs_iovec_t* iov, int iovcnt)
+{
+  boldBlue();
+  dprintf("File_WriteV(%d, iov, %d):\n", fd, iovcnt);
+  reset();
+
+  return writev_at(fd, iov, iovcnt, -1);
+}
+
+int File_Seek(int fd, int offset)
+{
+  boldBlue();
+  dprintf("File_Seek(%d, %d):\n", fd, offset);
+  reset();
+  //check if fd is valid index
+  if(fd < 0 || fd >= open_files_limit()){
+    dprintf("... error: fd=%d out of bound\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;    
+  }
+  //check if open file
+ if(OPEN_FILE(fd).file == NULL) {
+    dprintf("... error: fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+   
+  //check if offset is within bounds; seeking past the end of file is
+  //allowed, a later write leaves the skipped sectors as a hole
+  if(offset < 0 || offset > MAX_FILE_SIZE){
+     dprintf("... error: offset=%d out of bound\n", offset);
+     osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+ 
+  OPEN_FILE(fd).pos = offset/SECTOR_SIZE;
+  OPEN_FILE(fd).posByte = offset%SECTOR_SIZE;
+ 
+ dprintf("... file=%d now at position=%d at byte position=%d\n",
+          fd, OPEN_FILE(fd).pos, OPEN_FILE(fd).posByte);
+
+  return OPEN_FILE(fd).pos;  
+}
+ 
+int File_Truncate(int fd, int size)
+{
+  boldBlue();
+  dprintf("File_Truncate(%d, %d):\n", fd, size);
+  reset();
+  if(check_writable() < 0) return -1;
+  //check if fd is valid index
+  if(fd < 0 || fd >= open_files_limit()){
+    dprintf("... error: fd=%d out of bound\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  //check if open file
+  if(OPEN_FILE(fd).file == NULL) {
+    dprintf("... error: fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  //a file can be shrunk, or grown up to the max file size (the new
+  //part is a hole)
+  if(size < 0 || size > MAX_FILE_SIZE) {
+    dprintf("... error: size=%d out of bound\n", size);
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+
+  //the inode is updated right away; the freed sectors are reclaimed later
+  open_inode_t* of = OPEN_FILE(fd).file;
+  txn_begin();
+  inode_lock(of->inode, LOCK_WRITE);
+  int ret = inode_resize(&of->node, size);
+  if(ret == 0) ret = inode_write(of->inode, &of->node);
+  inode_unlock(of->inode);
+  txn_end();
+  if(ret < 0) {
+    dprintf("... error: failed to truncate inode %d\n", of->inode);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  //a read/write position past the new end of file moves to the end;
+  //other fds sharing the file keep theirs, reading there gives
+  //nothing and writing leaves a hole
+  if(OPEN_FILE(fd).pos*SECTOR_SIZE+OPEN_FILE(fd).posByte > size) {
+    OPEN_FILE(fd).pos = size/SECTOR_SIZE;
+    OPEN_FILE(fd).posByte = size%SECTOR_SIZE;
+  }
+
+  dprintf("... file=%d truncated to size=%d\n", fd, size);
+  return 0;
+}
+
+int File_Close(int fd)
+{
+  dprintf("File_Close(%d):\n", fd);
+  if(0 > fd || fd >= open_files_limit()) {
+    dprintf("... error: fd=%d out of bound\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+  if(OPEN_FILE(fd).file == NULL) {
+    dprintf("... error: fd=%d not an open file\n", fd);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+ 
+  //the last close of a file frees it if it has been unlinked
+  open_inode_t* of = OPEN_FILE(fd).file;
+  free_file_fd(fd);
+  txn_begin();
+  int ret = open_inode_put(of);
+  txn_end();
+  if(ret < 0) {
+    dprintf("... error: failed to free unlinked file\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+ 
+  dprintf("... file closed successfully\n");
+  return 0;
+}
+ 
+int Dir_Create(char* path)
+{
+  dprintf("Dir_Create('%s'):\n", path);
+  if(check_writable() < 0) return -1;
+  txn_begin();
+  int ret = create_file_or_directory(-1, 1, path);
+  txn_end();
+  return ret;
+}
+ 
+// the rest of Dir_Unlink(), within a transaction
+static int dir_unlink(char* path)
+{
+   dprintf("Dir_Unlink('%s'):\n", path);
+     // no empty path and no root directory allowed
+  if(path==NULL) {
+    dprintf("... error: empty path (NULL) for directory unlink");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+ 
+  if(strcmp(path, "/")==0) {
+    dprintf("... error: not allowed to unlink root directory");
+    osErrno = E_ROOT_DIR;
+    return -1;
+  }
+ 
+  // find parent and children (if theres any)
+  int child_inode;
+  int parent_inode = follow_path(path, &child_inode, NULL, LOCK_WRITE);
+  if(parent_inode >= 0 && child_inode < 0) inode_unlock(parent_inode);
+  if(parent_inode < 0 || child_inode < 0) {
+    dprintf("... error: directory '%s' not found\n", path);
+      osErrno = E_NO_SUCH_DIR;
+      return -1;
+  }
+ 
+  // the directory is locked too, so that nothing is added to it
+  // meanwhile; with a handle open on it, it's only unlinked
+  inode_lock(child_inode, LOCK_WRITE);
+  pthread_mutex_lock(&fs->open_lock);
+  open_inode_t* of = find_open_inode(child_inode);
+  int remove = remove_inode(1, parent_inode, child_inode, of != NULL);
+  if(remove == 0 && of) of->unlinked = 1;
+  pthread_mutex_unlock(&fs->open_lock);
+  inode_unlock(child_inode);
+  inode_unlock(parent_inode);
+ 
+  if (remove==-1) {
+    dprintf("... error: general error when unlinking directory\n");
+    osErrno = E_GENERAL;
+    return -1;
+  } else if (remove==-3) {
+    dprintf("... error: no directory, wrong type\n");
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  } else if (remove==-2) {
+    dprintf("... error: directory %s not empty", path);
+    osErrno = E_DIR_NOT_EMPTY;
+    return -1;
+  } else {
+    return 0;
+  }
+ 
+ 
+}
+
+int Dir_Unlink(char* path)
+{
+  if(check_writable() < 0) return -1;
+  txn_begin();
+  pthread_rwlock_rdlock(&fs->rename_lock);
+  int ret = dir_unlink(path);
+  pthread_rwlock_unlock(&fs->rename_lock);
+  txn_end();
+  return ret;
+}
+
+// the rest of Dir_UnlinkRecursive(), within an operation that reserved
+// 'reserved' sectors of the journal: the directory and everything
+// under it are write-locked from the top down and collected in one
+// walk, then the directory is taken out of its parent and the whole
+// tree is freed at once, each inode table sector being rewritten only
+// once; a file still open only loses its name, as with File_Unlink();
+// return 0 if successful, -1 on error (osErrno is set), or 1, with
+// nothing changed, if the journal room the tree needs (put in '*need')
+// is more than what's reserved
+static int tree_unlink(char* path, int reserved, int* need)
+{
+  if(path==NULL) {
+    dprintf("... error: empty path (NULL) for directory unlink\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(strcmp(path, "/")==0) {
+    dprintf("... error: not allowed to unlink root directory\n");
+    osErrno = E_ROOT_DIR;
+    return -1;
+  }
+  int root;
+  int parent_inode = follow_path(path, &root, NULL, LOCK_WRITE);
+  if(parent_inode >= 0 && root < 0) inode_unlock(parent_inode);
+  if(parent_inode < 0 || root < 0) {
+    dprintf("... error: directory '%s' not found\n", path);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  inode_lock(root, LOCK_WRITE);
+
+  // breadth first, so each directory is locked before what's in it;
+  // 'seen' is 1 for an inode in the tree, 2 if it's an open file
+  int* tree = (int*)malloc(MAX_FILES*sizeof(int));
+  inode_t* nodes = (inode_t*)malloc(MAX_FILES*sizeof(inode_t));
+  char seen[MAX_FILES];
+  unsigned char masks[INODE_TABLE_SECTORS]; // the inodes of the tree in each sector
+  memset(seen, 0, MAX_FILES);
+  memset(masks, 0, INODE_TABLE_SECTORS);
+  int n = 0, ret = (tree && nodes) ? 0 : -1;
+  if(ret == 0) { tree[n++] = root; seen[root] = 1; }
+  for(int k=0; k<n && ret == 0; k++) {
+    inode_t* node = &nodes[k];
+    if(inode_read(tree[k], node) < 0) { ret = -1; break; }
+    if(k == 0 && node->type != 1) { ret = -3; break; }
+    masks[tree[k]/INODES_PER_SECTOR] |= 1 << (tree[k]%INODES_PER_SECTOR);
+    char dirent_buffer[SECTOR_SIZE];
+    for(int i=0; node->type == 1 && i*DIRENTS_PER_SECTOR < node->size && ret == 0; i++) {
+      if(Disk_Read(node->data[i], dirent_buffer) < 0) { ret = -1; break; }
+      for(int j=0; j<min(DIRENTS_PER_SECTOR, node->size-i*DIRENTS_PER_SECTOR); j++) {
+        int child = ((dirent_t*)dirent_buffer)[j].inode;
+        if(child <= 0 || child >= MAX_FILES || seen[child]) {
+          dprintf("... error: bad entry (inode=%d) in directory %d\n", child, tree[k]);
+          ret = -1;
+          break;
+        }
+        inode_lock(child, LOCK_WRITE);
+        seen[child] = 1;
+        tree[n++] = child;
+      }
+    }
+  }
+
+  // the inode table sectors of the tree, the parent's inode and its
+  // two entry sectors, and the reference count table if files share
+  // sectors
+  *need = 3;
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) *need += (masks[i] != 0);
+  pthread_mutex_lock(&fs->refcount_lock);
+  if(fs->refcounts) *need += REFCOUNT_TABLE_SECTORS;
+  pthread_mutex_unlock(&fs->refcount_lock);
+  if(ret == 0 && *need > reserved) {
+    dprintf("... tree of %d inodes needs %d journal sectors, %d reserved\n", n, *need, reserved);
+    ret = 1;
+  }
+
+  if(ret == 0) {
+    dprintf("... unlink tree of %d inodes\n", n);
+    inode_t parent;
+    pthread_mutex_lock(&fs->open_lock);
+    if(inode_read(parent_inode, &parent) < 0 || dirent_remove(parent_inode, &parent, root) < 0)
+      ret = -1;
+    for(int k=0; k<n && ret == 0; k++) {
+      open_inode_t* of = find_open_inode(tree[k]);
+      if(of) {
+        dprintf("... inode %d is open, defer freeing it until closed\n", tree[k]);
+        of->unlinked = 1;
+        seen[tree[k]] = 2;
+        masks[tree[k]/INODES_PER_SECTOR] &= ~(1 << (tree[k]%INODES_PER_SECTOR));
+        // an open directory is left empty
+        for(int i=0; nodes[k].type == 1 && i*DIRENTS_PER_SECTOR < nodes[k].size && ret == 0; i++)
+          ret = reclaim_sector(nodes[k].data[i]);
+        if(nodes[k].type == 1 && ret == 0) {
+          memset(nodes[k].data, 0, sizeof(nodes[k].data));
+          nodes[k].size = 0;
+          ret = inode_write(tree[k], &nodes[k]);
+        }
+      } else if(nodes[k].type == 0) {
+        ret = inode_resize(&nodes[k], 0);
+      } else {
+        for(int i=0; i*DIRENTS_PER_SECTOR < nodes[k].size && ret == 0; i++)
+          ret = reclaim_sector(nodes[k].data[i]);
+      }
+    }
+    // the inodes are cleared before they can be allocated again
+    for(int i=0; i<INODE_TABLE_SECTORS && ret == 0; i++)
+      if(masks[i]) ret = itable_clear(i, masks[i]);
+    for(int k=0; k<n && ret == 0; k++)
+      if(seen[tree[k]] == 1) ret = bitmap_free(&fs->inode_bitmap, tree[k]);
+    pthread_mutex_unlock(&fs->open_lock);
+  }
+
+  for(int k=n-1; k>=0; k--) inode_unlock(tree[k]);
+  if(n == 0) inode_unlock(root);
+  inode_unlock(parent_inode);
+  free(tree);
+  free(nodes);
+  if(ret == -3) {
+    dprintf("... error: no directory, wrong type\n");
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+  if(ret < 0) {
+    dprintf("... error: general error when unlinking directory tree\n");
+    osErrno = E_GENERAL;
+  }
+  return ret;
+}
+
+// remove the subdirectories of 'path' one at a time, for a tree too
+// big to go in one operation; return how many were removed, -1 on error
+static int tree_split(char* path)
+{
+  int size = Dir_Size(path);
+  if(size <= 0) return size;
+  char* buffer = (char*)malloc(size);
+  if(!buffer) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int entries = Dir_Read(path, buffer, size);
+  int removed = 0;
+  for(int i=0; i<entries; i++) {
+    dirent_t* dirent = (dirent_t*)buffer+i;
+    inode_t child;
+    if(inode_read(dirent->inode, &child) < 0 || child.type != 1) continue;
+    char child_path[MAX_PATH];
+    if(snprintf(child_path, MAX_PATH, "%s/%s", path, dirent->fname) >= MAX_PATH) continue;
+    if(Dir_UnlinkRecursive(child_path) == 0) removed++;
+    else if(osErrno != E_NO_SUCH_DIR) { removed = -1; break; } // unless it's gone already
+  }
+  free(buffer);
+  return removed;
+}
+
+// the directory is removed with all it holds; the tree is freed in a
+// single operation if it fits in the journal, otherwise its
+// subdirectories are removed first, one by one
+int Dir_UnlinkRecursive(char* path)
+{
+  dprintf("Dir_UnlinkRecursive('%s'):\n", path);
+  if(check_writable() < 0) return -1;
+  int reserve = TXN_MAX_SECTORS;
+  for(;;) {
+    int need;
+    txn_reserve(reserve);
+    pthread_rwlock_rdlock(&fs->rename_lock);
+    int ret = tree_unlink(path, reserve, &need);
+    pthread_rwlock_unlock(&fs->rename_lock);
+    txn_end();
+    if(ret <= 0) return ret;
+    if(need > TXN_MAX_RESERVE) {
+      int removed = tree_split(path);
+      if(removed < 0) return -1;
+      if(removed == 0) {
+        dprintf("... error: directory '%s' too big to unlink\n", path);
+        osErrno = E_GENERAL;
+        return -1;
+      }
+    }
+    reserve = min(need, TXN_MAX_RESERVE);
+  }
+}
+
+int Dir_Rename(char* from, char* to)
+{
+  dprintf("Dir_Rename('%s', '%s'):\n", from, to);
+  if(check_writable() < 0) return -1;
+  txn_begin();
+  int ret = rename_inode(1, from, to);
+  txn_end();
+  return ret;
+}
+ 
+// find the directory 'path' and read its inode into 'node', with the
+// directory read-locked (the caller unlocks it); return the inode of
+// the directory, -1 if it's not found (osErrno is set)
+static int dir_lookup(char* path, inode_t* node)
+{
+  // no empty path allowed
+  if(path==NULL) {
+    dprintf("... error: empty path (NULL) given as parameter\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+ 
+  // directory has to exist
+  int child_inode;
+  int parent_inode = follow_path(path, &child_inode, NULL, LOCK_READ);
+  if(parent_inode >= 0 && child_inode < 0) inode_unlock(parent_inode);
+  if(parent_inode < 0 || child_inode < 0) {
+    dprintf("... error: directory '%s' not found\n", path);
+      osErrno = E_NO_SUCH_DIR;
+      return -1;
+  }
+  lock_child(parent_inode, child_inode, LOCK_READ);
+ 
+  if(inode_read(child_inode, node) < 0) {
+    inode_unlock(child_inode);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... get inode %d (size=%d, type=%d)\n",
+     child_inode, node->size, node->type);
+  return child_inode;
+}
+
+int Dir_Size(char* path)
+{
+  dprintf("Dir_Size('%s'):\n", path);
+  inode_t child;
+  int inode = dir_lookup(path, &child);
+  if(inode < 0) return -1;
+  inode_unlock(inode);
+ 
+  // check for type
+  if (child.type!=1) {
+    dprintf("... error: wrong type, path leads to file\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+ 
+  return child.size*sizeof(dirent_t);
+}
+ 
+// the rest of Dir_Read(), with the directory 'dir_inode' read-locked
+static int dir_read_locked(inode_t* dir_inode, void* buffer, int size)
+{
+  // check if size parameter matches the actual directory size
+  int act_size = (dir_inode->type == 1) ? dir_inode->size*sizeof(dirent_t) : -1;
+  if (size>act_size) {
+    dprintf("... error: size parameter %d does not match actual directory size of %d bytes.\n",
+      size, act_size);
+    osErrno=E_GENERAL;
+    return -1;
+  }
+ 
+  // check if size of buffer is large enough to hold all elements in the directory
+  int buf_size = (int)malloc_usable_size(buffer);
+  if (size>buf_size) {
+    dprintf("... error: buffer provided has size %d, but %d bytes required\n",
+      buf_size, size);
+    osErrno=E_BUFFER_TOO_SMALL;
+    return -1;
+  }
+ 
+  // initialize buffer
+  bzero(buffer, size);
+ 
+  // read the directory entries into the buffer
+  int remainder=dir_inode->size%DIRENTS_PER_SECTOR;
+  int group=dir_inode->size/DIRENTS_PER_SECTOR;
+  int buf_offset = (int)(SECTOR_SIZE-SECTOR_SIZE%sizeof(dirent_t));
+ 
+  // a) completely filled sectors (a sector holds a few bytes past its
+  // last entry, which mustn't land in the buffer)
+  for(int i=0; i<group;i++) {
+    char buff[SECTOR_SIZE];
+    if(Disk_Read(dir_inode->data[i], buff) < 0) {
+        dprintf("... error: cant read sector %d\n", dir_inode->data[i]);
+        osErrno=E_GENERAL;
+        return -1;
+    }
+    memcpy(buffer+i*buf_offset, buff, buf_offset);
+  }
+ 
+  // b) partly filled sector
+  if(remainder) {
+      char buff[SECTOR_SIZE];
+      if(Disk_Read(dir_inode->data[group], buff) < 0){
+        dprintf("... error: cant read sector %d\n", dir_inode->data[group]);
+            osErrno=E_GENERAL;
+            return -1;
+      }
+ 
+    memcpy(buffer+group*buf_offset, buff, remainder*sizeof(dirent_t));
+   
+  }
+ 
+  return dir_inode->size;
+}
+
+int Dir_Read(char* path, void* buffer, int size)
+{
+  dprintf("Dir_Read('%s', buffer, %d):\n", path, size);
+ 
+  // the directory stays locked while it's read
+  inode_t dir_inode;
+  int inode = dir_lookup(path, &dir_inode);
+  if(inode < 0) return -1;
+  int ret = dir_read_locked(&dir_inode, buffer, size);
+  inode_unlock(inode);
+  return ret;
+}
+/* directory handles */
+
+// find the directory a relative 'path' is followed from: the one behind
+// handle 'dh' (which needn't be valid for an absolute path), put in
+// '*dir'; return 0 if successful, -1 otherwise (osErrno is set)
+static int handle_dir(int dh, char* path, int* dir)
+{
+  *dir = -1;
+  if(path && path[0] == '/') return 0;
+  pthread_mutex_lock(&fs->open_lock);
+  if(dh >= 0 && dh < MAX_DIR_HANDLES && fs->dir_handles[dh]) *dir = fs->dir_handles[dh]->inode;
+  pthread_mutex_unlock(&fs->open_lock);
+  if(*dir >= 0) return 0;
+  dprintf("... error: dh=%d not an open directory\n", dh);
+  osErrno = E_BAD_FD;
+  return -1;
+}
+
+int Dir_OpenHandle(char* path)
+{
+  dprintf("Dir_OpenHandle('%s'):\n", path);
+  int child_inode;
+  int parent_inode = follow_path(path, &child_inode, NULL, LOCK_READ);
+  if(parent_inode >= 0 && child_inode < 0) inode_unlock(parent_inode);
+  if(parent_inode < 0 || child_inode < 0) {
+    dprintf("... error: directory '%s' not found\n", path);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+
+  // the directory shares the open file entry of its inode, which keeps
+  // it from being freed while the handle is open; the parent is locked,
+  // so it can't be unlinked meanwhile
+  open_inode_t* of = open_inode_get(child_inode);
+  inode_unlock(parent_inode);
+  if(!of) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(of->node.type != 1) {
+    dprintf("... error: '%s' is not a directory\n", path);
+    open_inode_put(of);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+
+  pthread_mutex_lock(&fs->open_lock);
+  int dh = 0;
+  while(dh < MAX_DIR_HANDLES && fs->dir_handles[dh]) dh++;
+  if(dh < MAX_DIR_HANDLES) fs->dir_handles[dh] = of;
+  pthread_mutex_unlock(&fs->open_lock);
+  if(dh == MAX_DIR_HANDLES) {
+    dprintf("... max open directory handles reached\n");
+    open_inode_put(of);
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return -1;
+  }
+  dprintf("... directory inode %d open as dh=%d\n", child_inode, dh);
+  return dh;
+}
+
+int Dir_CloseHandle(int dh)
+{
+  dprintf("Dir_CloseHandle(%d):\n", dh);
+  open_inode_t* of = NULL;
+  pthread_mutex_lock(&fs->open_lock);
+  if(dh >= 0 && dh < MAX_DIR_HANDLES) {
+    of = fs->dir_handles[dh];
+    fs->dir_handles[dh] = NULL;
+  }
+  pthread_mutex_unlock(&fs->open_lock);
+  if(!of) {
+    dprintf("... error: dh=%d not an open directory\n", dh);
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  // the last close of a directory frees it if it has been unlinked
+  txn_begin();
+  int ret = open_inode_put(of);
+  txn_end();
+  if(ret < 0) {
+    dprintf("... error: failed to free unlinked directory\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int File_OpenAt(int dh, char* file)
+{
+  dprintf("File_OpenAt(%d, '%s'):\n", dh, file);
+  int dir;
+  if(handle_dir(dh, file, &dir) < 0) return -1;
+  return file_open_at(dir, file);
+}
+
+int File_CreateAt(int dh, char* file)
+{
+  dprintf("File_CreateAt(%d, '%s'):\n", dh, file);
+  int dir;
+  if(handle_dir(dh, file, &dir) < 0 || check_writable() < 0) return -1;
+  txn_begin();
+  int ret = create_file_or_directory(dir, 0, file);
+  txn_end();
+  return ret;
+}
+
+int Dir_CreateAt(int dh, char* path)
+{
+  dprintf("Dir_CreateAt(%d, '%s'):\n", dh, path);
+  int dir;
+  if(handle_dir(dh, path, &dir) < 0 || check_writable() < 0) return -1;
+  txn_begin();
+  int ret = create_file_or_directory(dir, 1, path);
+  txn_end();
+  return ret;
+}
+/* tree walk */
+
+typedef struct _walk {
+  fs_walk_fn fn;
+  int order;            // FS_WALK_PRE and/or FS_WALK_POST
+  void* arg;
+  char path[MAX_PATH];  // the path of the node visited
+  char seen[MAX_FILES]; // the inodes reached so far, which breaks cycles
+  int reads;            // inode table sectors read
+} walk_t;
+
+typedef struct _walk_child {
+  int inode;
+  int index; // of its entry in the directory
+} walk_child_t;
+
+static int walk_child_cmp(const void* a, const void* b)
+{
+  return ((walk_child_t*)a)->inode-((walk_child_t*)b)->inode;
+}
+
+// fill in what the walk tells about an inode
+static void walk_stat(int inode, inode_t* node, fs_stat_t* st)
+{
+  st->inode = inode;
+  st->type = node->type;
+  st->size = (node->type == 1) ? node->size*sizeof(dirent_t) : node->size;
+  st->sectors = 0;
+  for(int i=0; i<inode_sectors(node); i++) st->sectors += (node->data[i] != 0);
+}
+
+// visit what's in the directory 'dir' (whose inode is 'node'), its
+// path being in w->path; the entries are read with the directory
+// read-locked, then the inodes of all the children are read, going
+// through the inode table in order, so that each of its sectors is
+// read once, and only then are the children visited, with no lock
+// held; return 0 if successful, -1 on error, or what the callback
+// returned to stop the walk
+static int walk_dir(walk_t* w, int dir, inode_t* node)
+{
+  int n = node->size, len = strlen(w->path);
+  if(len == 1) len = 0; // the root directory
+  dirent_t* entries = (dirent_t*)malloc(n*sizeof(dirent_t)+1);
+  walk_child_t* kids = (walk_child_t*)malloc(n*sizeof(walk_child_t)+1);
+  inode_t* nodes = (inode_t*)malloc(n*sizeof(inode_t)+1);
+  int ret = (entries && kids && nodes) ? 0 : -1;
+
+  char buf[SECTOR_SIZE];
+  inode_lock(dir, LOCK_READ);
+  for(int i=0; i*DIRENTS_PER_SECTOR < n && ret == 0; i++) {
+    if(Disk_Read(node->data[i], buf) < 0) ret = -1;
+    else memcpy(entries+i*DIRENTS_PER_SECTOR, buf,
+                min(DIRENTS_PER_SECTOR, n-i*DIRENTS_PER_SECTOR)*sizeof(dirent_t));
+  }
+  inode_unlock(dir);
+  if(ret < 0) osErrno = E_GENERAL;
+
+  // the children by inode, each inode table sector read once
+  int nkids = 0;
+  for(int i=0; i<n && ret == 0; i++) {
+    int child = entries[i].inode;
+    if(!entries[i].fname[0] || !memchr(entries[i].fname, 0, MAX_NAME) ||
+       child <= 0 || child >= MAX_FILES || w->seen[child]) {
+      dprintf("... skip entry %d of directory inode %d (inode=%d)\n", i, dir, child);
+      entries[i].inode = -1;
+      continue;
+    }
+    w->seen[child] = 1;
+    kids[nkids].inode = child;
+    kids[nkids++].index = i;
+  }
+  qsort(kids, nkids, sizeof(walk_child_t), walk_child_cmp);
+  for(int k=0, block=-1; k<nkids && ret == 0; k++) {
+    if(kids[k].inode/INODES_PER_SECTOR != block) {
+      block = kids[k].inode/INODES_PER_SECTOR;
+      pthread_mutex_lock(&fs->itable_locks[block]);
+      ret = itable_read(block, buf);
+      pthread_mutex_unlock(&fs->itable_locks[block]);
+      if(ret < 0) osErrno = E_GENERAL;
+      w->reads++;
+    }
+    memcpy(&nodes[kids[k].index], buf+(kids[k].inode%INODES_PER_SECTOR)*sizeof(inode_t), sizeof(inode_t));
+  }
+
+  for(int i=0; i<n && ret == 0; i++) {
+    int child = entries[i].inode;
+    if(child < 0) continue;
+    // a node changed or removed meanwhile may make no sense any more
+    if(!check_inode(&nodes[i])) {
+      dprintf("... skip inode %d, changed while walked\n", child);
+      continue;
+    }
+    if(len+1+strlen(entries[i].fname) >= MAX_PATH) {
+      dprintf("... skip inode %d, path too long\n", child);
+      continue;
+    }
+    sprintf(w->path+len, "/%s", entries[i].fname);
+    fs_stat_t st;
+    walk_stat(child, &nodes[i], &st);
+    if(nodes[i].type == 0) ret = w->fn(w->path, &st, FS_WALK_FILE, w->arg);
+    else {
+      if(w->order & FS_WALK_PRE) ret = w->fn(w->path, &st, FS_WALK_DIR, w->arg);
+      if(ret == 0) ret = walk_dir(w, child, &nodes[i]);
+      if(ret == 0 && (w->order & FS_WALK_POST)) ret = w->fn(w->path, &st, FS_WALK_DIR_POST, w->arg);
+    }
+  }
+  w->path[len ? len : 1] = '\0'; // back to the directory
+  free(entries);
+  free(kids);
+  free(nodes);
+  return ret;
+}
+
+int FS_Walk(char* path, fs_walk_fn fn, int order, void* arg)
+{
+  dprintf("FS_Walk('%s', fn, %d, arg):\n", path, order);
+  if(fn == NULL || path == NULL || strlen(path) >= MAX_PATH) {
+    dprintf("... error: no callback, or bad path\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  inode_t node;
+  int inode = dir_lookup(path, &node);
+  if(inode < 0) return -1;
+  inode_unlock(inode);
+
+  walk_t* w = (walk_t*)calloc(1, sizeof(walk_t));
+  if(!w) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  w->fn = fn;
+  w->order = order;
+  w->arg = arg;
+  // the path as given, without trailing '/'
+  int len = strlen(path);
+  while(len > 1 && path[len-1] == '/') len--;
+  memcpy(w->path, path, len);
+  w->seen[inode] = 1;
+
+  fs_stat_t st;
+  walk_stat(inode, &node, &st);
+  int ret = 0;
+  if(node.type == 0) ret = fn(w->path, &st, FS_WALK_FILE, arg);
+  else {
+    if(order & FS_WALK_PRE) ret = fn(w->path, &st, FS_WALK_DIR, arg);
+    if(ret == 0) ret = walk_dir(w, inode, &node);
+    if(ret == 0 && (order & FS_WALK_POST)) ret = fn(w->path, &st, FS_WALK_DIR_POST, arg);
+  }
+  dprintf("... walk done, %d inode table sectors read\n", w->reads);
+  free(w);
+  return ret;
+}
+
+int FS_Stat(char* path, fs_stat_t* st)
+{
+  dprintf("FS_Stat('%s', st):\n", path);
+  if(st == NULL) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  inode_t node;
+  int inode = dir_lookup(path, &node);
+  if(inode < 0) return -1;
+  inode_unlock(inode);
+  walk_stat(inode, &node, st);
+  return 0;
+}
+/* buffered stream ops (built on top of the file descriptor API) */
+
+// a buffered stream keeps a window of the file in memory; the window
+// always starts at a sector boundary and spans 'bufsize' bytes (a
+// multiple of SECTOR_SIZE), so that transfers between the buffer and
+// the disk are always whole sectors
+struct _fs_file {
+  int fd;       // file descriptor backing the stream
+  int inode;    // inode of the file
+  int mode;     // FS_STREAM_READ and/or FS_STREAM_WRITE
+  int pos;      // current stream position in bytes
+  inode_t* node; // the inode cached in the shared open file entry
+  char* buf;    // the buffer window
+  int bufsize;  // capacity of the window in bytes
+  int bufstart; // file offset of buf[0]; -1 if the window is empty
+  int buflen;   // number of valid bytes in the window
+  int dirty_lo; // first dirty sector within the window (-1 if clean)
+  int dirty_hi; // one past the last dirty sector within the window
+};
+
+#define FS_STREAM_READ  1
+#define FS_STREAM_WRITE 2
+
+// round a stream buffer size up to whole sectors; the buffer never
+// needs to be bigger than the largest possible file
+static int stream_bufsize(int size)
+{
+  if(size < SECTOR_SIZE) size = SECTOR_SIZE;
+  if(size > MAX_FILE_SIZE) size = MAX_FILE_SIZE;
+  return (size+SECTOR_SIZE-1)/SECTOR_SIZE*SECTOR_SIZE;
+}
+
+// the rest of stream_flush(), with the inode write-locked
+static int stream_flush_locked(FS_FILE* stream)
+{
+  int first = stream->bufstart/SECTOR_SIZE;
+  open_inode_t* of = OPEN_FILE(stream->fd).file;
+  dprintf("... flush stream (inode=%d) sectors data[%d..%d]\n", stream->inode,
+          first+stream->dirty_lo, first+stream->dirty_hi-1);
+
+  for(int i=stream->dirty_lo; i<stream->dirty_hi; i++) {
+    int idx = first+i;
+    if(idx*SECTOR_SIZE >= stream->node->size || stream->node->data[idx] == 0) {
+      // the sector lies beyond the end of the file or in a hole
+      int newsec;
+      if(file_sector_alloc(of, 1, &newsec) < 0) {
+        dprintf("... error: no space on disk, flush cannot complete\n");
+        osErrno = E_NO_SPACE;
+        return -1;
+      }
+      stream->node->data[idx] = newsec;
+    } else if(sector_unshare(&stream->node->data[idx], 0) < 0) {
+      // the sector is shared with a cloned file and needs a private copy
+      dprintf("... error: no space on disk to copy shared sector\n");
+      osErrno = E_NO_SPACE;
+      return -1;
+    }
+    if(Disk_Write(stream->node->data[idx], stream->buf+i*SECTOR_SIZE) < 0) {
+      dprintf("... error: failed to write sector %d\n", stream->node->data[idx]);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    // everything up to the end of a written sector now exists on disk
+    int end = min(stream->bufstart+stream->buflen, (idx+1)*SECTOR_SIZE);
+    if(end > stream->node->size) stream->node->size = end;
+  }
+  stream->dirty_lo = -1;
+
+  if(inode_write(stream->inode, stream->node) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  flush_poke();
+  return 0;
+}
+
+// write the dirty sectors of the window back to disk, allocating
+// sectors for the part of the window beyond the end of the file, and
+// update the file size; return 0 if successful, -1 otherwise
+static int stream_flush(FS_FILE* stream)
+{
+  if(stream->dirty_lo < 0) return 0;
+  txn_begin();
+  inode_lock(stream->inode, LOCK_WRITE);
+  int ret = stream_flush_locked(stream);
+  inode_unlock(stream->inode);
+  txn_end();
+  return ret;
+}
+
+// the rest of stream_fill(), with the inode read-locked
+static int stream_fill_locked(FS_FILE* stream, int offset)
+{
+  stream->bufstart = offset/SECTOR_SIZE*SECTOR_SIZE;
+  stream->buflen = min(stream->bufsize, stream->node->size-stream->bufstart);
+  if(stream->buflen < 0) stream->buflen = 0;
+  int sectors = (stream->buflen+SECTOR_SIZE-1)/SECTOR_SIZE;
+  dprintf("... fill stream (inode=%d) at offset %d with %d sectors\n",
+          stream->inode, stream->bufstart, sectors);
+
+  int first = stream->bufstart/SECTOR_SIZE;
+  for(int i=0; i<sectors; i++) {
+    if(stream->node->data[first+i] == 0) {
+      // a hole reads as zeros
+      memset(stream->buf+i*SECTOR_SIZE, 0, SECTOR_SIZE);
+      continue;
+    }
+    if(Disk_Read(stream->node->data[first+i], stream->buf+i*SECTOR_SIZE) < 0) {
+      dprintf("... error: can't read sector %d\n", stream->node->data[first+i]);
+      stream->bufstart = -1;
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  // keep the part past the end of the file zeroed so that partially
+  // filled sectors are written back clean
+  memset(stream->buf+stream->buflen, 0, stream->bufsize-stream->buflen);
+  return 0;
+}
+
+// move the window so that it covers the sector containing 'offset'
+// and fill it with the file's content; return 0 if successful, -1
+// otherwise
+static int stream_fill(FS_FILE* stream, int offset)
+{
+  if(stream_flush(stream) < 0) return -1;
+
+  inode_lock(stream->inode, LOCK_READ);
+  int ret = stream_fill_locked(stream, offset);
+  inode_unlock(stream->inode);
+  return ret;
+}
+
+// return the size of the file as seen through the stream, including
+// data still waiting in the buffer
+static int stream_size(FS_FILE* stream)
+{
+  inode_lock(stream->inode, LOCK_READ);
+  int size = stream->node->size;
+  inode_unlock(stream->inode);
+  if(stream->bufstart >= 0 && stream->bufstart+stream->buflen > size)
+    return stream->bufstart+stream->buflen;
+  return size;
+}
+
+// return true if the window currently covers 'offset'
+static int stream_covers(FS_FILE* stream, int offset)
+{
+  return stream->bufstart >= 0 && stream->bufstart <= offset &&
+    offset < stream->bufstart+stream->bufsize;
+}
+
+FS_FILE* FS_fopen(char* file, char* mode)
+{
+  dprintf("FS_fopen('%s', '%s'):\n", file, mode);
+
+  int flags;
+  if(mode == NULL) flags = 0;
+  else if(!strcmp(mode, "r")) flags = FS_STREAM_READ;
+  else if(!strcmp(mode, "r+") || !strcmp(mode, "w+") || !strcmp(mode, "a+"))
+    flags = FS_STREAM_READ|FS_STREAM_WRITE;
+  else if(!strcmp(mode, "w") || !strcmp(mode, "a")) flags = FS_STREAM_WRITE;
+  else flags = 0;
+  if(!flags) {
+    dprintf("... error: invalid mode '%s'\n", mode ? mode : "(null)");
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  if((flags & FS_STREAM_WRITE) && check_writable() < 0) return NULL;
+
+  // the 'w' and 'a' modes create the file if it doesn't exist yet
+  if(mode[0] != 'r') {
+    int child_inode;
+    if(follow_path(file, &child_inode, NULL, LOCK_NONE) >= 0 && child_inode < 0 &&
+       File_Create(file) < 0) return NULL;
+  }
+
+  int fd = File_Open(file);
+  if(fd < 0) return NULL;
+
+  FS_FILE* stream = (FS_FILE*)calloc(1, sizeof(FS_FILE));
+  if(stream) stream->bufsize = stream_bufsize(FS_BUFSIZ);
+  if(!stream || !(stream->buf = (char*)malloc(stream->bufsize))) {
+    dprintf("... error: out of memory for stream buffer\n");
+    free(stream);
+    File_Close(fd);
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  stream->fd = fd;
+  stream->inode = OPEN_FILE(fd).file->inode;
+  stream->node = &OPEN_FILE(fd).file->node;
+  stream->mode = flags;
+  stream->bufstart = -1;
+  stream->dirty_lo = -1;
+
+  txn_begin();
+  inode_lock(stream->inode, LOCK_WRITE);
+  int ret = 0;
+  if(mode[0] == 'w' && stream->node->size > 0) {
+    // discard the existing content of the file
+    ret = inode_resize(stream->node, 0);
+    if(ret == 0) ret = inode_write(stream->inode, stream->node);
+  }
+  if(mode[0] == 'a') stream->pos = stream->node->size;
+  inode_unlock(stream->inode);
+  txn_end();
+  if(ret < 0) {
+    FS_fclose(stream);
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+
+  dprintf("... stream opened on fd=%d (inode=%d, pos=%d)\n",
+          fd, stream->inode, stream->pos);
+  return stream;
+}
+
+int FS_setvbuf(FS_FILE* stream, int size)
+{
+  dprintf("FS_setvbuf(stream, %d):\n", size);
+  if(!stream) { osErrno = E_BAD_FD; return -1; }
+  if(stream_flush(stream) < 0) return -1;
+
+  size = stream_bufsize(size);
+  char* buf = (char*)malloc(size);
+  if(!buf) {
+    dprintf("... error: out of memory for stream buffer\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  free(stream->buf);
+  stream->buf = buf;
+  stream->bufsize = size;
+  stream->bufstart = -1;
+  return 0;
+}
+
+int FS_fread(FS_FILE* stream, void* buffer, int size)
+{
+  if(!stream || !(stream->mode & FS_STREAM_READ)) { osErrno = E_BAD_FD; return -1; }
+  if(size < 0) { osErrno = E_GENERAL; return -1; }
+
+  int done = 0;
+  size = min(size, stream_size(stream)-stream->pos);
+  while(done < size) {
+    if(!stream_covers(stream, stream->pos) && stream_fill(stream, stream->pos) < 0)
+      return -1;
+    int avail = stream->bufstart+stream->buflen-stream->pos;
+    int n = min(size-done, avail);
+    memcpy((char*)buffer+done, stream->buf+(stream->pos-stream->bufstart), n);
+    done += n;
+    stream->pos += n;
+  }
+  return done;
+}
+
+char* FS_fgets(FS_FILE* stream, char* s, int size)
+{
+  if(!stream || !(stream->mode & FS_STREAM_READ)) { osErrno = E_BAD_FD; return NULL; }
+  if(size <= 0) { osErrno = E_GENERAL; return NULL; }
+
+  int done = 0;
+  while(done < size-1 && stream->pos < stream_size(stream)) {
+    if(!stream_covers(stream, stream->pos) && stream_fill(stream, stream->pos) < 0)
+      return NULL;
+    char* from = stream->buf+(stream->pos-stream->bufstart);
+    int n = min(size-1-done, stream->bufstart+stream->buflen-stream->pos);
+    char* nl = memchr(from, '\n', n);
+    if(nl) n = nl-from+1;
+    memcpy(s+done, from, n);
+    done += n;
+    stream->pos += n;
+    if(nl) break;
+  }
+  if(done == 0) return NULL; // end of file
+  s[done] = '\0';
+  return s;
+}
+
+int FS_fwrite(FS_FILE* stream, void* buffer, int size)
+{
+  if(!stream || !(stream->mode & FS_STREAM_WRITE)) { osErrno = E_BAD_FD; return -1; }
+  if(size < 0) { osErrno = E_GENERAL; return -1; }
+  if(stream->pos+size > MAX_FILE_SIZE) {
+    dprintf("... error: stream write of %d bytes at %d exceeds max file size\n",
+            size, stream->pos);
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
+
+  int done = 0;
+  while(done < size) {
+    if(!stream_covers(stream, stream->pos) && stream_fill(stream, stream->pos) < 0)
+      return -1;
+    int at = stream->pos-stream->bufstart;
+    int n = min(size-done, stream->bufsize-at);
+    memcpy(stream->buf+at, (char*)buffer+done, n);
+
+    // extend the dirty range to the sectors just touched
+    int lo = at/SECTOR_SIZE, hi = (at+n+SECTOR_SIZE-1)/SECTOR_SIZE;
+    if(stream->dirty_lo < 0) { stream->dirty_lo = lo; stream->dirty_hi = hi; }
+    else {
+      if(lo < stream->dirty_lo) stream->dirty_lo = lo;
+      if(hi > stream->dirty_hi) stream->dirty_hi = hi;
+    }
+    if(at+n > stream->buflen) stream->buflen = at+n;
+    done += n;
+    stream->pos += n;
+  }
+  return done;
+}
+
+int FS_fflush(FS_FILE* stream)
+{
+  dprintf("FS_fflush(stream):\n");
+  if(!stream) { osErrno = E_BAD_FD; return -1; }
+  return stream_flush(stream);
+}
+
+int FS_fclose(FS_FILE* stream)
+{
+  dprintf("FS_fclose(stream):\n");
+  if(!stream) { osErrno = E_BAD_FD; return -1; }
+  int ret = stream_flush(stream);
+  if(File_Close(stream->fd) < 0) ret = -1;
+  free(stream->buf);
+  free(stream);
+  return ret;
+}
+
+/* asynchronous ops */
+
+// requests wait on the submission queue until a worker thread takes
+// them, and are put on the completion queue when done; 'aio_lock'
+// protects the queues and the counters; the workers run their
+// requests at the same time, and reads and writes are done at the
+// offset of the request without moving the read/write position of
+// the fd, so several requests may share an fd
+
+// run a request against the library
+static void aio_run(fs_aio_t* req)
+{
+  switch(req->op) {
+  case FS_AIO_READ:
+  case FS_AIO_WRITE: {
+    fs_iovec_t iov = { req->buffer, req->size };
+    if(req->offset < 0 || req->offset > MAX_FILE_SIZE) {
+      dprintf("... error: offset=%d out of bound\n", req->offset);
+      osErrno = E_SEEK_OUT_OF_BOUNDS;
+      req->result = -1;
+    } else req->result = (req->op == FS_AIO_READ) ?
+      readv_at(req->fd, &iov, 1, req->offset) : writev_at(req->fd, &iov, 1, req->offset);
+    break;
+  }
+  case FS_AIO_CREATE:
+    req->result = File_Create(req->path);
+    break;
+  case FS_AIO_UNLINK:
+    req->result = File_Unlink(req->path);
+    break;
+  }
+  req->error = (req->result < 0) ? osErrno : 0;
+}
+
+static void* aio_worker(void* arg)
+{
+  fs_enter((fs_t*)arg);
+  pthread_mutex_lock(&fs->aio_lock);
+  for(;;) {
+    while(!fs->sq_head && !fs->aio_stop) pthread_cond_wait(&fs->aio_submitted, &fs->aio_lock);
+    if(!fs->sq_head) break; // stopped, and nothing left to do
+    fs_aio_t* req = fs->sq_head;
+    fs->sq_head = req->next;
+    if(!fs->sq_head) fs->sq_tail = NULL;
+    pthread_mutex_unlock(&fs->aio_lock);
+
+    aio_run(req);
+
+    pthread_mutex_lock(&fs->aio_lock);
+    req->next = NULL;
+    if(fs->cq_tail) fs->cq_tail->next = req;
+    else fs->cq_head = req;
+    fs->cq_tail = req;
+    fs->cq_count++;
+    fs->aio_inflight--;
+    pthread_cond_broadcast(&fs->aio_completed);
+  }
+  pthread_mutex_unlock(&fs->aio_lock);
+  return NULL;
+}
+
+// take up to 'max' requests off the completion queue; called with
+// 'aio_lock' held
+static int aio_reap(fs_aio_t** done, int max)
+{
+  int n = 0;
+  while(n < max && fs->cq_head) {
+    done[n++] = fs->cq_head;
+    fs->cq_head = fs->cq_head->next;
+  }
+  if(!fs->cq_head) fs->cq_tail = NULL;
+  fs->cq_count -= n;
+  return n;
+}
+
+int FS_AioSetup(int workers, int depth)
+{
+  dprintf("FS_AioSetup(%d, %d):\n", workers, depth);
+  if(workers <= 0 || depth <= 0 || fs->aio_nworkers > 0) {
+    dprintf("... error: bad parameters, or already set up\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  fs->aio_workers = (pthread_t*)malloc(workers*sizeof(pthread_t));
+  if(!fs->aio_workers) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  fs->aio_depth = depth;
+  fs->aio_stop = 0;
+  for(fs->aio_nworkers = 0; fs->aio_nworkers < workers; fs->aio_nworkers++) {
+    if(pthread_create(&fs->aio_workers[fs->aio_nworkers], NULL, aio_worker, fs)) {
+      dprintf("... error: can't start worker thread %d\n", fs->aio_nworkers);
+      FS_AioTeardown();
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+  dprintf("... started %d worker threads\n", workers);
+  return 0;
+}
+
+// queue a request; wait for room if 'depth' requests are in flight
+int FS_AioSubmit(fs_aio_t* req)
+{
+  if(!req || req->op < FS_AIO_READ || req->op > FS_AIO_UNLINK) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  pthread_mutex_lock(&fs->aio_lock);
+  if(fs->aio_nworkers == 0 || fs->aio_stop) {
+    pthread_mutex_unlock(&fs->aio_lock);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  while(fs->aio_inflight >= fs->aio_depth) pthread_cond_wait(&fs->aio_completed, &fs->aio_lock);
+  req->next = NULL;
+  if(fs->sq_tail) fs->sq_tail->next = req;
+  else fs->sq_head = req;
+  fs->sq_tail = req;
+  fs->aio_inflight++;
+  pthread_cond_signal(&fs->aio_submitted);
+  pthread_mutex_unlock(&fs->aio_lock);
+  return 0;
+}
+
+// collect up to 'max' completed requests without waiting
+int FS_AioPoll(fs_aio_t** done, int max)
+{
+  pthread_mutex_lock(&fs->aio_lock);
+  int n = aio_reap(done, max);
+  pthread_mutex_unlock(&fs->aio_lock);
+  return n;
+}
+
+// collect up to 'max' completed requests, waiting until there are at
+// least 'min' of them, or nothing is in flight any more
+int FS_AioWait(fs_aio_t** done, int min, int max)
+{
+  if(min > max) min = max;
+  pthread_mutex_lock(&fs->aio_lock);
+  while(fs->cq_count < min && fs->aio_inflight > 0) pthread_cond_wait(&fs->aio_completed, &fs->aio_lock);
+  int n = aio_reap(done, max);
+  pthread_mutex_unlock(&fs->aio_lock);
+  return n;
+}
+
+// finish the requests in flight and stop the worker threads; requests
+// completed and not collected are dropped from the completion queue
+int FS_AioTeardown()
+{
+  dprintf("FS_AioTeardown():\n");
+  pthread_mutex_lock(&fs->aio_lock);
+  fs->aio_stop = 1;
+  pthread_cond_broadcast(&fs->aio_submitted);
+  pthread_mutex_unlock(&fs->aio_lock);
+  for(int i=0; i<fs->aio_nworkers; i++) pthread_join(fs->aio_workers[i], NULL);
+
+  free(fs->aio_workers);
+  fs->aio_workers = NULL;
+  fs->aio_nworkers = 0;
+  fs->cq_head = fs->cq_tail = NULL;
+  fs->cq_count = 0;
+  return 0;
+}
+
+/* mounting several file systems */
+
+// run 'call' on file system 'f' instead of the one the calling thread
+// works on, and return what it returns ('fail' if 'f' is NULL)
+#define FS_CALL(f, type, fail, call) { \
+  if(!(f)) { osErrno = E_GENERAL; return fail; } \
+  fs_t* prev = fs_enter(f); \
+  type ret = call; \
+  fs_enter(prev); \
+  return ret; \
+}
+
+fs_t* FS_Mount(char* path, int mode)
+{
+  dprintf("FS_Mount('%s', %d):\n", path, mode);
+  if(mode < FS_MOUNT_MEMORY || mode > FS_MOUNT_LOG) {
+    dprintf("... error: bad mount mode\n");
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  fs_t* f = (fs_t*)calloc(1, sizeof(fs_t));
+  if(f) f->disk = Disk_New();
+  if(!f || !f->disk) {
+    dprintf("... error: out of memory\n");
+    free(f);
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  fs_init(f);
+
+  fs_t* prev = fs_enter(f);
+  int ret;
+  switch(mode) {
+  case FS_MOUNT_FILE: ret = boot(path, DISK_FILE); break;
+  case FS_MOUNT_READONLY: ret = boot(path, DISK_READONLY); break;
+  case FS_MOUNT_LOG: ret = FS_BootLog(path); break;
+  default: ret = boot(path, DISK_MEMORY); break;
+  }
+  if(ret < 0) open_files_reset();
+  fs_enter(prev);
+  if(ret < 0) {
+    free(f->refcounts);
+    Disk_Free(f->disk);
+    free(f);
+    return NULL;
+  }
+  return f;
+}
+
+// stop the flusher and the async workers, sync the file system and
+// let go of it, even if the sync fails; return 0 if successful, -1
+// otherwise
+int FS_Unmount(fs_t* f)
+{
+  dprintf("FS_Unmount():\n");
+  if(!f || f == &default_fs) {
+    dprintf("... error: not a mounted file system\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  fs_t* prev = fs_enter(f);
+  FS_AioTeardown();
+  FS_FlushTeardown();
+  int ret = FS_Sync();
+  open_files_reset();
+  free(fs->refcounts);
+  fs_enter(prev == f ? &default_fs : prev);
+  Disk_Free(f->disk);
+  free(f);
+  return ret;
+}
+
+int FS_Sync_r(fs_t* f)
+{
+  FS_CALL(f, int, -1, FS_Sync());
+}
+
+int FS_FlushSetup_r(fs_t* f, int interval, int threshold)
+{
+  FS_CALL(f, int, -1, FS_FlushSetup(interval, threshold));
+}
+
+int FS_FlushTeardown_r(fs_t* f)
+{
+  FS_CALL(f, int, -1, FS_FlushTeardown());
+}
+
+int FS_Check_r(fs_t* f, int repair, fs_check_t* report)
+{
+  FS_CALL(f, int, -1, FS_Check(repair, report));
+}
+
+int File_Create_r(fs_t* f, char* file)
+{
+  FS_CALL(f, int, -1, File_Create(file));
+}
+
+int File_Open_r(fs_t* f, char* file)
+{
+  FS_CALL(f, int, -1, File_Open(file));
+}
+
+int File_Read_r(fs_t* f, int fd, void* buffer, int size)
+{
+  FS_CALL(f, int, -1, File_Read(fd, buffer, size));
+}
+
+int File_Write_r(fs_t* f, int fd, void* buffer, int size)
+{
+  FS_CALL(f, int, -1, File_Write(fd, buffer, size));
+}
+
+int File_Seek_r(fs_t* f, int fd, int offset)
+{
+  FS_CALL(f, int, -1, File_Seek(fd, offset));
+}
+
+int File_Truncate_r(fs_t* f, int fd, int size)
+{
+  FS_CALL(f, int, -1, File_Truncate(fd, size));
+}
+
+int File_Close_r(fs_t* f, int fd)
+{
+  FS_CALL(f, int, -1, File_Close(fd));
+}
+
+int File_Unlink_r(fs_t* f, char* file)
+{
+  FS_CALL(f, int, -1, File_Unlink(file));
+}
+
+int File_Clone_r(fs_t* f, char* src, char* dst)
+{
+  FS_CALL(f, int, -1, File_Clone(src, dst));
+}
+
+int File_Rename_r(fs_t* f, char* from, char* to)
+{
+  FS_CALL(f, int, -1, File_Rename(from, to));
+}
+
+int File_ImportHost_r(fs_t* f, char* file, char* hostfile)
+{
+  FS_CALL(f, int, -1, File_ImportHost(file, hostfile));
+}
+
+int File_ExportHost_r(fs_t* f, char* file, char* hostfile)
+{
+  FS_CALL(f, int, -1, File_ExportHost(file, hostfile));
+}
+
+int File_ReadV_r(fs_t* f, int fd, fs_iovec_t* iov, int iovcnt)
+{
+  FS_CALL(f, int, -1, File_ReadV(fd, iov, iovcnt));
+}
+
+int File_WriteV_r(fs_t* f, int fd, fs_iovec_t* iov, int iovcnt)
+{
+  FS_CALL(f, int, -1, File_WriteV(fd, iov, iovcnt));
+}
+
+int Dir_Create_r(fs_t* f, char* path)
+{
+  FS_CALL(f, int, -1, Dir_Create(path));
+}
+
+int Dir_Unlink_r(fs_t* f, char* path)
+{
+  FS_CALL(f, int, -1, Dir_Unlink(path));
+}
+
+int Dir_Size_r(fs_t* f, char* path)
+{
+  FS_CALL(f, int, -1, Dir_Size(path));
+}
+
+int Dir_Read_r(fs_t* f, char* path, void* buffer, int size)
+{
+  FS_CALL(f, int, -1, Dir_Read(path, buffer, size));
+}
+
+int Dir_UnlinkRecursive_r(fs_t* f, char* path)
+{
+  FS_CALL(f, int, -1, Dir_UnlinkRecursive(path));
+}
+
+int Dir_Rename_r(fs_t* f, char* from, char* to)
+{
+  FS_CALL(f, int, -1, Dir_Rename(from, to));
+}
+
+int Dir_OpenHandle_r(fs_t* f, char* path)
+{
+  FS_CALL(f, int, -1, Dir_OpenHandle(path));
+}
+
+int Dir_CloseHandle_r(fs_t* f, int dh)
+{
+  FS_CALL(f, int, -1, Dir_CloseHandle(dh));
+}
+
+int File_OpenAt_r(fs_t* f, int dh, char* file)
+{
+  FS_CALL(f, int, -1, File_OpenAt(dh, file));
+}
+
+int File_CreateAt_r(fs_t* f, int dh, char* file)
+{
+  FS_CALL(f, int, -1, File_CreateAt(dh, file));
+}
+
+int Dir_CreateAt_r(fs_t* f, int dh, char* path)
+{
+  FS_CALL(f, int, -1, Dir_CreateAt(dh, path));
+}
+
+int FS_Walk_r(fs_t* f, char* path, fs_walk_fn fn, int order, void* arg)
+{
+  FS_CALL(f, int, -1, FS_Walk(path, fn, order, arg));
+}
+
+int FS_Stat_r(fs_t* f, char* path, fs_stat_t* st)
+{
+  FS_CALL(f, int, -1, FS_Stat(path, st));
+}
+
+int File_OpenInode_r(fs_t* f, int inode)
+{
+  FS_CALL(f, int, -1, File_OpenInode(inode));
+}
+
+FS_FILE* FS_fopen_r(fs_t* f, char* file, char* mode)
+{
+  FS_CALL(f, FS_FILE*, NULL, FS_fopen(file, mode));
+}
+
+int FS_setvbuf_r(fs_t* f, FS_FILE* stream, int size)
+{
+  FS_CALL(f, int, -1, FS_setvbuf(stream, size));
+}
+
+int FS_fread_r(fs_t* f, FS_FILE* stream, void* buffer, int size)
+{
+  FS_CALL(f, int, -1, FS_fread(stream, buffer, size));
+}
+
+int FS_fwrite_r(fs_t* f, FS_FILE* stream, void* buffer, int size)
+{
+  FS_CALL(f, int, -1, FS_fwrite(stream, buffer, size));
+}
+
+char* FS_fgets_r(fs_t* f, FS_FILE* stream, char* s, int size)
+{
+  FS_CALL(f, char*, NULL, FS_fgets(stream, s, size));
+}
+
+int FS_fflush_r(fs_t* f, FS_FILE* stream)
+{
+  FS_CALL(f, int, -1, FS_fflush(stream));
+}
+
+int FS_fclose_r(fs_t* f, FS_FILE* stream)
+{
+  FS_CALL(f, int, -1, FS_fclose(stream));
+}
+
+int FS_AioSetup_r(fs_t* f, int workers, int depth)
+{
+  FS_CALL(f, int, -1, FS_AioSetup(workers, depth));
+}
+
+int FS_AioSubmit_r(fs_t* f, fs_aio_t* req)
+{
+  FS_CALL(f, int, -1, FS_AioSubmit(req));
+}
+
+int FS_AioPoll_r(fs_t* f, fs_aio_t** done, int max)
+{
+  FS_CALL(f, int, -1, FS_AioPoll(done, max));
+}
+
+int FS_AioWait_r(fs_t* f, fs_aio_t** done, int min, int max)
+{
+  FS_CALL(f, int, -1, FS_AioWait(done, min, max));
+}
+
+int FS_AioTeardown_r(fs_t* f)
+{
+  FS_CALL(f, int, -1, FS_AioTeardown());
+}
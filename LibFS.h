@@ -20,10 +20,11 @@ typedef enum {
     E_DIR_NOT_EMPTY,
     E_ROOT_DIR,
     E_BUFFER_TOO_SMALL, 
+    E_READ_ONLY,
 } FS_Error_t;
     
-// used for errors
-extern int osErrno;
+// used for errors (each thread has its own)
+extern __thread int osErrno;
 
 // a few file system parameters
 
@@ -40,16 +41,84 @@ extern int osErrno;
 
 // file system generic calls
 int FS_Boot(char *path);
+int FS_BootFile(char *path);
 int FS_Sync();
 
+// like FS_Boot(), but also switches the file system to the
+// log-structured layout if it isn't yet: data, directories and inodes
+// are never written in place but to the head of a log, which suits
+// the churn of many small files; the layout stays when booted later
+// with FS_Boot() or FS_BootFile()
+int FS_BootLog(char *path);
+
+// like FS_Boot(), but the backstore file is only mapped, read-only and
+// shared with other processes, and never written: calls that would
+// change the file system fail with E_READ_ONLY and FS_Sync() does
+// nothing, so several readers can use the same file at once; the file
+// must hold a file system already
+int FS_BootReadOnly(char *path);
+
+// the background flusher writes the dirty sectors back to the
+// backstore file every 'interval' milliseconds, or as soon as
+// 'threshold' sectors are dirty, so that FS_Sync() only has to write
+// what's left; it must be torn down before booting again
+int FS_FlushSetup(int interval, int threshold);
+int FS_FlushTeardown();
+
+// the file system checker makes one pass over the inode table (split
+// among a few threads) and walks the directory tree from the root,
+// then compares what the files and directories use with the inode and
+// sector bitmaps and the sector reference counts; operations changing
+// the file system wait while it runs; with 'repair' set, the problems
+// are fixed and committed; the counts go to 'report' (unless NULL);
+// return the number of problems found, -1 on error (or if the root
+// directory is damaged)
+typedef struct _fs_check {
+  int files;            // files reached from the root directory
+  int dirs;             // directories reached from the root directory
+  int sectors;          // data sectors in use
+  int bad_entries;      // directory entries naming no valid inode, or one named twice (dropped)
+  int bad_sectors;      // file sectors outside the data blocks (made holes)
+  int lost_inodes;      // inodes marked used but not reached (freed)
+  int unmarked_inodes;  // inodes reached but not marked used (marked)
+  int lost_sectors;     // sectors marked used but not in use (freed)
+  int unmarked_sectors; // sectors in use but not marked used (marked)
+  int bad_refcounts;    // wrong reference counts of shared sectors (fixed)
+} fs_check_t;
+
+int FS_Check(int repair, fs_check_t *report);
+
 // file ops
 int File_Create(char *file);
 int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
 int File_Seek(int fd, int offset);
+int File_Truncate(int fd, int size);
 int File_Close(int fd);
 int File_Unlink(char *file);
+int File_Clone(char *src, char *dst);
+int File_ImportHost(char *file, char *hostfile);
+int File_ExportHost(char *file, char *hostfile);
+
+// rename or move a file or directory; only its directory entry moves,
+// so the data stays where it is, and an open file stays open; a file
+// already at 'to' is replaced at once (like rename() does), which is
+// how a file written aside is published; a directory can't replace
+// anything, nor move under itself
+int File_Rename(char *from, char *to);
+int Dir_Rename(char *from, char *to);
+
+// vectored file ops; the buffers of the vector are read or written in
+// order as one contiguous range of the file, starting at the current
+// read/write position
+typedef struct _fs_iovec {
+  void *base; // start of the buffer
+  int len;    // size of the buffer in bytes
+} fs_iovec_t;
+
+int File_ReadV(int fd, fs_iovec_t *iov, int iovcnt);
+int File_WriteV(int fd, fs_iovec_t *iov, int iovcnt);
 
 // directory ops
 int Dir_Create(char *path);
@@ -57,4 +126,166 @@ int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 
+// remove a directory and everything under it; files still open are
+// only unlinked, and freed on their last close
+int Dir_UnlinkRecursive(char *path);
+
+// a directory handle stands for an open directory, from which the
+// *At() calls follow a relative path (an absolute one is followed from
+// the root, as usual), so the path to the directory is followed once
+// only; a directory unlinked while a handle is open on it is freed
+// when the last one is closed, and nothing can be found or created in
+// it meanwhile
+int Dir_OpenHandle(char *path);
+int Dir_CloseHandle(int dh);
+int File_OpenAt(int dh, char *file);
+int File_CreateAt(int dh, char *file);
+int Dir_CreateAt(int dh, char *path);
+
+// the tree walk visits 'path' and everything under it, depth first in
+// directory order, calling 'fn' on each file (FS_WALK_FILE), and on
+// each directory before (FS_WALK_DIR) and/or after (FS_WALK_DIR_POST)
+// what it holds, as 'order' asks (FS_WALK_PRE and/or FS_WALK_POST);
+// the inodes of the children of a directory are read together, each
+// inode table sector once; no lock is held while 'fn' runs, so it may
+// change the file system (the rest of the walk may or may not see the
+// change); a nonzero return from 'fn' stops the walk, and is what
+// FS_Walk() returns; otherwise return 0, or -1 on error
+typedef struct _fs_stat {
+  int inode;   // inode number
+  int type;    // 0 for a file, 1 for a directory
+  int size;    // in bytes (for a directory, as Dir_Size() gives it)
+  int sectors; // data sectors in use
+} fs_stat_t;
+
+#define FS_WALK_PRE  1
+#define FS_WALK_POST 2
+
+#define FS_WALK_FILE     0
+#define FS_WALK_DIR      1
+#define FS_WALK_DIR_POST 2
+
+typedef int (*fs_walk_fn)(char *path, fs_stat_t *st, int visit, void *arg);
+
+int FS_Walk(char *path, fs_walk_fn fn, int order, void *arg);
+
+// FS_Stat() tells the same about 'path' as the walk does, its inode
+// number included; File_OpenInode() opens the file by that number,
+// without following a path, and fails if the inode is no longer in
+// use, is a directory, or was unlinked (a number kept around may come
+// to stand for another file, once the first one is unlinked)
+int FS_Stat(char *path, fs_stat_t *st);
+int File_OpenInode(int inode);
+
+// buffered stream ops; a stream wraps a file descriptor and moves data
+// between its buffer and the disk in whole sectors, so that small
+// reads and writes are served from memory
+typedef struct _fs_file FS_FILE;
+
+// default size of the stream buffer (in bytes)
+#define FS_BUFSIZ 4096
+
+FS_FILE* FS_fopen(char *file, char *mode);
+int FS_setvbuf(FS_FILE *stream, int size);
+int FS_fread(FS_FILE *stream, void *buffer, int size);
+int FS_fwrite(FS_FILE *stream, void *buffer, int size);
+char* FS_fgets(FS_FILE *stream, char *s, int size);
+int FS_fflush(FS_FILE *stream);
+int FS_fclose(FS_FILE *stream);
+
+// asynchronous ops; requests are put on a submission queue and run
+// by a pool of worker threads, and finished requests are collected
+// from a completion queue; the request stays owned by the caller and
+// must not be touched until it completes
+#define FS_AIO_READ   0
+#define FS_AIO_WRITE  1
+#define FS_AIO_CREATE 2
+#define FS_AIO_UNLINK 3
+
+typedef struct _fs_aio {
+  int op;        // one of the FS_AIO_* ops
+  int fd;        // file descriptor to read or write
+  int offset;    // file offset to read or write at
+  void *buffer;  // buffer to read into or write from
+  int size;      // number of bytes to read or write
+  char *path;    // file to create or unlink
+  void *data;    // left untouched, for the caller's use
+  int result;    // set on completion: what the synchronous call returns
+  int error;     // set on completion: osErrno if the op failed
+  struct _fs_aio *next; // used internally to link the queues
+} fs_aio_t;
+
+int FS_AioSetup(int workers, int depth);
+int FS_AioSubmit(fs_aio_t *req);
+int FS_AioPoll(fs_aio_t **done, int max);
+int FS_AioWait(fs_aio_t **done, int min, int max);
+int FS_AioTeardown();
+
+// several file systems can be mounted at once, each from a backstore
+// file of its own and with its own disk, caches and open files; the
+// calls above work on the default file system (the one booted with
+// FS_Boot() and the like), and each has a variant ending in _r that
+// works on the file system given first instead; file descriptors,
+// streams and async requests belong to the file system they were
+// opened or submitted on; a file system must not be used once it's
+// unmounted (which syncs it, like FS_Sync())
+typedef struct _fs fs_t;
+
+#define FS_MOUNT_MEMORY   0 // like FS_Boot()
+#define FS_MOUNT_FILE     1 // like FS_BootFile()
+#define FS_MOUNT_READONLY 2 // like FS_BootReadOnly()
+#define FS_MOUNT_LOG      3 // like FS_BootLog()
+
+fs_t* FS_Mount(char *path, int mode);
+int FS_Unmount(fs_t *fs);
+
+int FS_Sync_r(fs_t *fs);
+int FS_FlushSetup_r(fs_t *fs, int interval, int threshold);
+int FS_FlushTeardown_r(fs_t *fs);
+int FS_Check_r(fs_t *fs, int repair, fs_check_t *report);
+
+int File_Create_r(fs_t *fs, char *file);
+int File_Open_r(fs_t *fs, char *file);
+int File_Read_r(fs_t *fs, int fd, void *buffer, int size);
+int File_Write_r(fs_t *fs, int fd, void *buffer, int size);
+int File_Seek_r(fs_t *fs, int fd, int offset);
+int File_Truncate_r(fs_t *fs, int fd, int size);
+int File_Close_r(fs_t *fs, int fd);
+int File_Unlink_r(fs_t *fs, char *file);
+int File_Clone_r(fs_t *fs, char *src, char *dst);
+int File_Rename_r(fs_t *fs, char *from, char *to);
+int File_ImportHost_r(fs_t *fs, char *file, char *hostfile);
+int File_ExportHost_r(fs_t *fs, char *file, char *hostfile);
+int File_ReadV_r(fs_t *fs, int fd, fs_iovec_t *iov, int iovcnt);
+int File_WriteV_r(fs_t *fs, int fd, fs_iovec_t *iov, int iovcnt);
+
+int Dir_Create_r(fs_t *fs, char *path);
+int Dir_Unlink_r(fs_t *fs, char *path);
+int Dir_Size_r(fs_t *fs, char *path);
+int Dir_Read_r(fs_t *fs, char *path, void *buffer, int size);
+int Dir_UnlinkRecursive_r(fs_t *fs, char *path);
+int Dir_Rename_r(fs_t *fs, char *from, char *to);
+int Dir_OpenHandle_r(fs_t *fs, char *path);
+int Dir_CloseHandle_r(fs_t *fs, int dh);
+int File_OpenAt_r(fs_t *fs, int dh, char *file);
+int File_CreateAt_r(fs_t *fs, int dh, char *file);
+int Dir_CreateAt_r(fs_t *fs, int dh, char *path);
+int FS_Walk_r(fs_t *fs, char *path, fs_walk_fn fn, int order, void *arg);
+int FS_Stat_r(fs_t *fs, char *path, fs_stat_t *st);
+int File_OpenInode_r(fs_t *fs, int inode);
+
+FS_FILE* FS_fopen_r(fs_t *fs, char *file, char *mode);
+int FS_setvbuf_r(fs_t *fs, FS_FILE *stream, int size);
+int FS_fread_r(fs_t *fs, FS_FILE *stream, void *buffer, int size);
+int FS_fwrite_r(fs_t *fs, FS_FILE *stream, void *buffer, int size);
+char* FS_fgets_r(fs_t *fs, FS_FILE *stream, char *s, int size);
+int FS_fflush_r(fs_t *fs, FS_FILE *stream);
+int FS_fclose_r(fs_t *fs, FS_FILE *stream);
+
+int FS_AioSetup_r(fs_t *fs, int workers, int depth);
+int FS_AioSubmit_r(fs_t *fs, fs_aio_t *req);
+int FS_AioPoll_r(fs_t *fs, fs_aio_t **done, int max);
+int FS_AioWait_r(fs_t *fs, fs_aio_t **done, int min, int max);
+int FS_AioTeardown_r(fs_t *fs);
+
 #endif /* __LibFS_h__ */
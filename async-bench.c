@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibFS.h"
+
+// measures the throughput of asynchronous sector-sized reads and
+// writes as the queue depth grows; the disk image is used in place
+// (FS_BootFile) and each completion is followed by some computation,
+// which is what the queue lets the caller overlap with file system
+// work; the results go to stderr, so build the library with
+// -DFSDEBUG=0 or send stdout to /dev/null
+
+#define BLOCK 512
+#define BLOCKS MAX_SECTORS_PER_FILE
+#define OPS 4000
+#define MAX_DEPTH 32
+#define WORKERS 4
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file> [compute_iterations]\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+// stands in for the work the caller does with each completed request
+static unsigned compute(char* buf, int iterations)
+{
+  unsigned sum = 0;
+  for(int k=0; k<iterations; k++)
+    for(int i=0; i<BLOCK; i++) sum = sum*31+buf[i];
+  return sum;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2 && argc != 3) usage(argv[0]);
+  int iterations = (argc == 3) ? atoi(argv[2]) : 5;
+
+  if(FS_BootFile(argv[1]) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system booted from file '%s'\n", argv[1]);
+
+  char* fn = "/bench-file";
+  File_Create(fn);
+  int fd = File_Open(fn);
+  static char data[BLOCKS*BLOCK];
+  for(int i=0; i<sizeof(data); i++) data[i] = 'a'+i%26;
+  fs_iovec_t iov = { data, sizeof(data) };
+  if(fd < 0 || File_WriteV(fd, &iov, 1) != sizeof(data)) {
+    printf("ERROR: can't write file '%s'\n", fn);
+    return -1;
+  }
+
+  if(FS_AioSetup(WORKERS, MAX_DEPTH) < 0) {
+    printf("ERROR: can't set up async ops\n");
+    return -1;
+  }
+
+  static fs_aio_t reqs[MAX_DEPTH];
+  static char bufs[MAX_DEPTH][BLOCK];
+  fs_aio_t* done[MAX_DEPTH];
+  unsigned sum = 0;
+  int errors = 0;
+  fprintf(stderr, "%d workers, %d ops (3 reads : 1 write), compute=%d\n",
+          WORKERS, OPS, iterations);
+  fprintf(stderr, "depth      ops/s\n");
+  for(int depth=1; depth<=MAX_DEPTH; depth*=2) {
+    double start = now();
+    int submitted = 0, completed = 0;
+    // fill the queue, then submit a new request for each one completed
+    for(int i=0; i<depth; i++) {
+      memset(&reqs[i], 0, sizeof(fs_aio_t));
+      reqs[i].data = bufs[i];
+      done[i] = &reqs[i];
+    }
+    int ready = depth;
+    while(completed < OPS) {
+      for(int i=0; i<ready && submitted<OPS; i++) {
+        fs_aio_t* req = done[i];
+        req->op = (submitted%4 == 3) ? FS_AIO_WRITE : FS_AIO_READ;
+        req->fd = fd;
+        req->offset = (submitted*7%BLOCKS)*BLOCK;
+        req->buffer = req->data;
+        req->size = BLOCK;
+        if(req->op == FS_AIO_WRITE) memcpy(req->buffer, data+req->offset, BLOCK);
+        FS_AioSubmit(req);
+        submitted++;
+      }
+      ready = FS_AioWait(done, 1, depth);
+      for(int i=0; i<ready; i++) {
+        if(done[i]->result != BLOCK) errors++;
+        sum += compute(done[i]->buffer, iterations);
+      }
+      completed += ready;
+    }
+    double secs = now()-start;
+    fprintf(stderr, "%5d %10.0f\n", depth, OPS/secs);
+  }
+  FS_AioTeardown();
+  File_Close(fd);
+
+  if(errors) printf("ERROR: %d requests failed\n", errors);
+  else printf("all async requests completed successfully (checksum %u)\n", sum);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync file system to file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system sync'd to file '%s'\n", argv[1]);
+
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibFS.h"
+
+// measures the churn of many small files: each round creates a batch
+// of files of a few hundred bytes, unlinks the batch created a few
+// rounds before (after checking what it reads back), and syncs, which
+// is what a mail spool or a build directory does; with the 'log'
+// option, the file system is switched to the log-structured layout
+// first (FS_BootLog), which writes each sync out sequentially; the
+// disk is written over many times, so the log has to be cleaned; the
+// results go to stderr, so build the library with -DFSDEBUG=0 or send
+// stdout to /dev/null
+
+#define ROUNDS 60
+#define FILES 100     // files per round
+#define KEEP 3        // rounds a file lives for
+#define MAX_BYTES 1500
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file> [log]\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+// the size and content of each file tell which one it is
+static int file_bytes(int r, int i)
+{
+  return 100+(r*FILES+i)*37%(MAX_BYTES-100);
+}
+
+static void file_data(int r, int i, char* data)
+{
+  for(int k=0; k<MAX_BYTES; k++) data[k] = r*7+i+k;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2 && argc != 3) usage(argv[0]);
+  int log_mode = (argc == 3 && !strcmp(argv[2], "log"));
+  if(argc == 3 && !log_mode) usage(argv[0]);
+
+  if((log_mode ? FS_BootLog(argv[1]) : FS_Boot(argv[1])) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system booted from file '%s'\n", argv[1]);
+
+  char* dir = "/churn";
+  char fn[64], data[MAX_BYTES], back[MAX_BYTES];
+  int errors = 0;
+  double syncs = 0, start = now();
+  if(Dir_Create(dir) < 0) errors++;
+  for(int r=0; r<ROUNDS+KEEP; r++) {
+    for(int i=0; r<ROUNDS && i<FILES; i++) {
+      sprintf(fn, "%s/f%d-%d", dir, r, i);
+      file_data(r, i, data);
+      int fd;
+      if(File_Create(fn) < 0 || (fd = File_Open(fn)) < 0) { errors++; continue; }
+      if(File_Write(fd, data, file_bytes(r, i)) != file_bytes(r, i)) errors++;
+      File_Close(fd);
+    }
+    for(int i=0; r>=KEEP && i<FILES; i++) {
+      sprintf(fn, "%s/f%d-%d", dir, r-KEEP, i);
+      file_data(r-KEEP, i, data);
+      int fd = File_Open(fn);
+      if(fd < 0 || File_Read(fd, back, MAX_BYTES) != file_bytes(r-KEEP, i) ||
+         memcmp(data, back, file_bytes(r-KEEP, i))) errors++;
+      File_Close(fd);
+      if(File_Unlink(fn) < 0) errors++;
+    }
+    double t = now();
+    if(FS_Sync() < 0) errors++;
+    syncs += now()-t;
+  }
+  if(Dir_Unlink(dir) < 0) errors++;
+  double secs = now()-start;
+
+  fprintf(stderr, "%d rounds of %d files of %d-%d bytes, each kept for %d rounds%s\n",
+          ROUNDS, FILES, 100, MAX_BYTES-1, KEEP, log_mode ? " (log-structured)" : "");
+  // create, open, write, close, then open, read, close and unlink of each file
+  fprintf(stderr, "%10.0f ops/s, %.3f ms per sync\n", 8.0*ROUNDS*FILES/secs,
+          syncs*1e3/(ROUNDS+KEEP));
+
+  if(errors) printf("ERROR: %d operations failed\n", errors);
+  else printf("all rounds completed successfully\n");
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync file system to file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system sync'd to file '%s'\n", argv[1]);
+
+  return 0;
+}
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+
+  if(FS_Boot(argv[1]) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system booted from file '%s'\n", argv[1]);
+
+  char* fn = "/trunc-file";
+  char buf[4096], buf2[4096];
+  for(int i=0; i<sizeof(buf); i++) buf[i] = 'a'+i%26;
+
+  printf("\nExpected output: SUCCESS\n");
+  if(File_Create(fn) < 0) printf("ERROR: can't create file '%s'\n", fn);
+  else printf("file '%s' created successfully\n", fn);
+  int fd = File_Open(fn);
+  if(File_Write(fd, buf, 3000) != 3000)
+    printf("ERROR: can't write 3000 bytes to fd=%d for file='%s'\n", fd, fn);
+  else printf("successfully wrote 3000 bytes to fd=%d for file='%s'\n", fd, fn);
+
+  printf("\nExpected output: SUCCESS\n");
+  if(File_Truncate(fd, 700) < 0)
+    printf("ERROR: can't truncate fd=%d for file='%s' to 700 bytes\n", fd, fn);
+  else printf("successfully truncated fd=%d for file='%s' to 700 bytes\n", fd, fn);
+
+  printf("\nExpected output: SUCCESS\n");
+  File_Close(fd);
+  fd = File_Open(fn);
+  int sz = File_Read(fd, buf2, sizeof(buf2));
+  if(sz != 700 || memcmp(buf, buf2, 700))
+    printf("ERROR: read %d bytes from truncated file '%s'\n", sz, fn);
+  else printf("successfully read %d bytes from truncated file '%s'\n", sz, fn);
+
+  printf("\nExpected output: ERROR\n");
+  if(File_Truncate(fd, 100000) < 0)
+    printf("ERROR: can't truncate fd=%d for file='%s' to 100000 bytes\n", fd, fn);
+  else printf("successfully truncated fd=%d for file='%s' to 100000 bytes\n", fd, fn);
+
+  printf("\nExpected output: SUCCESS\n");
+  if(File_Truncate(fd, 1500) < 0)
+    printf("ERROR: can't extend fd=%d for file='%s' to 1500 bytes\n", fd, fn);
+  else {
+    File_Seek(fd, 0);
+    sz = File_Read(fd, buf2, sizeof(buf2));
+    int zeros = 0;
+    for(int i=700; i<sz; i++) zeros += (buf2[i] == 0);
+    if(sz != 1500 || memcmp(buf, buf2, 700) || zeros != 800)
+      printf("ERROR: extended file '%s' reads back wrong (size=%d)\n", fn, sz);
+    else printf("successfully extended file '%s' to %d bytes with a zero tail\n", fn, sz);
+  }
+
+  printf("\nExpected output: SUCCESS\n");
+  if(File_Truncate(fd, 0) < 0)
+    printf("ERROR: can't truncate fd=%d for file='%s' to 0 bytes\n", fd, fn);
+  else if(File_Write(fd, buf, 1000) != 1000)
+    printf("ERROR: can't write 1000 bytes after truncating file='%s'\n", fn);
+  else printf("successfully truncated and rewrote file='%s'\n", fn);
+  File_Close(fd);
+
+  // sparse file: data at 0 and at 10000, everything in between a hole
+  char* sparse = "/sparse-file";
+  printf("\nExpected output: SUCCESS\n");
+  File_Create(sparse);
+  fd = File_Open(sparse);
+  if(File_Write(fd, buf, 100) != 100 || File_Seek(fd, 10000) < 0 ||
+     File_Write(fd, buf, 100) != 100)
+    printf("ERROR: can't write sparse file '%s'\n", sparse);
+  else printf("successfully wrote sparse file '%s'\n", sparse);
+
+  printf("\nExpected output: SUCCESS\n");
+  File_Close(fd);
+  fd = File_Open(sparse);
+  char big[16*1024];
+  sz = File_Read(fd, big, sizeof(big));
+  int holes = 0;
+  for(int i=100; i<10000; i++) holes += (big[i] == 0);
+  if(sz != 10100 || memcmp(big, buf, 100) || memcmp(big+10000, buf, 100) || holes != 9900)
+    printf("ERROR: sparse file '%s' reads back wrong (size=%d)\n", sparse, sz);
+  else printf("successfully read sparse file '%s' of %d bytes\n", sparse, sz);
+
+  printf("\nExpected output: SUCCESS\n");
+  if(File_Seek(fd, 12000) < 0 || File_Write(fd, buf, 10) != 10)
+    printf("ERROR: can't extend sparse file '%s'\n", sparse);
+  else {
+    File_Seek(fd, 10000);
+    sz = File_Read(fd, big, sizeof(big));
+    holes = 0;
+    for(int i=100; i<2000; i++) holes += (big[i] == 0);
+    if(sz != 2010 || memcmp(big, buf, 100) || holes != 1900 || memcmp(big+2000, buf, 10))
+      printf("ERROR: extended sparse file '%s' reads back wrong (size=%d)\n", sparse, sz);
+    else printf("successfully extended sparse file '%s' past its end\n", sparse);
+  }
+  File_Close(fd);
+
+  printf("\nExpected output: SUCCESS\n");
+  if(File_Unlink(sparse) < 0) printf("ERROR: can't unlink file '%s'\n", sparse);
+  else printf("file '%s' unlinked successfully\n", sparse);
+
+  // cloned file: shares the sectors of the original until written
+  char* orig = "/orig-file";
+  char* copy = "/copy-file";
+  printf("\nExpected output: SUCCESS\n");
+  File_Create(orig);
+  fd = File_Open(orig);
+  File_Write(fd, buf, 1000);
+  File_Close(fd);
+  if(File_Clone(orig, copy) < 0) printf("ERROR: can't clone file '%s' to '%s'\n", orig, copy);
+  else printf("file '%s' cloned to '%s' successfully\n", orig, copy);
+
+  printf("\nExpected output: ERROR\n");
+  if(File_Clone(orig, copy) < 0) printf("ERROR: can't clone file '%s' to '%s'\n", orig, copy);
+  else printf("file '%s' cloned to '%s' successfully\n", orig, copy);
+
+  printf("\nExpected output: SUCCESS\n");
+  FS_FILE* stream = FS_fopen(copy, "a");
+  FS_fwrite(stream, "appended to the clone", 21);
+  FS_fclose(stream);
+  fd = File_Open(copy);
+  File_Truncate(fd, 300);
+  File_Close(fd);
+  fd = File_Open(orig);
+  sz = File_Read(fd, big, sizeof(big));
+  File_Close(fd);
+  if(sz != 1000 || memcmp(big, buf, 1000))
+    printf("ERROR: original '%s' changed by writes to its clone (size=%d)\n", orig, sz);
+  else printf("successfully kept '%s' intact while writing its clone\n", orig);
+
+  printf("\nExpected output: SUCCESS\n");
+  File_Unlink(orig);
+  fd = File_Open(copy);
+  sz = File_Read(fd, big, sizeof(big));
+  File_Close(fd);
+  if(sz != 300 || memcmp(big, buf, 300))
+    printf("ERROR: clone '%s' reads back wrong (size=%d)\n", copy, sz);
+  else printf("successfully read clone '%s' after unlinking the original\n", copy);
+  File_Unlink(copy);
+
+  // shared file: two fds on one file, each with its own position
+  char* shared = "/shared-file";
+  printf("\nExpected output: SUCCESS\n");
+  File_Create(shared);
+  int fd1 = File_Open(shared);
+  int fd2 = File_Open(shared);
+  if(fd1 < 0 || fd2 < 0 || fd1 == fd2)
+    printf("ERROR: can't open file '%s' twice\n", shared);
+  else printf("file '%s' opened twice as fd=%d and fd=%d\n", shared, fd1, fd2);
+
+  printf("\nExpected output: SUCCESS\n");
+  File_Write(fd1, buf, 2000);
+  sz = File_Read(fd2, big, 1000);
+  int sz2 = File_Read(fd2, big+1000, sizeof(big));
+  if(sz != 1000 || sz2 != 1000 || memcmp(big, buf, 2000))
+    printf("ERROR: fd=%d doesn't see data written through fd=%d\n", fd2, fd1);
+  else printf("successfully read through fd=%d the data written through fd=%d\n", fd2, fd1);
+
+  printf("\nExpected output: SUCCESS\n");
+  if(File_Unlink(shared) < 0) printf("ERROR: can't unlink open file '%s'\n", shared);
+  else printf("open file '%s' unlinked successfully\n", shared);
+
+  printf("\nExpected output: ERROR\n");
+  if(File_Open(shared) < 0) printf("ERROR: can't open unlinked file '%s'\n", shared);
+  else printf("unlinked file '%s' opened\n", shared);
+
+  printf("\nExpected output: SUCCESS\n");
+  File_Seek(fd2, 0);
+  sz = File_Read(fd2, big, sizeof(big));
+  File_Close(fd1);
+  File_Close(fd2);
+  if(sz != 2000 || memcmp(big, buf, 2000))
+    printf("ERROR: unlinked file '%s' reads back wrong (size=%d)\n", shared, sz);
+  else printf("successfully read unlinked file '%s' until its last close\n", shared);
+
+  // many open files: more fds than the initial size of the fd table
+  printf("\nExpected output: SUCCESS\n");
+  static int fds[1000];
+  int opened = 0;
+  File_Create(shared);
+  while(opened < 1000 && (fds[opened] = File_Open(shared)) >= 0) opened++;
+  int closed = 0;
+  for(int i=0; i<opened; i++) closed += (File_Close(fds[i]) == 0);
+  if(opened != 1000 || closed != 1000)
+    printf("ERROR: opened %d and closed %d fds on file '%s'\n", opened, closed, shared);
+  else printf("successfully opened and closed %d fds on file '%s'\n", opened, shared);
+  File_Unlink(shared);
+
+  // vectored i/o: header and payload records written as one operation
+  char* records = "/record-file";
+  char hdr[8] = "HEADER:";
+  printf("\nExpected output: SUCCESS\n");
+  File_Create(records);
+  fd = File_Open(records);
+  fs_iovec_t wv[4] = { { hdr, 8 }, { buf, 700 }, { hdr, 8 }, { buf+700, 300 } };
+  if(File_WriteV(fd, wv, 4) != 1016)
+    printf("ERROR: can't write vector to fd=%d for file='%s'\n", fd, records);
+  else printf("successfully wrote vector of 1016 bytes to fd=%d for file='%s'\n", fd, records);
+
+  printf("\nExpected output: SUCCESS\n");
+  char h1[8], h2[8];
+  File_Seek(fd, 0);
+  fs_iovec_t rv[4] = { { h1, 8 }, { big, 700 }, { h2, 8 }, { big+700, 1000 } };
+  sz = File_ReadV(fd, rv, 4);
+  if(sz != 1016 || strcmp(h1, hdr) || strcmp(h2, hdr) || memcmp(big, buf, 1000))
+    printf("ERROR: vector read from fd=%d reads back wrong (size=%d)\n", fd, sz);
+  else printf("successfully read vector of %d bytes from fd=%d\n", sz, fd);
+
+  printf("\nExpected output: ERROR\n");
+  fs_iovec_t huge[2] = { { big, sizeof(big) }, { big, sizeof(big) } };
+  if(File_WriteV(fd, huge, 2) < 0)
+    printf("ERROR: can't write vector past the max file size to fd=%d\n", fd);
+  else printf("successfully wrote vector past the max file size to fd=%d\n", fd);
+  File_Close(fd);
+  File_Unlink(records);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync file system to file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system sync'd to file '%s'\n", argv[1]);
+
+  return 0;
+}
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibFS.h"
+
+// the thin client of the file system daemon (see fsd): runs the
+// commands of the slow-* tools on the file system fsd serves, and
+// prints what they print; with '-' instead of a command, the commands
+// are read from stdin, one per line, and all sent at once (while the
+// answers come back), so they make a single batch; return -1 if any
+// of the commands failed
+
+#define MAX_LINE 512
+#define BLOCK 512
+#define MAX_BYTES (MAX_SECTORS_PER_FILE*BLOCK) // the largest file
+
+void usage(char *prog)
+{
+  printf("USAGE: %s socket command [args]\n", prog);
+  printf("       %s socket -    (commands from stdin, one per line)\n", prog);
+  printf("commands: ls dir, mkdir dir, rmdir dir, touch file, rm file, cat file,\n"
+         "          mv from to, import file from_unix_file, export file to_unix_file,\n"
+         "          fsck, sync, shutdown\n");
+  exit(1);
+}
+
+typedef struct {
+  char cmd[16];
+  char path[MAX_LINE];
+  char host[MAX_LINE]; // the unix file of an import or export, or where mv moves to
+} command_t;
+
+// the requests, sent by a thread of their own while the answers are read
+typedef struct {
+  int fd;
+  char* data;
+  int size;
+} request_t;
+
+static void* sender(void* arg)
+{
+  request_t* r = (request_t*)arg;
+  for(int n=0; n<r->size; ) {
+    int k = write(r->fd, r->data+n, r->size-n);
+    if(k <= 0) break;
+    n += k;
+  }
+  shutdown(r->fd, SHUT_WR); // the end of the batch
+  return NULL;
+}
+
+static void append(request_t* r, char* data, int size)
+{
+  r->data = realloc(r->data, r->size+size);
+  if(!r->data) { printf("ERROR: out of memory\n"); exit(1); }
+  memcpy(r->data+r->size, data, size);
+  r->size += size;
+}
+
+// parse a command line; return 0 if it makes sense, -1 otherwise
+static int parse(char* line, command_t* c)
+{
+  char extra[MAX_LINE];
+  c->path[0] = c->host[0] = '\0';
+  int args = sscanf(line, "%15s %511s %511s %511s", c->cmd, c->path, c->host, extra);
+  if(args < 1) return -1;
+  if(!strcmp(c->cmd, "fsck") || !strcmp(c->cmd, "sync") || !strcmp(c->cmd, "shutdown"))
+    return (args == 1) ? 0 : -1;
+  if(!strcmp(c->cmd, "import") || !strcmp(c->cmd, "export") || !strcmp(c->cmd, "mv"))
+    return (args == 3) ? 0 : -1;
+  if(!strcmp(c->cmd, "ls") || !strcmp(c->cmd, "mkdir") || !strcmp(c->cmd, "rmdir") ||
+     !strcmp(c->cmd, "touch") || !strcmp(c->cmd, "rm") || !strcmp(c->cmd, "cat"))
+    return (args == 2) ? 0 : -1;
+  return -1;
+}
+
+// add the request of a command; an import carries the unix file along
+static void request(request_t* r, command_t* c)
+{
+  char line[3*MAX_LINE];
+  if(!strcmp(c->cmd, "import")) {
+    // a unix file that can't be read gets a request that fails
+    FILE* f = fopen(c->host, "rb");
+    char* data = NULL;
+    int size = -1;
+    if(f) {
+      fseek(f, 0, SEEK_END);
+      size = ftell(f);
+      fseek(f, 0, SEEK_SET);
+      data = malloc(size+1);
+      if(!data || fread(data, 1, size, f) != size) size = -1;
+      fclose(f);
+    }
+    append(r, line, sprintf(line, "import %s %d\n", c->path, size));
+    if(size > 0) append(r, data, size);
+    free(data);
+  } else if(!strcmp(c->cmd, "export"))
+    append(r, line, sprintf(line, "cat %s\n", c->path));
+  else if(!strcmp(c->cmd, "mv"))
+    append(r, line, sprintf(line, "mv %s %s\n", c->path, c->host));
+  else append(r, line, sprintf(line, "%s %s\n", c->cmd, c->path));
+}
+
+// print the answer to a command like the slow-* tool would; return 0
+// if the command succeeded, -1 otherwise
+static int report(command_t* c, int ok, int err, char* data, int size)
+{
+  char* what = c->path;
+  if(!strcmp(c->cmd, "ls")) {
+    if(!ok) printf("ERROR: can't list '%s' (error %d)\n", what, err);
+    else if(size == 0) printf("directory '%s': empty\n", what);
+    else {
+      printf("directory '%s':\n     %-15s\t%-s\n", what, "NAME", "INODE");
+      for(int i=0; i*20<size; i++)
+        printf("%-4d %-15s\t%-d\n", i, &data[i*20], *(int*)&data[i*20+16]);
+    }
+  } else if(!strcmp(c->cmd, "mkdir")) {
+    if(!ok) printf("ERROR: can't create directory '%s' (error %d)\n", what, err);
+    else printf("directory '%s' created successfully\n", what);
+  } else if(!strcmp(c->cmd, "rmdir")) {
+    if(!ok) printf("ERROR: can't remove directory '%s' (error %d)\n", what, err);
+    else printf("directory '%s' removed successfully\n", what);
+  } else if(!strcmp(c->cmd, "touch")) {
+    if(!ok) printf("ERROR: can't create file '%s' (error %d)\n", what, err);
+    else printf("file '%s' created successfully\n", what);
+  } else if(!strcmp(c->cmd, "rm")) {
+    if(!ok) printf("ERROR: can't remove file '%s' (error %d)\n", what, err);
+    else printf("file '%s' removed successfully\n", what);
+  } else if(!strcmp(c->cmd, "mv")) {
+    if(!ok) printf("ERROR: can't move '%s' to '%s' (error %d)\n", what, c->host, err);
+    else printf("'%s' moved to '%s' successfully\n", what, c->host);
+  } else if(!strcmp(c->cmd, "cat")) {
+    if(!ok) printf("ERROR: can't open file '%s' (error %d)\n", what, err);
+    else fwrite(data, 1, size, stdout);
+  } else if(!strcmp(c->cmd, "import")) {
+    if(!ok) printf("ERROR: can't import file '%s' into '%s' (error %d)\n", c->host, what, err);
+  } else if(!strcmp(c->cmd, "export")) {
+    FILE* f = ok ? fopen(c->host, "wb") : NULL;
+    if(f && fwrite(data, 1, size, f) != size) ok = 0;
+    if(f && fclose(f)) ok = 0;
+    if(!f || !ok) printf("ERROR: can't export file '%s' to '%s'\n", what, c->host);
+  } else if(!strcmp(c->cmd, "fsck")) {
+    if(!ok) printf("ERROR: can't check file system (error %d)\n", err);
+    else fwrite(data, 1, size, stdout);
+  } else if(!ok) printf("ERROR: can't %s (error %d)\n", c->cmd, err);
+  return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 3) usage(argv[0]);
+  command_t* cmds = NULL;
+  int ncmds = 0;
+  char line[MAX_LINE];
+  if(argc == 3 && !strcmp(argv[2], "-")) {
+    while(fgets(line, MAX_LINE, stdin)) {
+      command_t c;
+      if(strspn(line, " \t\r\n") == strlen(line)) continue;
+      if(parse(line, &c) < 0) {
+        printf("ERROR: bad command: %s", line);
+        return -1;
+      }
+      cmds = realloc(cmds, (ncmds+1)*sizeof(command_t));
+      if(!cmds) { printf("ERROR: out of memory\n"); return -1; }
+      cmds[ncmds++] = c;
+    }
+  } else {
+    line[0] = '\0';
+    for(int i=2; i<argc; i++) {
+      if(strlen(line)+strlen(argv[i])+2 > MAX_LINE) usage(argv[0]);
+      strcat(line, argv[i]);
+      strcat(line, " ");
+    }
+    cmds = malloc(sizeof(command_t));
+    if(!cmds || parse(line, &cmds[0]) < 0) usage(argv[0]);
+    ncmds = 1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path)-1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    printf("ERROR: can't connect to the file system daemon at '%s'\n", argv[1]);
+    return -1;
+  }
+
+  request_t r = { fd, NULL, 0 };
+  for(int i=0; i<ncmds; i++) request(&r, &cmds[i]);
+  pthread_t t;
+  if(pthread_create(&t, NULL, sender, &r)) {
+    printf("ERROR: can't send the commands\n");
+    return -1;
+  }
+
+  FILE* in = fdopen(fd, "r");
+  char* data = malloc(MAX_BYTES+MAX_LINE);
+  int failed = 0;
+  for(int i=0; i<ncmds; i++) {
+    int n = 0;
+    if(!in || !data || !fgets(line, MAX_LINE, in)) {
+      printf("ERROR: the file system daemon hung up\n");
+      failed += ncmds-i;
+      break;
+    }
+    int ok = (sscanf(line, "OK %d", &n) == 1);
+    int err = -1;
+    if(!ok) sscanf(line, "ERR %d", &err);
+    if(n < 0 || n > MAX_BYTES+MAX_LINE || fread(data, 1, n, in) != n) {
+      printf("ERROR: bad answer from the file system daemon\n");
+      failed += ncmds-i;
+      break;
+    }
+    if(report(&cmds[i], ok, err, data, n) < 0) failed++;
+  }
+  pthread_join(t, NULL);
+  if(in) fclose(in);
+  free(data);
+  free(r.data);
+  free(cmds);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibFS.h"
+
+// the file system daemon: mounts a disk image once and serves the
+// commands of the slow-* tools (see fsc) over a Unix-domain socket,
+// so each command costs what the operation costs rather than loading
+// and saving the whole image; the caches stay warm between commands
+//
+// a client sends commands, one per line, without waiting for the
+// answers; 'import' is followed by the bytes of the file:
+//   ls <dir>, mkdir <dir>, rmdir <dir>, touch <file>, rm <file>,
+//   mv <from> <to>, cat <file>, import <file> <size>, fsck, sync,
+//   shutdown
+// each command gets an answer, in order: "OK <size>" followed by that
+// many bytes (the directory entries, the file, or the fsck report), or
+// "ERR <osErrno>"
+//
+// the commands a client sent at once make a batch; with the 'batch'
+// sync policy (the default), the file system is synced at the end of a
+// batch that changed it, before the answers go out, so an answer means
+// the change is on disk, and the batches of several clients share a
+// commit; with an interval in milliseconds, the background flusher
+// writes back instead, and answers go out at once; with 'none', only
+// the 'sync' and 'shutdown' commands and SIGINT or SIGTERM sync
+
+#define MAX_LINE 512
+#define BLOCK 512
+#define MAX_BYTES (MAX_SECTORS_PER_FILE*BLOCK) // the largest file
+#define IN_SIZE 8192
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-r] [-s batch|none|interval_ms] disk [socket]\n", prog);
+  printf("       (the socket defaults to '<disk>.sock'; -r mounts read-only)\n");
+  exit(1);
+}
+
+static fs_t* fs;
+static int sync_batch = 1;
+static int listen_fd = -1;
+static int stopping; // set by a 'shutdown' command, SIGINT or SIGTERM
+
+// the clients connected, waited for before unmounting
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_done = PTHREAD_COND_INITIALIZER;
+static int conns;
+
+// a connection, with its input and the answers of the batch
+typedef struct {
+  int fd;
+  char in[IN_SIZE];
+  int in_pos, in_len;
+  char* out;
+  int out_len, out_size;
+  int dirty; // the batch changed the file system
+} conn_t;
+
+static int conn_send(conn_t* c)
+{
+  for(int n=0; n<c->out_len; ) {
+    int k = write(c->fd, c->out+n, c->out_len-n);
+    if(k < 0 && errno == EINTR) continue;
+    if(k <= 0) return -1;
+    n += k;
+  }
+  c->out_len = 0;
+  return 0;
+}
+
+// the end of a batch, when the client has sent nothing more yet: sync
+// (if the policy says so), then send the answers
+static int conn_end_batch(conn_t* c)
+{
+  if(c->dirty && sync_batch && FS_Sync_r(fs) < 0)
+    fprintf(stderr, "fsd: can't sync (error %d)\n", osErrno);
+  c->dirty = 0;
+  return conn_send(c);
+}
+
+// get more input, ending the batch first if none is there yet; return
+// the bytes read, 0 at the end
+static int conn_fill(conn_t* c)
+{
+  struct pollfd p = { c->fd, POLLIN, 0 };
+  if(poll(&p, 1, 0) == 0 && conn_end_batch(c) < 0) return 0;
+  int k;
+  do k = read(c->fd, c->in, IN_SIZE); while(k < 0 && errno == EINTR);
+  c->in_pos = 0;
+  c->in_len = (k > 0) ? k : 0;
+  return c->in_len;
+}
+
+// read a line (without its newline); return -1 at the end
+static int conn_getline(conn_t* c, char* line)
+{
+  int n = 0;
+  for(;;) {
+    if(c->in_pos == c->in_len && !conn_fill(c)) return -1;
+    char ch = c->in[c->in_pos++];
+    if(ch == '\n') break;
+    if(n < MAX_LINE-1) line[n++] = ch;
+  }
+  line[n] = '\0';
+  return n;
+}
+
+static int conn_read(conn_t* c, char* buf, int size)
+{
+  for(int n=0; n<size; ) {
+    if(c->in_pos == c->in_len && !conn_fill(c)) return -1;
+    int k = c->in_len-c->in_pos;
+    if(k > size-n) k = size-n;
+    if(buf) memcpy(buf+n, c->in+c->in_pos, k);
+    c->in_pos += k;
+    n += k;
+  }
+  return 0;
+}
+
+static void conn_put(conn_t* c, void* data, int size)
+{
+  if(c->out_len+size > c->out_size) {
+    int grow = 2*c->out_size+size;
+    char* out = realloc(c->out, grow);
+    if(!out) { fprintf(stderr, "fsd: out of memory\n"); exit(1); }
+    c->out = out;
+    c->out_size = grow;
+  }
+  memcpy(c->out+c->out_len, data, size);
+  c->out_len += size;
+}
+
+static void answer(conn_t* c, int ret, void* data, int size)
+{
+  char head[32];
+  if(ret < 0) {
+    conn_put(c, head, sprintf(head, "ERR %d\n", osErrno));
+    return;
+  }
+  conn_put(c, head, sprintf(head, "OK %d\n", size));
+  if(size > 0) conn_put(c, data, size);
+}
+
+static int cat(char* path, char* buf)
+{
+  int fd = File_Open_r(fs, path);
+  if(fd < 0) return -1;
+  int size = File_Read_r(fs, fd, buf, MAX_BYTES);
+  File_Close_r(fs, fd);
+  return size;
+}
+
+// replace the content of file 'path' (created if need be)
+static int import(char* path, char* data, int size)
+{
+  if(File_Create_r(fs, path) < 0 && osErrno != E_CREATE) return -1;
+  int fd = File_Open_r(fs, path);
+  if(fd < 0) return -1;
+  int ret = File_Truncate_r(fs, fd, 0);
+  if(ret == 0 && File_Write_r(fs, fd, data, size) != size) ret = -1;
+  File_Close_r(fs, fd);
+  return ret;
+}
+
+// move a file, or else a directory
+static int move(char* from, char* to)
+{
+  int ret = File_Rename_r(fs, from, to);
+  if(ret < 0 && osErrno == E_NO_SUCH_FILE) ret = Dir_Rename_r(fs, from, to);
+  return ret;
+}
+
+static int fsck(char* buf)
+{
+  fs_check_t r;
+  int problems = FS_Check_r(fs, 0, &r);
+  if(problems < 0) return -1;
+  return sprintf(buf, "%d files, %d directories, %d data sectors in use\n"
+                 "%d bad entries, %d bad sectors, %d lost inodes, %d unmarked inodes, "
+                 "%d lost sectors, %d unmarked sectors, %d bad refcounts\n%d problems\n",
+                 r.files, r.dirs, r.sectors, r.bad_entries, r.bad_sectors,
+                 r.lost_inodes, r.unmarked_inodes, r.lost_sectors, r.unmarked_sectors,
+                 r.bad_refcounts, problems);
+}
+
+static void stop()
+{
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+  shutdown(listen_fd, SHUT_RDWR); // wakes up accept()
+}
+
+// run the commands of a client; return -1 once it's gone
+static int serve(conn_t* c, char* buf)
+{
+  char line[MAX_LINE], cmd[MAX_LINE], path[MAX_LINE], to[MAX_LINE];
+  if(conn_getline(c, line) < 0) return -1;
+  int size = 0, ret;
+  int args = sscanf(line, "%s %s %d", cmd, path, &size);
+  if(args < 1) return 0; // blank line
+  if(args < 2) path[0] = '\0';
+
+  if(!strcmp(cmd, "ls")) {
+    size = Dir_Size_r(fs, path);
+    ret = (size > 0) ? Dir_Read_r(fs, path, buf, size) : size;
+    answer(c, ret, buf, (ret > 0) ? size : 0);
+  } else if(!strcmp(cmd, "cat")) {
+    ret = cat(path, buf);
+    answer(c, ret, buf, ret);
+  } else if(!strcmp(cmd, "import") && args == 3 && size >= 0) {
+    // the bytes come along whether the import can be done or not
+    if(conn_read(c, (size <= MAX_BYTES) ? buf : NULL, size) < 0) return -1;
+    if(size > MAX_BYTES) { osErrno = E_FILE_TOO_BIG; ret = -1; }
+    else ret = import(path, buf, size);
+    c->dirty = 1;
+    answer(c, ret, NULL, 0);
+  } else if(!strcmp(cmd, "mkdir") || !strcmp(cmd, "rmdir") ||
+            !strcmp(cmd, "touch") || !strcmp(cmd, "rm")) {
+    if(!strcmp(cmd, "mkdir")) ret = Dir_Create_r(fs, path);
+    else if(!strcmp(cmd, "rmdir")) ret = Dir_Unlink_r(fs, path);
+    else if(!strcmp(cmd, "touch")) ret = File_Create_r(fs, path);
+    else ret = File_Unlink_r(fs, path);
+    c->dirty = 1;
+    answer(c, ret, NULL, 0);
+  } else if(!strcmp(cmd, "mv") && sscanf(line, "%*s %*s %s", to) == 1) {
+    ret = move(path, to);
+    c->dirty = 1;
+    answer(c, ret, NULL, 0);
+  } else if(!strcmp(cmd, "fsck")) {
+    ret = fsck(buf);
+    answer(c, ret, buf, ret);
+  } else if(!strcmp(cmd, "sync")) {
+    answer(c, FS_Sync_r(fs), NULL, 0);
+  } else if(!strcmp(cmd, "shutdown")) {
+    answer(c, 0, NULL, 0);
+    stop();
+  } else {
+    osErrno = E_GENERAL;
+    answer(c, -1, NULL, 0);
+  }
+  return 0;
+}
+
+static void* client(void* arg)
+{
+  conn_t* c = (conn_t*)arg;
+  char* buf = malloc(MAX_BYTES+MAX_LINE);
+  while(buf && serve(c, buf) == 0);
+  conn_end_batch(c); // what's left of the last one
+  close(c->fd);
+  free(c->out);
+  free(c);
+  free(buf);
+
+  pthread_mutex_lock(&conns_lock);
+  if(--conns == 0) pthread_cond_signal(&conns_done);
+  pthread_mutex_unlock(&conns_lock);
+  return NULL;
+}
+
+static void on_signal(int sig)
+{
+  stop();
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = NULL, *sockname = NULL;
+  int readonly = 0, interval = 0;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-r")) readonly = 1;
+    else if(!strcmp(argv[i], "-s") && i+1 < argc) {
+      i++;
+      if(!strcmp(argv[i], "none")) sync_batch = 0;
+      else if(strcmp(argv[i], "batch")) {
+        interval = atoi(argv[i]);
+        if(interval <= 0) usage(argv[0]);
+        sync_batch = 0;
+      }
+    } else if(argv[i][0] == '-') usage(argv[0]);
+    else if(!diskfile) diskfile = argv[i];
+    else if(!sockname) sockname = argv[i];
+    else usage(argv[0]);
+  }
+  if(!diskfile) usage(argv[0]);
+  char defname[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  if(!sockname) {
+    snprintf(defname, sizeof(defname), "%s.sock", diskfile);
+    sockname = defname;
+  }
+
+  fs = FS_Mount(diskfile, readonly ? FS_MOUNT_READONLY : FS_MOUNT_MEMORY);
+  if(!fs) {
+    printf("ERROR: can't mount file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  if(interval && FS_FlushSetup_r(fs, interval, 256) < 0) {
+    printf("ERROR: can't set up the flusher\n");
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, sockname, sizeof(addr.sun_path)-1);
+  unlink(sockname);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+     listen(listen_fd, 16) < 0) {
+    printf("ERROR: can't listen on socket '%s'\n", sockname);
+    FS_Unmount(fs);
+    return -2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  fprintf(stderr, "fsd: serving '%s' on '%s'\n", diskfile, sockname);
+
+  while(!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+    conn_t* c = calloc(1, sizeof(conn_t));
+    if(c) c->fd = fd;
+    pthread_t t;
+    pthread_mutex_lock(&conns_lock);
+    conns++;
+    pthread_mutex_unlock(&conns_lock);
+    if(!c || pthread_create(&t, NULL, client, c)) {
+      fprintf(stderr, "fsd: can't serve a client\n");
+      close(fd);
+      free(c);
+      pthread_mutex_lock(&conns_lock);
+      conns--;
+      pthread_mutex_unlock(&conns_lock);
+      continue;
+    }
+    pthread_detach(t);
+  }
+  close(listen_fd);
+  unlink(sockname);
+
+  // the clients still connected finish what they sent, and hang up
+  pthread_mutex_lock(&conns_lock);
+  while(conns > 0) pthread_cond_wait(&conns_done, &conns_lock);
+  pthread_mutex_unlock(&conns_lock);
+  if(FS_Unmount(fs) < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  fprintf(stderr, "fsd: '%s' synced and unmounted\n", diskfile);
+  return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "LibFS.h"
+
+// measures how create, write, read and unlink throughput scales when
+// each thread works on a file system of its own, mounted from a disk
+// image of its own (FS_Mount), so threads share no disk, cache or open
+// file table; each thread mounts '<prefix>-<n>' with the _r calls,
+// works on files of its own, over and over, and checks what it reads
+// back, then unmounts; the images are checked afterwards, mounted
+// read-only; the results go to stderr, so build the library with
+// -DFSDEBUG=0 or send stdout to /dev/null
+
+#define FILES 40      // files per thread per round
+#define ROUNDS 10
+#define FILE_BYTES 1024
+#define MAX_THREADS 8
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_prefix>\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+typedef struct {
+  char image[256];
+  int id;
+  int errors;
+} worker_t;
+
+static void* worker(void* arg)
+{
+  worker_t* w = (worker_t*)arg;
+  char fn[64];
+  char data[FILE_BYTES], back[FILE_BYTES];
+  fs_t* fs = FS_Mount(w->image, FS_MOUNT_MEMORY);
+  if(!fs) { w->errors++; return NULL; }
+
+  for(int r=0; r<ROUNDS; r++) {
+    for(int i=0; i<FILES; i++) {
+      sprintf(fn, "/f%d", i);
+      for(int k=0; k<FILE_BYTES; k++) data[k] = w->id+r+i+k;
+      int fd;
+      if(File_Create_r(fs, fn) < 0 || (fd = File_Open_r(fs, fn)) < 0) { w->errors++; continue; }
+      if(File_Write_r(fs, fd, data, FILE_BYTES) != FILE_BYTES || File_Seek_r(fs, fd, 0) < 0 ||
+         File_Read_r(fs, fd, back, FILE_BYTES) != FILE_BYTES || memcmp(data, back, FILE_BYTES))
+        w->errors++;
+      File_Close_r(fs, fd);
+    }
+    for(int i=0; i<FILES; i++) {
+      sprintf(fn, "/f%d", i);
+      // leave the last round's files for the check
+      if(r < ROUNDS-1 && File_Unlink_r(fs, fn) < 0) w->errors++;
+    }
+  }
+  if(FS_Unmount(fs) < 0) w->errors++;
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+
+  pthread_t threads[MAX_THREADS];
+  worker_t workers[MAX_THREADS];
+  int errors = 0;
+  fprintf(stderr, "%d files of %d bytes per thread, %d rounds, a file system per thread\n",
+          FILES, FILE_BYTES, ROUNDS);
+  fprintf(stderr, "threads      ops/s\n");
+  for(int n=1; n<=MAX_THREADS; n*=2) {
+    double start = now();
+    for(int i=0; i<n; i++) {
+      snprintf(workers[i].image, sizeof(workers[i].image), "%s-%d", argv[1], i);
+      remove(workers[i].image);
+      workers[i].id = i;
+      workers[i].errors = 0;
+      pthread_create(&threads[i], NULL, worker, &workers[i]);
+    }
+    for(int i=0; i<n; i++) {
+      pthread_join(threads[i], NULL);
+      errors += workers[i].errors;
+    }
+    double secs = now()-start;
+    // create, open, write, read, close and unlink of each file
+    fprintf(stderr, "%7d %10.0f\n", n, 6.0*n*FILES*ROUNDS/secs);
+  }
+
+  // each image holds the files of its last round, and nothing else
+  for(int i=0; i<MAX_THREADS; i++) {
+    fs_check_t r;
+    fs_t* fs = FS_Mount(workers[i].image, FS_MOUNT_READONLY);
+    if(!fs || FS_Check_r(fs, 0, &r) != 0 || r.files != FILES ||
+       Dir_Size_r(fs, "/") != FILES*20) { // 20 bytes per directory entry
+      printf("ERROR: file system '%s' is not as left\n", workers[i].image);
+      errors++;
+    }
+    if(fs) FS_Unmount(fs);
+  }
+
+  if(errors) printf("ERROR: %d operations failed\n", errors);
+  else printf("all threads completed successfully\n");
+  return errors ? -1 : 0;
+}
@@ -18,20 +18,20 @@ int main(int argc, char *argv[])
   if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
   else { diskfile = "default-disk"; path = argv[1]; }
 
-  if(FS_Boot(diskfile) < 0) {
+  if(FS_BootReadOnly(diskfile) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
   
-  int fd = File_Open(path);
-  if(fd < 0) {
+  FS_FILE* stream = FS_fopen(path, "r");
+  if(!stream) {
     printf("ERROR: can't open file '%s'\n", path);
     return -2;
   }
 
   char buf[BFSZ+1]; int sz;
   do {
-    sz = File_Read(fd, buf, BFSZ);
+    sz = FS_fread(stream, buf, BFSZ);
     if(sz < 0) {
       printf("ERROR: can't read file '%s'\n", path);
       return -3;
@@ -40,11 +40,7 @@ int main(int argc, char *argv[])
     printf("%s\n", buf);
   } while(sz > 0);
   
-  File_Close(fd);
+  FS_fclose(stream);
   
-  if(FS_Sync() < 0) {
-    printf("ERROR: can't sync disk '%s'\n", diskfile);
-    return -3;
-  }
   return 0;
 }
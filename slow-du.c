@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibFS.h"
+
+// prints the data sectors used under each directory, like du (with -a,
+// for each file too), walking the tree once with FS_Walk()
+
+#define MAX_DEPTH 128
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-a] [disk] path\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+typedef struct {
+  int all;              // print files too
+  int depth;            // of the directory visited, -1 above the path
+  int sums[MAX_DEPTH];  // the sectors of each directory on the way so far
+} du_t;
+
+static int visit(char *path, fs_stat_t *st, int what, void *arg)
+{
+  du_t *du = (du_t*)arg;
+  if(what == FS_WALK_FILE) {
+    if(du->all || du->depth < 0) printf("%d\t%s\n", st->sectors, path);
+    if(du->depth >= 0) du->sums[du->depth] += st->sectors;
+  } else if(what == FS_WALK_DIR) {
+    if(++du->depth >= MAX_DEPTH) return 1;
+    du->sums[du->depth] = st->sectors;
+  } else {
+    printf("%d\t%s\n", du->sums[du->depth], path);
+    if(du->depth > 0) du->sums[du->depth-1] += du->sums[du->depth];
+    du->depth--;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk", *path = NULL;
+  du_t du = { 0, -1 };
+  int i = 1;
+  if(argc > 1 && !strcmp(argv[1], "-a")) { du.all = 1; i++; }
+  if(argc-i != 1 && argc-i != 2) usage(argv[0]);
+  if(argc-i == 2) diskfile = argv[i++];
+  path = argv[i];
+
+  if(FS_BootReadOnly(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  double start = now();
+  int ret = FS_Walk(path, visit, FS_WALK_PRE|FS_WALK_POST, &du);
+  double secs = now()-start;
+  if(ret < 0) {
+    printf("ERROR: can't walk '%s'\n", path);
+    return -2;
+  }
+  if(ret > 0) {
+    printf("ERROR: '%s' nested too deep\n", path);
+    return -3;
+  }
+  fprintf(stderr, "walked in %.3f ms\n", secs*1e3);
+  return 0;
+}
@@ -3,8 +3,6 @@
 #include <string.h>
 #include "LibFS.h"
 
-#define BFSZ 256
-
 void usage(char *prog)
 {
   printf("USAGE: %s [disk] file to_unix_file\n", prog);
@@ -18,44 +16,15 @@ int main(int argc, char *argv[])
   if(argc == 4) { diskfile = argv[1]; path = argv[2]; fname = argv[3]; }
   else { diskfile = "default-disk"; path = argv[1]; fname = argv[2]; }
 
-  if(FS_Boot(diskfile) < 0) {
+  if(FS_BootReadOnly(diskfile) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
   
-  int fd = File_Open(path);
-  if(fd < 0) {
-    printf("ERROR: can't open file '%s'\n", path);
+  if(File_ExportHost(path, fname) < 0) {
+    printf("ERROR: can't export file '%s' to '%s'\n", path, fname);
     return -2;
   }
-
-  FILE* fptr = fopen(fname, "w");
-  if(!fptr) {
-    printf("ERROR: can't open file '%s' to export\n", fname);
-    return -3;
-  }
-
-  char buf[BFSZ]; int sz;
-  do {
-    sz = File_Read(fd, buf, BFSZ);
-    if(sz < 0) {
-      printf("ERROR: can't read file '%s'\n", path);
-      return -4;
-    } else if(sz > 0) {
-      int wsz = fwrite(buf, 1, sz, fptr);
-      if(wsz != sz) {
-	printf("ERROR: can't write file '%s'\n", fname);
-	return -5;
-      }
-    }
-  } while(sz > 0);
-  
-  fclose(fptr);
-  File_Close(fd);
   
-  if(FS_Sync() < 0) {
-    printf("ERROR: can't sync disk '%s'\n", diskfile);
-    return -3;
-  }
   return 0;
 }
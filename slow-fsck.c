@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LibFS.h"
+
+// checks the file system, and repairs it with -r; booting replays what
+// was committed before a crash, so what's left to find is damage
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-r] [disk]\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk";
+  int repair = 0;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-r")) repair = 1;
+    else if(argv[i][0] == '-' || i != argc-1) usage(argv[0]);
+    else diskfile = argv[i];
+  }
+
+  // only a repair writes to the disk
+  if((repair ? FS_Boot(diskfile) : FS_BootReadOnly(diskfile)) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  fs_check_t r;
+  double start = now();
+  int problems = FS_Check(repair, &r);
+  double secs = now()-start;
+  if(problems < 0) {
+    printf("ERROR: can't check file system '%s'\n", diskfile);
+    return -2;
+  }
+  printf("%d files, %d directories, %d data sectors in use\n", r.files, r.dirs, r.sectors);
+  if(r.bad_entries) printf("%d bad directory entries\n", r.bad_entries);
+  if(r.bad_sectors) printf("%d file sectors outside the data blocks\n", r.bad_sectors);
+  if(r.lost_inodes) printf("%d inodes marked used but not reached\n", r.lost_inodes);
+  if(r.unmarked_inodes) printf("%d inodes reached but not marked used\n", r.unmarked_inodes);
+  if(r.lost_sectors) printf("%d sectors marked used but not in use\n", r.lost_sectors);
+  if(r.unmarked_sectors) printf("%d sectors in use but not marked used\n", r.unmarked_sectors);
+  if(r.bad_refcounts) printf("%d wrong sector reference counts\n", r.bad_refcounts);
+  printf("file system '%s': %d problems%s\n", diskfile, problems,
+         (problems && repair) ? " fixed" : "");
+  fprintf(stderr, "checked in %.3f ms\n", secs*1e3);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  // like fsck: 1 if the problems were fixed, 4 if they were left
+  return problems ? (repair ? 1 : 4) : 0;
+}
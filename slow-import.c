@@ -3,8 +3,6 @@
 #include <string.h>
 #include "LibFS.h"
 
-#define BFSZ 1024
-
 void usage(char *prog)
 {
   printf("USAGE: %s [disk] file from_unix_file\n", prog);
@@ -23,43 +21,13 @@ int main(int argc, char *argv[])
     return -1;
   }
   
-/* XXX: Removed action to create file because I'm assuming
-	file should already be created.
-  if(File_Create(path) < 0) {
-    printf("ERROR: can't create file '%s'\n", path);
-    return -2;
-  }*/
-
-  int fd = File_Open(path);
-  if(fd < 0) {
-    printf("ERROR: can't open file '%s'\n", path);
+  // the file is created if it doesn't exist yet; an existing file is
+  // overwritten with the content of the unix file
+  if(File_ImportHost(path, fname) < 0) {
+    printf("ERROR: can't import file '%s' into '%s'\n", fname, path);
     return -2;
   }
   
-  FILE* fptr = fopen(fname, "r");
-  if(!fptr) {
-    printf("ERROR: can't open file '%s' to import\n", fname);
-    return -3;
-  }
-
-  char buf[BFSZ]; 
-  while(!feof(fptr)) {
-    int rsz = fread(buf, 1, BFSZ, fptr);
-    if(rsz < 0) {
-      printf("ERROR: can't read file '%s' to import\n", fname);
-      return -4;
-    } else if(rsz > 0) {
-      int wsz = File_Write(fd, buf, rsz);
-      if(wsz < 0) {
-	printf("ERROR: can't write file '%s'\n", path);
-	return -5;
-      }
-    }
-  }
-
-  fclose(fptr);
-  File_Close(fd);
-  
   if(FS_Sync() < 0) {
     printf("ERROR: can't sync disk '%s'\n", diskfile);
     return -3;
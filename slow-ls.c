@@ -16,7 +16,7 @@ int main(int argc, char *argv[])
   if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
   else { diskfile = "default-disk"; path = argv[1]; }
 
-  if(FS_Boot(diskfile) < 0) {
+  if(FS_BootReadOnly(diskfile) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
@@ -44,9 +44,5 @@ int main(int argc, char *argv[])
   }
   free(buf);
 
-  if(FS_Sync() < 0) {
-    printf("ERROR: can't sync disk '%s'\n", diskfile);
-    return -3;
-  }
   return 0;
 }
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] from to\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *from, *to;
+  if(argc != 3 && argc != 4) usage(argv[0]);
+  if(argc == 4) { diskfile = argv[1]; from = argv[2]; to = argv[3]; }
+  else { diskfile = "default-disk"; from = argv[1]; to = argv[2]; }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  // a file, or else a directory
+  int ret = File_Rename(from, to);
+  if(ret < 0 && osErrno == E_NO_SUCH_FILE) ret = Dir_Rename(from, to);
+  if(ret < 0) {
+    printf("ERROR: can't move '%s' to '%s'\n", from, to);
+    return -2;
+  }
+  printf("'%s' moved to '%s' successfully\n", from, to);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
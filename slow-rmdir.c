@@ -5,23 +5,26 @@
 
 void usage(char *prog)
 {
-  printf("USAGE: %s [disk] dir\n", prog);
+  printf("USAGE: %s [-r] [disk] dir\n", prog);
   exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-  char *diskfile, *path;
-  if(argc != 2 && argc != 3) usage(argv[0]);
-  if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
-  else { diskfile = "default-disk"; path = argv[1]; }
+  char *diskfile = "default-disk", *path = NULL;
+  int recursive = 0; // with -r, what's in the directory goes too
+  int i = 1;
+  if(argc > 1 && !strcmp(argv[1], "-r")) { recursive = 1; i++; }
+  if(argc-i != 1 && argc-i != 2) usage(argv[0]);
+  if(argc-i == 2) diskfile = argv[i++];
+  path = argv[i];
 
   if(FS_Boot(diskfile) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
   
-  if(Dir_Unlink(path) < 0) {
+  if((recursive ? Dir_UnlinkRecursive(path) : Dir_Unlink(path)) < 0) {
     printf("ERROR: can't remove directory '%s'\n", path);
     return -2;
   }
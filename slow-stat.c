@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// prints the inode number, type, size and data sectors of a file or
+// directory, like stat; the inode number opens the file again with
+// File_OpenInode(), without following the path
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] path\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path;
+  if(argc != 2 && argc != 3) usage(argv[0]);
+  if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
+  else { diskfile = "default-disk"; path = argv[1]; }
+
+  if(FS_BootReadOnly(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  fs_stat_t st;
+  if(FS_Stat(path, &st) < 0) {
+    printf("ERROR: can't stat '%s' (error %d)\n", path, osErrno);
+    return -2;
+  }
+  printf("'%s': inode %d, %s, %d bytes, %d data sectors\n", path, st.inode,
+         st.type ? "directory" : "file", st.size, st.sectors);
+  return 0;
+}
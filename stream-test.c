@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+
+  if(FS_Boot(argv[1]) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system booted from file '%s'\n", argv[1]);
+
+  char* fn = "/stream-file";
+  FS_FILE* stream;
+  char line[64];
+
+  printf("\nExpected output: SUCCESS\n");
+  stream = FS_fopen(fn, "w");
+  if(!stream) printf("ERROR: can't open stream on '%s' for writing\n", fn);
+  else printf("stream on '%s' opened for writing\n", fn);
+
+  // many small writes crossing several sector boundaries
+  printf("\nExpected output: SUCCESS\n");
+  int written = 0;
+  for(int i=0; i<500; i++) {
+    sprintf(line, "line %d\n", i);
+    if(FS_fwrite(stream, line, strlen(line)) != strlen(line)) break;
+    written += strlen(line);
+  }
+  if(FS_fclose(stream) < 0) printf("ERROR: can't close stream on '%s'\n", fn);
+  else printf("successfully wrote %d bytes through stream on '%s'\n", written, fn);
+
+  printf("\nExpected output: SUCCESS\n");
+  stream = FS_fopen(fn, "r");
+  FS_setvbuf(stream, 1024);
+  int lines = 0, bad = 0;
+  while(FS_fgets(stream, line, sizeof(line))) {
+    char expect[64];
+    sprintf(expect, "line %d\n", lines);
+    if(strcmp(line, expect)) bad++;
+    lines++;
+  }
+  FS_fclose(stream);
+  if(lines != 500 || bad) printf("ERROR: read back %d lines (%d mismatched)\n", lines, bad);
+  else printf("successfully read back %d lines through stream on '%s'\n", lines, fn);
+
+  printf("\nExpected output: SUCCESS\n");
+  stream = FS_fopen(fn, "a");
+  if(FS_fwrite(stream, "tail\n", 5) != 5 || FS_fclose(stream) < 0)
+    printf("ERROR: can't append to '%s'\n", fn);
+  else {
+    int fd = File_Open(fn);
+    char buf[16*1024];
+    int sz = File_Read(fd, buf, sizeof(buf));
+    File_Close(fd);
+    if(sz != written+5 || memcmp(buf+written, "tail\n", 5))
+      printf("ERROR: appended data not found in '%s' (size=%d)\n", fn, sz);
+    else printf("successfully appended to '%s', size=%d\n", fn, sz);
+  }
+
+  printf("\nExpected output: SUCCESS\n");
+  stream = FS_fopen(fn, "w");
+  if(FS_fwrite(stream, "short\n", 6) != 6 || FS_fclose(stream) < 0)
+    printf("ERROR: can't rewrite '%s'\n", fn);
+  else {
+    stream = FS_fopen(fn, "r");
+    int sz = FS_fread(stream, line, sizeof(line));
+    FS_fclose(stream);
+    if(sz != 6) printf("ERROR: rewritten '%s' has %d bytes\n", fn, sz);
+    else printf("successfully rewrote '%s'\n", fn);
+  }
+
+  printf("\nExpected output: ERROR\n");
+  stream = FS_fopen("/no-such-file", "r");
+  if(!stream) printf("ERROR: can't open stream on '/no-such-file'\n");
+  else printf("stream on '/no-such-file' opened\n");
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync file system to file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system sync'd to file '%s'\n", argv[1]);
+
+  return 0;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "LibFS.h"
+
+// measures how create, write, read and unlink throughput scales with
+// the number of threads calling the library at the same time; each
+// thread works on files of its own directory, over and over, and
+// checks what it reads back; with the 'alloc' option, each thread
+// instead fills and truncates a file of its own, which measures how
+// fast sectors are allocated and given back; with the 'flush' option,
+// the background flusher runs meanwhile, which leaves less for the
+// final sync; the results go to stderr, so build the library with
+// -DFSDEBUG=0 or send stdout to /dev/null
+
+#define FILES 40      // files per thread per round
+#define ROUNDS 10
+#define FILE_BYTES 1024
+#define MAX_THREADS 8
+#define BLOCK 512
+#define ALLOC_ROUNDS 200
+#define FLUSH_INTERVAL 20   // ms
+#define FLUSH_THRESHOLD 256 // sectors
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file> [alloc|flush]\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+typedef struct {
+  int id;
+  int nthreads;
+  int errors;
+} worker_t;
+
+static void* worker(void* arg)
+{
+  worker_t* w = (worker_t*)arg;
+  char dir[32], fn[64];
+  char data[FILE_BYTES], back[FILE_BYTES];
+  sprintf(dir, "/t%d-%d", w->nthreads, w->id);
+  if(Dir_Create(dir) < 0) { w->errors++; return NULL; }
+
+  for(int r=0; r<ROUNDS; r++) {
+    for(int i=0; i<FILES; i++) {
+      sprintf(fn, "%s/f%d", dir, i);
+      for(int k=0; k<FILE_BYTES; k++) data[k] = w->id+r+i+k;
+      fs_iovec_t wv = { data, FILE_BYTES }, rv = { back, FILE_BYTES };
+      int fd;
+      if(File_Create(fn) < 0 || (fd = File_Open(fn)) < 0) { w->errors++; continue; }
+      if(File_WriteV(fd, &wv, 1) != FILE_BYTES || File_Seek(fd, 0) < 0 ||
+         File_ReadV(fd, &rv, 1) != FILE_BYTES || memcmp(data, back, FILE_BYTES))
+        w->errors++;
+      File_Close(fd);
+    }
+    for(int i=0; i<FILES; i++) {
+      sprintf(fn, "%s/f%d", dir, i);
+      if(File_Unlink(fn) < 0) w->errors++;
+    }
+  }
+  if(Dir_Unlink(dir) < 0) w->errors++;
+  return NULL;
+}
+
+// write the whole file, which allocates all of its sectors, and
+// truncate it, which gives them back, over and over
+static void* alloc_worker(void* arg)
+{
+  worker_t* w = (worker_t*)arg;
+  char fn[32];
+  static char data[MAX_SECTORS_PER_FILE*BLOCK];
+  sprintf(fn, "/a%d-%d", w->nthreads, w->id);
+  int fd;
+  if(File_Create(fn) < 0 || (fd = File_Open(fn)) < 0) { w->errors++; return NULL; }
+  fs_iovec_t iov = { data, sizeof(data) };
+  for(int r=0; r<ALLOC_ROUNDS; r++) {
+    if(File_Seek(fd, 0) < 0 || File_WriteV(fd, &iov, 1) != sizeof(data) ||
+       File_Truncate(fd, 0) < 0) w->errors++;
+  }
+  File_Close(fd);
+  if(File_Unlink(fn) < 0) w->errors++;
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2 && argc != 3) usage(argv[0]);
+  int alloc = (argc == 3 && !strcmp(argv[2], "alloc"));
+  int flush = (argc == 3 && !strcmp(argv[2], "flush"));
+  if(argc == 3 && !alloc && !flush) usage(argv[0]);
+
+  if(FS_Boot(argv[1]) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system booted from file '%s'\n", argv[1]);
+
+  if(flush && FS_FlushSetup(FLUSH_INTERVAL, FLUSH_THRESHOLD) < 0) {
+    printf("ERROR: can't set up the flusher\n");
+    return -1;
+  }
+
+  pthread_t threads[MAX_THREADS];
+  worker_t workers[MAX_THREADS];
+  int errors = 0;
+  if(alloc) {
+    fprintf(stderr, "%d sectors allocated and freed per thread, %d rounds\n",
+            MAX_SECTORS_PER_FILE, ALLOC_ROUNDS);
+    fprintf(stderr, "threads  sectors/s\n");
+  } else {
+    fprintf(stderr, "%d files of %d bytes per thread, %d rounds\n", FILES, FILE_BYTES, ROUNDS);
+    fprintf(stderr, "threads      ops/s\n");
+  }
+  for(int n=1; n<=MAX_THREADS; n*=2) {
+    double start = now();
+    for(int i=0; i<n; i++) {
+      workers[i].id = i;
+      workers[i].nthreads = n;
+      workers[i].errors = 0;
+      pthread_create(&threads[i], NULL, alloc ? alloc_worker : worker, &workers[i]);
+    }
+    for(int i=0; i<n; i++) {
+      pthread_join(threads[i], NULL);
+      errors += workers[i].errors;
+    }
+    double secs = now()-start;
+    if(alloc) fprintf(stderr, "%7d %10.0f\n", n, 1.0*n*MAX_SECTORS_PER_FILE*ALLOC_ROUNDS/secs);
+    // create, open, write, read, close and unlink of each file
+    else fprintf(stderr, "%7d %10.0f\n", n, 6.0*n*FILES*ROUNDS/secs);
+  }
+
+  if(errors) printf("ERROR: %d operations failed\n", errors);
+  else printf("all threads completed successfully\n");
+
+  if(Dir_Size("/") != 0) printf("ERROR: root directory not empty after the run\n");
+
+  double start = now();
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync file system to file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system sync'd to file '%s'\n", argv[1]);
+  fprintf(stderr, "final sync took %.3f ms\n", (now()-start)*1e3);
+  FS_FlushTeardown();
+
+  return 0;
+}